@@ -1,12 +1,29 @@
 #ifdef _WIN32
 #include <windows.h> //import windows.h to change console color
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <dirent.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #endif
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <limits.h>
+#include "kernel.h"
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(KERNEL_NO_SIMD)
+#define X86_SIMD
+#include <immintrin.h>
+#endif
 
 //color codes
 #define RED 31
@@ -23,27 +40,680 @@
 #define MAGIC_NUMBER_SIZE 2
 #define MAX_PIXEL_VAL 255
 #define BRAND_NAME "Besher"
+#define DEFAULT_WORKER_COUNT 1
+#define DEFAULT_THREAD_COUNT 1
+#define MIN_BAND_ROWS 16
+#define DEFAULT_CACHE_SIZE (256 << 10)
+#define TILE_ROWS 64
+#define TILE_MIN_COLUMNS 256
+#define PATH_SEP '/'
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#define SEPARABLE_MIN_SIZE 5
+#define FFT_MIN_SIZE 32
+#define FFT_MAX_SIZE 1024
+#define FFT_MAX_BOUND ((long long) 1 << 26)
+//relative costs (measured on x86) of a tap per pixel of the direct and
+//separable convolutions and of size*size*log2(size) for an FFT tile
+#define SIMD_TAP_COST 1
+#define SCALAR_TAP_COST 4
+#define SEPARABLE_TAP_COST 4
+#define FFT_TILE_COST 24
+//single prewitt gradients computed by applyGradientRows, next to the GRADIENT_ types
+#define PREWITT_VERTICAL 3
+#define PREWITT_HORIZONTAL 4
+//mask algorithms
+#define MASK_DIRECT 0
+#define MASK_SEPARABLE 1
+#define MASK_FFT 2
+#define DEFAULT_WINDOW_SIZE 3
+#define DEFAULT_CANNY_WINDOW_SIZE 5
+#define DEFAULT_CANNY_LOW 40
+#define DEFAULT_CANNY_HIGH 100
+//pixel classes of canny
+#define EDGE_NONE 0
+#define EDGE_WEAK 1
+#define EDGE_STRONG 2
+#define EDGE_TRACED 3
+//tan(22.5 degrees) in 1/32768ths, bounds the gradient direction sectors
+#define TAN_22_5 13573
+//largest prewitt gradient of canny along one axis
+#define MAX_PREWITT_GRADIENT (3*MAX_PIXEL_VAL)
+#define EDGE_STACK_SIZE 1024
+#define HISTOGRAM_MEDIAN_MIN_SIZE 7
+#define HISTOGRAM_BINS 256
+#define HISTOGRAM_COARSE_BINS 16
+#define SEQUENTIAL_HINT_MIN_SIZE (1 << 20)
+#define DEFAULT_OUTPUT_VERSION 2
+#define ASCII_BLOCK_SIZE (1 << 22)
+#define STREAM_BLOCK_ROWS 64
+#define STAGE_NAME_SIZE 16
+#define BENCH_NAME_SIZE 64
+#define DEFAULT_BENCH_SIZES "512,2048"
+#define DEFAULT_BENCH_REPEATS 3
+#define POOL_ALIGNMENT 64
+#define POOL_MIN_SIZE 4096
+#define POOL_MAX_BLOCKS 64
+#define POOL_MAX_BYTES ((size_t) 1 << 28)
+#define PROFILE_DEPTH 8
+//profiled stages, see beginStage
+#define PROFILE_READ 0
+#define PROFILE_FILTER 1
+#define PROFILE_NORMALIZE 2
+#define PROFILE_PAD 3
+#define PROFILE_WRITE 4
+#define PROFILE_OTHER 5
+#define PROFILE_STAGE_COUNT 6
+//profile report formats
+#define PROFILE_REPORT_NONE 0
+#define PROFILE_REPORT_CSV 1
+#define PROFILE_REPORT_JSON 2
 
+/*
+* Struct: mask
+* --------------------------
+*
+* size: the length of kernel dimension
+* matrix: size*size kernel values
+* rowVector, colVector: factors of a separable mask (matrix[i][j] is
+* colVector[i]*rowVector[j]), NULL if unknown
+*/
 typedef struct {
   int size;
   int* matrix;
+  int* rowVector;
+  int* colVector;
 } mask;
 
 /*
-* Struct: kernelSettings
+* Struct: file_list
+* --------------------------
+*
+* count: number of file names in names
+* capacity: number of allocated slots in names
+* names: heap allocated file names
+*/
+typedef struct {
+  int count;
+  int capacity;
+  char** names;
+} file_list;
+
+/*
+* Struct: pgm_map
+* --------------------------
+* a read-only view of a whole file
+*
+* data: first byte of the file
+* length: file size in bytes
+* mapped: true if data is a memory mapping, false if it is a heap buffer
+*/
+typedef struct {
+  uint8_t* data;
+  size_t length;
+  bool mapped;
+} pgm_map;
+
+/*
+* Struct: pgm_reader
+* --------------------------
+* reads the rows of a mapped PGM file in order
+*
+* image: the mapped file
+* fileName: used in error messages
+* version: 2 for ASCII, 5 for binary
+* width, height, maxValue: header values
+* rasterOffset: offset of the first pixel
+* position: offset of the next pixel
+* pixelIndex: index of the next pixel
+* releasedOffset: the pages before this offset have been released
+*/
+typedef struct {
+  pgm_map image;
+  char* fileName;
+  int version;
+  int width;
+  int height;
+  int maxValue;
+  size_t rasterOffset;
+  size_t position;
+  size_t pixelIndex;
+  size_t releasedOffset;
+} pgm_reader;
+
+/*
+* Struct: pgm_writer
+* --------------------------
+* writes the rows of a PGM file in order
+*
+* file: the output file
+* version: 2 for ASCII, 5 for binary
+* width: image width
+* text, rowLengths, blockRows: ASCII encoding buffer of blockRows rows
+* failed: set once a write fails
+*/
+typedef struct {
+  FILE* file;
+  int version;
+  int width;
+  char* text;
+  size_t* rowLengths;
+  int blockRows;
+  bool failed;
+} pgm_writer;
+
+#ifdef _WIN32
+typedef HANDLE worker_thread;
+typedef SRWLOCK worker_mutex;
+#define WORKER_MUTEX_INIT SRWLOCK_INIT
+#else
+typedef pthread_t worker_thread;
+typedef pthread_mutex_t worker_mutex;
+#define WORKER_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#endif
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/*
+* Struct: pool_block
+* --------------------------
+* header in front of every buffer handed out by poolAlloc, it takes
+* POOL_ALIGNMENT bytes so the buffer behind it stays aligned
+*
+* size: usable bytes of the buffer
+* next: next released block while the block waits in the pool
+*/
+typedef struct pool_block {
+  size_t size;
+  struct pool_block* next;
+} pool_block;
+
+/*
+* Struct: buffer_pool
+* --------------------------
+* keeps released rasters and scratch rows so the next image of the same size
+* reuses them instead of going back to the allocator, see poolAlloc. There
+* is no arena per band or thread: bands take their scratch once, not per
+* row, so an image costs a handful of requests per band and the lock is
+* not contended
+*
+* blocks: released blocks, the most recent first
+* blockCount: number of released blocks
+* pooledBytes: bytes held by the released blocks
+* usedBytes: bytes handed out and not released yet
+* peakBytes: the most bytes handed out at once
+* hits: requests served by a released block
+* misses: requests of at least POOL_MIN_SIZE bytes that went to the allocator
+* lock: serializes workers and bands
+*/
+typedef struct {
+  pool_block* blocks;
+  int blockCount;
+  size_t pooledBytes;
+  size_t usedBytes;
+  size_t peakBytes;
+  long hits;
+  long misses;
+  worker_mutex lock;
+} buffer_pool;
+
+/*
+* Struct: pipeline_stage
+* --------------------------
+* one step of a pipeline, see parsePipeline
+*
+* command: avg, median, verprewitt, sobel, custom or one of the pointwise
+* stages minmax, invert and threshold
+* windowSize: window dimension of avg and median, smoothing window of canny
+* gradientType: magnitude of sobel and canny
+* threshold: pixels below it become 0 and the others 255
+* lowThreshold, highThreshold: hysteresis thresholds of canny
+* pointwise: the stage maps each pixel value on its own
+*/
+typedef struct {
+  char command[STAGE_NAME_SIZE];
+  int windowSize;
+  int gradientType;
+  int threshold;
+  int lowThreshold;
+  int highThreshold;
+  bool pointwise;
+} pipeline_stage;
+
+/*
+* Struct: command_options
+* --------------------------
+* optional parameters of the commands
+*
+* windowSize: window dimension of the avg and median commands, smoothing
+* window of canny
+* gradientType: magnitude used by the sobel and canny commands (GRADIENT_L2,
+* GRADIENT_L1 or GRADIENT_SQUARED)
+* lowThreshold, highThreshold: hysteresis thresholds of canny
+* streamRows: process the image a block of rows at a time, see streamCommand
+* stages, stageCount: steps of the pipeline command
+* context: threads per image and tile width the filters run with
+* outputVersion: PGM version of the written files, 2 (ASCII) or 5 (binary)
+*/
+typedef struct {
+  int windowSize;
+  int gradientType;
+  int lowThreshold;
+  int highThreshold;
+  bool streamRows;
+  pipeline_stage* stages;
+  int stageCount;
+  kernel_context context;
+  int outputVersion;
+} command_options;
+
+/*
+* Struct: stage_counter
+* --------------------------
+* what one stage of an image cost
+*
+* seconds: wall time spent in the stage, without the stages nested in it
+* bytes: bytes the stage read or produced
+* allocations: buffers the stage took from the buffer pool
+*/
+typedef struct {
+  double seconds;
+  size_t bytes;
+  long allocations;
+} stage_counter;
+
+/*
+* Struct: image_profile
+* --------------------------
+* per-stage counters of one image, filled by beginStage and endStage while
+* it is the current profile of a thread
+*
+* stages: counters indexed by the PROFILE_ stage types
+* activeStage: the stage the time is currently counted for
+* previousStages, depth: stages interrupted by nested ones
+* stageStart: when the time of activeStage was last taken
+*/
+typedef struct {
+  stage_counter stages[PROFILE_STAGE_COUNT];
+  int activeStage;
+  int previousStages[PROFILE_DEPTH];
+  int depth;
+  double stageStart;
+} image_profile;
+
+/*
+* Struct: batch_job
+* --------------------------
+* state shared between the workers of a batch run
+*
+* command: the command applied to every file (avg, median, ...)
+* outputDir: directory the processed files are written to
+* files: list of input files
+* outputs: output file of every input file
+* kernel: mask used by the custom command, NULL otherwise
+* settings: settings used by the custom command, NULL otherwise
+* options: optional parameters of the command
+* nextFile: index of the next file to be picked up by a worker
+* failed: number of files that couldn't be processed
+* profiles: per-file profiles for the --profile report, NULL without it
+* totals: profiles of every file added up
+* lock: guards nextFile, failed, profiles and totals
+*/
+typedef struct {
+  char* command;
+  char* outputDir;
+  file_list* files;
+  file_list* outputs;
+  mask* kernel;
+  kernel_settings* settings;
+  command_options* options;
+  int nextFile;
+  int failed;
+  image_profile* profiles;
+  image_profile totals;
+  worker_mutex lock;
+} batch_job;
+
+/*
+* Struct: bench_image
+* --------------------------
+* an image the benchmark runs every operation on
+*
+* name: file name without its directory, or "synthetic" for generated images
+* pixelValues: the raster, owned by the benchmark
+* width, height: image dimensions
+*/
+typedef struct {
+  char name[BENCH_NAME_SIZE];
+  uint8_t* pixelValues;
+  int width;
+  int height;
+} bench_image;
+
+/*
+* Struct: row_band
+* --------------------------
+* a contiguous range of output rows processed by one thread
+*
+* process: function applied to the rows in [firstRow, lastRow)
+* context: data shared by all the bands of the same call
+* profile: current profile of the calling thread
+*/
+typedef struct {
+  void (*process)(void*, int, int);
+  void* context;
+  image_profile* profile;
+  int firstRow;
+  int lastRow;
+} row_band;
+
+/*
+* Struct: row_sink
+* --------------------------
+* receives the output rows of a filter and normalizes them on the fly, so
+* the filters never have to materialise a full int image
+*
+* normalizationType: NORMALIZE_SLICE clamps each row straight into pixels,
+* NORMALIZE_MINMAX keeps the rows (as int16 if the filter range allows it)
+* and scales them in finishRowSink, NORMALIZE_NONE keeps the raw values
+* width: output width
+* height: output height
+* values: raw values (NORMALIZE_NONE, or NORMALIZE_MINMAX with a wide range)
+* narrowValues: raw values of NORMALIZE_MINMAX with a range fitting in int16
+* pixels: normalized output
+* rowMin, rowMax: per row extremes collected for NORMALIZE_MINMAX
+* fixedRange: scale with the range given to setSinkRange instead of the
+* extremes of the rows
+* framePadding, frame: border finishRowSink fills around the pixels, see
+* initFramedRowSink
+* output: caller buffer that becomes pixels, NULL for a buffer of the pool
+*/
+typedef struct {
+  int normalizationType;
+  int width;
+  int height;
+  int* values;
+  int16_t* narrowValues;
+  uint8_t* pixels;
+  int* rowMin;
+  int* rowMax;
+  bool fixedRange;
+  int srcMin;
+  long long srcScale;
+  uint64_t multiplier;
+  int framePadding;
+  padding_mode frame;
+  uint8_t* output;
+} row_sink;
+
+/*
+* Struct: stream_job
 * --------------------------
+* a command applied by streamCommand
 *
-* paddingType: 0 for zero-padding 1 for mirror padding
-* normalizationType: 0 for slicing 1 for minMax
-* postPadding: apply padding after kernel if true before if false
-* coefficient: a float to be multiplied with the kernel
+* command, kernel, settings, options: the arguments of runCommand
+* kernelSize: window dimension of the command
+* normalizationType: normalization of the command (NORMALIZE_SLICE or
+* NORMALIZE_MINMAX, unused by median)
+* width: image width
+* collectRange: the current pass only collects srcMin and srcMax
+* rangeFound: srcMin and srcMax hold at least one value
+* sink: sink of every block, its rows are allocated by the first block and
+* reused by the next ones
+* output: the output pixels of a block, kept across blocks
 */
 typedef struct {
-  int paddingType;
+  char* command;
+  mask* kernel;
+  kernel_settings* settings;
+  command_options* options;
+  int kernelSize;
   int normalizationType;
-  bool postPadding;
-  float coefficient;
-} kernel_settings;
+  int width;
+  bool collectRange;
+  bool rangeFound;
+  int srcMin;
+  int srcMax;
+  row_sink sink;
+  uint8_t* output;
+} stream_job;
+
+/*
+* Struct: fixed_scale
+* --------------------------
+* a float coefficient as an exact integer multiply-shift, see initFixedScale
+*
+* multiplier: odd mantissa of the coefficient (1 for powers of two)
+* shift: power of two the product is divided by
+*/
+typedef struct {
+  long long multiplier;
+  int shift;
+} fixed_scale;
+
+/*
+* Struct: mask_plan
+* --------------------------
+* a mask compiled for an image width: zero taps are dropped and the taps
+* sharing an absolute weight form a group whose positive taps are added,
+* negative taps subtracted and sum multiplied once (not at all for 1)
+*
+* groupCount: number of groups
+* weights: absolute weight of each group
+* positiveEnds: index after the last positive tap of each group
+* groupEnds: index after the last tap of each group
+* offsets: position of each tap in the window (row*width+column)
+*/
+typedef struct {
+  int groupCount;
+  int* weights;
+  int* positiveEnds;
+  int* groupEnds;
+  int* offsets;
+} mask_plan;
+
+typedef struct {
+  int* kernel;
+  int kernelSize;
+  fixed_scale scale;
+  uint8_t* pixelValues;
+  int width;
+  int height;
+  padding_mode* padding;
+  row_sink* sink;
+  mask_plan* plan;
+  int tileColumns;
+  worker_mutex lock;
+  bool failed;
+} kernel_job;
+
+typedef struct {
+  int* rowVector;
+  int* colVector;
+  int kernelSize;
+  fixed_scale scale;
+  uint8_t* pixelValues;
+  int width;
+  int height;
+  padding_mode* padding;
+  row_sink* sink;
+  worker_mutex lock;
+  bool failed;
+} separable_job;
+
+/*
+* Struct: fft_plan
+* --------------------------
+* tables of a radix-2 complex FFT, complex values are stored as re, im pairs
+*
+* size: transform length, a power of two
+* twiddles: size/2 factors exp(-2*pi*i*k/size)
+* reversed: bit reversed order of each index
+*/
+typedef struct {
+  int size;
+  double* twiddles;
+  int* reversed;
+} fft_plan;
+
+/*
+* Struct: fft_job
+* --------------------------
+* a mask applied through the frequency domain in overlap-save tiles: each
+* size*size input tile gives (size-kernelSize+1)^2 output values that the
+* circular correlation doesn't wrap around for
+*
+* kernel, kernelSize, scale, pixelValues, width, height, padding, sink: see
+* applyKernelArr
+* plan: transform of the tile rows and columns
+* spectrum: conjugated transform of the zero padded mask, size*size values
+* tileSize: output rows and columns of a tile
+* areaWidth, areaHeight: output size
+* lock: guards failed, set by a band that couldn't get its buffers
+*/
+typedef struct {
+  int* kernel;
+  int kernelSize;
+  fixed_scale scale;
+  uint8_t* pixelValues;
+  int width;
+  int height;
+  padding_mode* padding;
+  row_sink* sink;
+  fft_plan plan;
+  double* spectrum;
+  int tileSize;
+  int areaWidth;
+  int areaHeight;
+  worker_mutex lock;
+  bool failed;
+} fft_job;
+
+typedef struct {
+  int kernelSize;
+  uint8_t* pixelValues;
+  int width;
+  uint8_t* outputArr;
+  int outputWidth;
+  int tileColumns;
+  worker_mutex lock;
+  bool failed;
+} median_job;
+
+/*
+* Struct: canny_job
+* --------------------------
+* a canny run, see filterCannyImage
+*
+* weights: binomial smoothing weights, windowSize of them
+* low, high: thresholds in the units of the magnitude, squared for GRADIENT_L2,
+* at most one above the largest magnitude
+* edges: the pixel classes (EDGE_) of every pixel, then the output
+* seeds, seedCount: pixels a hysteresis round traces from, NULL in the first one
+* crossings, crossingCount: pixels a round reached in the rows of another band
+* lock: guards crossings and failed
+*/
+typedef struct {
+  uint8_t* pixelValues;
+  int width;
+  int height;
+  int windowSize;
+  int weights[MAX_CANNY_WINDOW_SIZE];
+  int gradientType;
+  int low;
+  int high;
+  uint8_t* edges;
+  size_t* seeds;
+  size_t seedCount;
+  size_t* crossings;
+  size_t crossingCount;
+  worker_mutex lock;
+  bool failed;
+} canny_job;
+
+typedef struct {
+  int windowSize;
+  uint8_t* pixelValues;
+  int width;
+  int height;
+  padding_mode* padding;
+  row_sink* sink;
+  worker_mutex lock;
+  bool failed;
+} box_job;
+
+typedef struct {
+  uint8_t* pixelValues;
+  int width;
+  int gradientType;
+  row_sink* sink;
+  worker_mutex lock;
+  bool failed;
+} gradient_job;
+
+typedef struct {
+  uint8_t* pixelValues;
+  int width;
+  int firstRow;
+  char* text;
+  size_t* rowLengths;
+} ascii_job;
+
+typedef struct {
+  uint8_t* lut;
+  uint8_t* pixelValues;
+  uint8_t* outputArr;
+  int width;
+} lut_job;
+
+/*
+* convolves count adjacent pixels of a padded row, see convolveRowScalar
+*/
+typedef void (*convolve_row_function)(int*, int, uint8_t*, int, int*, int);
+
+/*
+* convolves count adjacent pixels of a row with a compiled mask, see
+* convolveRowPlanScalar
+*/
+typedef void (*plan_row_function)(mask_plan*, uint8_t*, int*, int);
+
+/*
+* applies a 3x3 or 5x5 median to count adjacent pixels of a padded row, see medianRowScalar
+*/
+typedef void (*median_row_function)(int, uint8_t*, int, uint8_t*, uint8_t*, int);
+
+//buffers shared by every image of a run and every library call
+buffer_pool bufferPool = {NULL, 0, 0, 0, 0, 0, 0, WORKER_MUTEX_INIT};
+//threads and tiles of the call the thread runs, NULL runs on the thread alone
+THREAD_LOCAL kernel_context* currentContext = NULL;
+//profile of the image the thread works on, NULL when nothing is recorded
+THREAD_LOCAL image_profile* currentProfile = NULL;
+//names of the PROFILE_ stage types
+static const char* profileStageNames[PROFILE_STAGE_COUNT] = {"read", "filter", "normalize", "pad", "write", "other"};
+
+//decimal text of every pixel value, one pixel per line
+static const char pixelText[256][4] = {
+  "0\n", "1\n", "2\n", "3\n", "4\n", "5\n", "6\n", "7\n", "8\n", "9\n", "10\n", "11\n", "12\n", "13\n", "14\n", "15\n",
+  "16\n", "17\n", "18\n", "19\n", "20\n", "21\n", "22\n", "23\n", "24\n", "25\n", "26\n", "27\n", "28\n", "29\n", "30\n", "31\n",
+  "32\n", "33\n", "34\n", "35\n", "36\n", "37\n", "38\n", "39\n", "40\n", "41\n", "42\n", "43\n", "44\n", "45\n", "46\n", "47\n",
+  "48\n", "49\n", "50\n", "51\n", "52\n", "53\n", "54\n", "55\n", "56\n", "57\n", "58\n", "59\n", "60\n", "61\n", "62\n", "63\n",
+  "64\n", "65\n", "66\n", "67\n", "68\n", "69\n", "70\n", "71\n", "72\n", "73\n", "74\n", "75\n", "76\n", "77\n", "78\n", "79\n",
+  "80\n", "81\n", "82\n", "83\n", "84\n", "85\n", "86\n", "87\n", "88\n", "89\n", "90\n", "91\n", "92\n", "93\n", "94\n", "95\n",
+  "96\n", "97\n", "98\n", "99\n", "100\n", "101\n", "102\n", "103\n", "104\n", "105\n", "106\n", "107\n", "108\n", "109\n", "110\n", "111\n",
+  "112\n", "113\n", "114\n", "115\n", "116\n", "117\n", "118\n", "119\n", "120\n", "121\n", "122\n", "123\n", "124\n", "125\n", "126\n", "127\n",
+  "128\n", "129\n", "130\n", "131\n", "132\n", "133\n", "134\n", "135\n", "136\n", "137\n", "138\n", "139\n", "140\n", "141\n", "142\n", "143\n",
+  "144\n", "145\n", "146\n", "147\n", "148\n", "149\n", "150\n", "151\n", "152\n", "153\n", "154\n", "155\n", "156\n", "157\n", "158\n", "159\n",
+  "160\n", "161\n", "162\n", "163\n", "164\n", "165\n", "166\n", "167\n", "168\n", "169\n", "170\n", "171\n", "172\n", "173\n", "174\n", "175\n",
+  "176\n", "177\n", "178\n", "179\n", "180\n", "181\n", "182\n", "183\n", "184\n", "185\n", "186\n", "187\n", "188\n", "189\n", "190\n", "191\n",
+  "192\n", "193\n", "194\n", "195\n", "196\n", "197\n", "198\n", "199\n", "200\n", "201\n", "202\n", "203\n", "204\n", "205\n", "206\n", "207\n",
+  "208\n", "209\n", "210\n", "211\n", "212\n", "213\n", "214\n", "215\n", "216\n", "217\n", "218\n", "219\n", "220\n", "221\n", "222\n", "223\n",
+  "224\n", "225\n", "226\n", "227\n", "228\n", "229\n", "230\n", "231\n", "232\n", "233\n", "234\n", "235\n", "236\n", "237\n", "238\n", "239\n",
+  "240\n", "241\n", "242\n", "243\n", "244\n", "245\n", "246\n", "247\n", "248\n", "249\n", "250\n", "251\n", "252\n", "253\n", "254\n", "255\n"
+};
 
 //generic functions
 void setColor(int);
@@ -51,108 +721,571 @@ void removeExtension(char*, char*);
 bool isSpace(char);
 void swap(uint8_t*, uint8_t*);
 bool isIntegerStr(char*);
-int* staticToDynamicKernel(int[], int);
 void help();
 
 //quick select functions
 /* Reference: https://www.geeksforgeeks.org/median-of-an-unsorted-array-in-liner-time-on/ */
 int partition(uint8_t*, int, int);
-int randomPartition(uint8_t*, int, int);
+int pivotPartition(uint8_t*, int, int);
 void medianUtil(uint8_t*, int, int, int, int*, int*);
 uint8_t findMedian(uint8_t*, int);
 
 //generic PGM functions
-bool isBinaryPgm(FILE*);
-bool isAsciiPgm(FILE*);
 void skipComments(FILE*);
 bool writeArrToPgm(uint8_t*, int, int, char*, int);
 
 //program-specific functions
-uint8_t* allocArrWithPad(int, int, int);
-size_t fwritePixels(const void*, size_t, size_t, FILE*);
-uint8_t* rBinaryPgm(char*, int*, int*);
+bool openPgmWriter(pgm_writer*, char*, int, int, int);
+bool writePgmRows(pgm_writer*, uint8_t*, int);
+bool closePgmWriter(pgm_writer*, char*);
+void encodeAsciiRows(void*, int, int);
+bool parseOutputVersion(char*, int*);
 uint8_t* rAsciiPgm(char*, int*, int*);
-int* applyKernelArr(int*, int, float, uint8_t*, int, int);
-int applyKernelPixWithCo(int*, int, float, uint8_t*, int, size_t, size_t);
-int applyKernelPixNoCo(int*, int, float, uint8_t*, int, size_t, size_t);
-uint8_t* filterSlice(int*, int, int);
-uint8_t* filterMinMax(int*, int, int);
-void setPaddingMirror(uint8_t*, int, int, int);
-uint8_t* addStaticPad(uint8_t*, uint8_t, int, int, int);
+uint8_t* mapBinaryPgm(char*, int*, int*, pgm_map*);
+bool openPgmReader(pgm_reader*, char*, char*);
+bool readPgmRows(pgm_reader*, uint8_t*, int);
+bool parseAsciiPixels(pgm_reader*, uint8_t*, size_t);
+bool checkPgmEnd(pgm_reader*);
+void rewindPgmReader(pgm_reader*);
+void closePgmReader(pgm_reader*);
+bool parsePgmHeader(pgm_map*, char*, char*, int*, int*, int*, size_t*);
+bool readHeaderValue(pgm_map*, size_t*, int*);
+uint8_t* readPgm(char*, int*, int*, pgm_map*);
+void releasePgm(uint8_t*, pgm_map*);
+bool applyMaskArr(mask*, float, uint8_t*, int, int, padding_mode*, row_sink*);
+void getMaskBounds(int*, int, fixed_scale*, long long*, long long*);
+void initFixedScale(fixed_scale*, float);
+void scaleRowFixed(int*, int, fixed_scale*);
+bool findSeparableFactors(int*, int, int*, int*);
+bool applySeparableArr(int*, int*, int, fixed_scale*, uint8_t*, int, int, padding_mode*, row_sink*);
+void applySeparableRows(void*, int, int);
+void separableHorizontalRow(separable_job*, int, int*);
+bool applyKernelArr(int*, int, fixed_scale*, uint8_t*, int, int, padding_mode*, row_sink*);
+int selectMaskMethod(int*, int, bool, int, int, long long, int*);
+bool applyFftArr(int*, int, int, fixed_scale*, uint8_t*, int, int, padding_mode*, row_sink*);
+void applyFftRows(void*, int, int);
+void loadFftTile(fft_job*, double*, int, int, int);
+bool initFftPlan(fft_plan*, int);
+void freeFftPlan(fft_plan*);
+void fftRows(fft_plan*, double*, int, bool);
+void fftColumns(fft_plan*, double*, bool);
+void applyKernelRows(void*, int, int);
+void convolvePaddedPixels(kernel_job*, int, int, int, int*);
+convolve_row_function selectConvolveRow(int*, int);
+void convolveRowScalar(int*, int, uint8_t*, int, int*, int);
+bool compileMaskPlan(int*, int, int, mask_plan*);
+plan_row_function selectPlanRow();
+void convolveRowPlanScalar(mask_plan*, uint8_t*, int*, int);
+#ifdef X86_SIMD
+void convolveRowSse2(int*, int, uint8_t*, int, int*, int);
+void convolveRowAvx2(int*, int, uint8_t*, int, int*, int);
+void convolveRowPlanAvx2(mask_plan*, uint8_t*, int*, int);
+#endif
+uint8_t* filterMinMax(int*, int, int, uint8_t*);
+uint64_t getScaleMultiplier(long long);
+static inline uint8_t scaleToPixel(long long, long long, uint64_t);
+bool initRowSink(row_sink*, int, int, int);
+bool initFramedRowSink(row_sink*, int, int, int, int, padding_mode*, uint8_t*);
+static inline uint8_t* getSinkPixelRow(row_sink*, int);
+bool prepareRowSink(row_sink*, long long, long long);
+int* getSinkRow(row_sink*, int, int*);
+void putSinkRow(row_sink*, int, int*);
+uint8_t* finishRowSink(row_sink*);
+void scaleSinkRows(void*, int, int);
+void scaleSinkRange(row_sink*, int);
+void setSinkRange(row_sink*, int, int);
+void freeRowSink(row_sink*);
+void fillPadding(uint8_t*, int, int, int, padding_mode*);
+static inline int borderIndex(int, int, int);
+static inline uint8_t getPaddingValue(padding_mode*);
+static inline uint8_t getPaddedPixel(uint8_t*, int, int, int, int, padding_mode*);
+bool parsePaddingType(char*, int*);
 bool doesKernelFit(int, int, int);
-bool processInput(char*);
-int processCustomKernel(char*, char*);
+bool checkUnpaddedFit(int, int, int);
+bool processInput(char*, command_options*);
+int takeWindowSize(char**);
+int takeGradientType(char**);
+bool parseGradientType(char*, int*);
+int processCustomKernel(char*, char*, int);
+
+//batch functions
+int processBatch(int, char const**);
+void batchUsage();
+bool isBatchCommand(char*);
+int runCommand(char*, char*, char*, mask*, kernel_settings*, command_options*);
+bool readKernelFile(char*, mask*, kernel_settings*);
+void setDefaultSettings(kernel_settings*);
+bool addFileName(file_list*, char*);
+void freeFileList(file_list*);
+bool hasPgmExtension(char*);
+int compareFileNames(const void*, const void*);
+bool buildOutputName(char*, char*, char*, char*);
+bool listOutputNames(file_list*, char*, char*, file_list*);
+void* batchWorker(void*);
+int streamCommand(char*, char*, char*, mask*, kernel_settings*, command_options*);
+bool parsePipeline(char*, pipeline_stage**, int*);
+bool parseStage(char*, pipeline_stage*);
+bool pipelineUses(command_options*, char*);
+int runPipeline(char*, char*, mask*, kernel_settings*, command_options*);
+uint8_t* filterStageImage(pipeline_stage*, uint8_t*, int, int, mask*, kernel_settings*);
+void buildPointwiseLut(pipeline_stage*, int, uint8_t*, size_t, uint8_t*);
+void applyLut(uint8_t*, uint8_t*, uint8_t*, int, int);
+void applyLutRows(void*, int, int);
+bool filterStreamRows(stream_job*, uint8_t*, int);
+void frameStreamRow(uint8_t*, uint8_t*, int, int, padding_mode*);
+
+//benchmark functions
+int runBenchmark(int, char const**);
+bool addBenchImage(bench_image**, int*, char*, uint8_t*, int, int);
+uint8_t* generateBenchImage(int, int);
+uint8_t* loadBenchImage(char*, int*, int*);
+void buildBenchKernel(mask*, int, bool);
+bool runBenchOperation(int, bench_image*, char*);
+
+//thread functions
+void runRowBands(int, void (*)(void*, int, int), void*);
+void* processBand(void*);
+int getThreadCount();
+int selectTileColumns(int, int, int);
+long getCacheSize();
+
+//buffer pool functions
+void* poolAlloc(size_t);
+void poolRelease(void*);
+void drainBufferPool();
+void printPoolStats();
+
+//profiling functions
+void startProfile(image_profile*);
+void stopProfile();
+void beginStage(int);
+void endStage(size_t);
+void addProfile(image_profile*, image_profile*);
+void printProfileSummary(image_profile*);
+bool writeProfileReport(char*, int, file_list*, image_profile*);
+void printJsonString(FILE*, char*);
+
+//platform-specific functions
+bool listPgmFiles(char*, file_list*);
+bool mapFile(char*, pgm_map*);
+void unmapFile(pgm_map*);
+void* allocAligned(size_t);
+void freeAligned(void*);
+double getSeconds();
+size_t getPeakMemory();
+size_t releaseFileRange(pgm_map*, size_t, size_t);
+bool startThread(worker_thread*, void* (*)(void*), void*);
+void joinThread(worker_thread);
+void initMutex(worker_mutex*);
+void lockMutex(worker_mutex*);
+void unlockMutex(worker_mutex*);
+void destroyMutex(worker_mutex*);
+
+//library functions
+int checkImages(kernel_image*, kernel_image*, int, bool);
+int runLibraryFilter(kernel_context*, kernel_image*, int, int, mask*, kernel_settings*, kernel_image*);
+int convolveValues(kernel_image*, mask*, int*);
 
 //kernel-specific functions
-int applyVerPrewittPgm(char*, char*);
-int* applyPrewittVertical(uint8_t*, int, int, bool);
-int* applyPrewittHorizontal(uint8_t*, int, int, bool);
-int applySobelPgm(char*, char*);
-int applyAvgPgm(char*, char*);
-int* applyAveraging(uint8_t*, int, int, bool);
-int applyCustomKernelPgm(mask*, kernel_settings*, char*, char*);
-int* applyCustomKernel(mask*, float, uint8_t*, int, int, bool);
-int applyMedianPgm(char*, char*);
-uint8_t* applyMedian(uint8_t*, int, int, bool);
-uint8_t* applyMedianArr(int, uint8_t*, int, int);
+int applyVerPrewittPgm(char*, char*, int);
+uint8_t* filterVerPrewittImage(uint8_t*, int, int, uint8_t*);
+bool applyPrewittVertical(uint8_t*, int, int, padding_mode*, row_sink*);
+bool applyPrewittHorizontal(uint8_t*, int, int, padding_mode*, row_sink*);
+int applySobelPgm(char*, char*, int, int);
+uint8_t* filterSobelImage(uint8_t*, int, int, int, uint8_t*);
+bool applyGradientMagnitude(uint8_t*, int, int, int, row_sink*);
+bool applyPrewittArr(uint8_t*, int, int, int, row_sink*);
+void applyGradientRows(void*, int, int);
+static inline void sumPrewittColumns(uint8_t*, uint8_t*, uint8_t*, int, int, int16_t*, int16_t*);
+static inline int getGradientMagnitude(int, int, int);
+int applyCannyPgm(char*, char*, int, int, int, int, int);
+uint8_t* filterCannyImage(uint8_t*, int, int, int, int, int, int, uint8_t*);
+void applyCannyRows(void*, int, int);
+void smoothCannyRow(canny_job*, int, int*, uint8_t*);
+void traceEdges(canny_job*);
+void traceEdgeRows(void*, int, int);
+bool pushEdge(size_t**, size_t*, size_t*, size_t);
+bool parseEdgeThresholds(char*, int*, int*);
+int applyAvgPgm(char*, char*, int, int);
+uint8_t* filterAvgImage(uint8_t*, int, int, int, uint8_t*);
+bool applyBoxFilter(uint8_t*, int, int, int, padding_mode*, row_sink*);
+bool applyBoxArr(int, uint8_t*, int, int, padding_mode*, row_sink*);
+void applyBoxRows(void*, int, int);
+void addBoxRow(box_job*, int, int*, int);
+int applyCustomKernelPgm(mask*, kernel_settings*, char*, char*, int);
+uint8_t* filterCustomImage(mask*, kernel_settings*, uint8_t*, int, int, uint8_t*);
+bool applyCustomKernel(mask*, float, uint8_t*, int, int, padding_mode*, row_sink*);
+int applyMedianPgm(char*, char*, int, int);
+uint8_t* filterMedianImage(uint8_t*, int, int, int, uint8_t*);
+bool applyMedianArr(int, uint8_t*, int, int, uint8_t*, int);
+void applyMedianRows(void*, int, int);
+void applyHistogramMedianRows(void*, int, int);
+void applyNetworkMedianRows(void*, int, int);
+median_row_function selectMedianRow();
+void sortColumns(int, uint8_t*, int, uint8_t*, int, int);
+void medianFromPlanes(int, uint8_t*, int, uint8_t*, int, int);
+void medianRowScalar(int, uint8_t*, int, uint8_t*, uint8_t*, int);
+#ifdef X86_SIMD
+void medianRowSse2(int, uint8_t*, int, uint8_t*, uint8_t*, int);
+void medianRowAvx2(int, uint8_t*, int, uint8_t*, uint8_t*, int);
+#endif
+static inline void addToColumnHistogram(uint16_t*, uint16_t*, size_t, uint8_t, int);
+static inline void addHistogram(uint16_t*, uint16_t*, int);
+static inline void subtractHistogram(uint16_t*, uint16_t*, int);
+static inline uint8_t findHistogramMedian(uint16_t*, uint16_t*, uint16_t*, int*, int, int, int);
+static inline void refreshFineBins(uint16_t*, uint16_t*, int, int, int, int);
 uint8_t getMedianForPix(uint8_t*, int, uint8_t*, int, size_t, size_t);
 
-
+#ifndef KERNEL_LIBRARY
 int main(int argc, char const *argv[]) {
-  char* inputStr = (char*) malloc(INPUT_SIZE * sizeof(char));
+  char inputStr[INPUT_SIZE];
+  int status = 0;
+  command_options session = {DEFAULT_WINDOW_SIZE, GRADIENT_L2, DEFAULT_CANNY_LOW, DEFAULT_CANNY_HIGH, false, NULL, 0,
+                             {DEFAULT_THREAD_COUNT, 0}, DEFAULT_OUTPUT_VERSION};
+  if (argc > 1) {
+    status = processBatch(argc, argv);
+    drainBufferPool();
+    return status;
+  }
   printf("Welcome to " BRAND_NAME "\n");
   help();
+  currentContext = &session.context;
   do {
     printf("> ");
-    fgets(inputStr, INPUT_SIZE, stdin);
-  } while(processInput(inputStr));
-  free(inputStr);
-  return 0;
+  } while(fgets(inputStr, INPUT_SIZE, stdin) && processInput(inputStr, &session));
+  currentContext = NULL;
+  drainBufferPool();
+  return status;
 }
+#endif
 
-void help() {
-  printf(
-          "Here are the commands you can use:\n"
-          "help\t\t\t\t\t- prints available commands\n"
-          "avg input.pgm [output.pgm]\t\t- applies averaging filter to input.pgm\n"
-          "median input.pgm [output.pgm]\t\t- applies median filter to input.pgm\n"
-          "verprewitt input.pgm [output.pgm]\t- applies prewitt vertical operator to input.pgm\n"
-          "sobel input.pgm [output.pgm]\t\t- applies sobel filter to input.pgm\n"
-          "custom input.pgm [output.pgm]\t\t- applies a custom filter to input.pgm\n"
-          "exit\t\t\t\t\t- quits the program\n"
-        );
+/*
+* Function: checkImages
+* --------------------------
+* validates the arguments of a library call
+*
+* input: the image to filter
+* output: the image to write to, must have the input size and its own pixels
+* kernelSize: odd window dimension
+* mustFit: whether the window has to fit in the image
+*
+* returns: KERNEL_OK or the status code of the first problem found
+*/
+int checkImages(kernel_image* input, kernel_image* output, int kernelSize, bool mustFit) {
+  if (!input || !output || !input->pixels || !output->pixels || input->pixels == output->pixels)
+    return KERNEL_INVALID_ARGUMENT;
+  if (input->width <= 0 || input->height <= 0 || output->width != input->width || output->height != input->height)
+    return KERNEL_INVALID_ARGUMENT;
+  if (kernelSize < 1 || !(kernelSize & 1))
+    return KERNEL_INVALID_ARGUMENT;
+  if (mustFit && !doesKernelFit(kernelSize, input->width, input->height))
+    return KERNEL_WINDOW_TOO_BIG;
+  return KERNEL_OK;
 }
 
-bool processInput(char* inputStr) {
-  int i;
-  char* strPointer;
-  bool shouldCont = true;
-  char** arg = (char**) malloc(MAX_ARG_NUMBER * sizeof(char*));
-  for (i = 0; i < MAX_ARG_NUMBER; i++) {
-    arg[i] = (char*) malloc(LINE_SIZE * sizeof(char));
-    strcpy(arg[i],"NULL");
-  }
-  i = 0;
-  strPointer = strtok(inputStr, " ");
-  strcpy(arg[i++], strPointer);
-  while ((strPointer = strtok(NULL, " "))) {
-    strcpy(arg[i++], strPointer);
+/*
+* Function: runLibraryFilter
+* --------------------------
+* runs one of the batch operations on behalf of a library call, with the
+* threads of the call's context
+*
+* context: options of the call, NULL for a single thread
+* input: the image to filter
+* operation: 'a'vg, 'm'edian, 'v'erprewitt, 's'obel or 'c'ustom
+* option: window size of avg and median, gradient type of sobel
+* kernel, settings: mask and settings of custom
+* output: the image the result is written to
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+int runLibraryFilter(kernel_context* context, kernel_image* input, int operation, int option, mask* kernel, kernel_settings* settings, kernel_image* output) {
+  kernel_context singleThread = {1, 0};
+  uint8_t* result;
+  currentContext = context && context->threadCount > 0 ? context : &singleThread;
+  if (operation == 'a')
+    result = filterAvgImage(input->pixels, input->width, input->height, option, output->pixels);
+  else if (operation == 'm')
+    result = filterMedianImage(input->pixels, input->width, input->height, option, output->pixels);
+  else if (operation == 'v')
+    result = filterVerPrewittImage(input->pixels, input->width, input->height, output->pixels);
+  else if (operation == 's')
+    result = filterSobelImage(input->pixels, input->width, input->height, option, output->pixels);
+  else
+    result = filterCustomImage(kernel, settings, input->pixels, input->width, input->height, output->pixels);
+  currentContext = NULL;
+  return result ? KERNEL_OK : KERNEL_OUT_OF_MEMORY;
+}
+
+/*
+* Function: kernelAverage
+* --------------------------
+* applies a kernelSize x kernelSize averaging filter, the border the window
+* doesn't fit in is zero
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelAverage(kernel_context* context, kernel_image* input, int kernelSize, kernel_image* output) {
+  int status = checkImages(input, output, kernelSize, true);
+  return status ? status : runLibraryFilter(context, input, 'a', kernelSize, NULL, NULL, output);
+}
+
+/*
+* Function: kernelMedian
+* --------------------------
+* applies a kernelSize x kernelSize median filter, the border the window
+* doesn't fit in is zero
+*
+* kernelSize: odd window dimension of at most MAX_MEDIAN_WINDOW_SIZE, the
+* window histograms count up to 65535 pixels. Bigger windows give
+* KERNEL_WINDOW_TOO_BIG
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelMedian(kernel_context* context, kernel_image* input, int kernelSize, kernel_image* output) {
+  int status = checkImages(input, output, kernelSize, true);
+  if (!status && kernelSize > MAX_MEDIAN_WINDOW_SIZE)
+    status = KERNEL_WINDOW_TOO_BIG;
+  return status ? status : runLibraryFilter(context, input, 'm', kernelSize, NULL, NULL, output);
+}
+
+/*
+* Function: kernelVerPrewitt
+* --------------------------
+* applies the vertical prewitt operator with slicing
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelVerPrewitt(kernel_context* context, kernel_image* input, kernel_image* output) {
+  int status = checkImages(input, output, MIN_KERNEL_SIZE, true);
+  return status ? status : runLibraryFilter(context, input, 'v', 0, NULL, NULL, output);
+}
+
+/*
+* Function: kernelSobel
+* --------------------------
+* applies the sobel filter and min-max normalizes the gradient magnitude
+*
+* gradientType: GRADIENT_L2, GRADIENT_L1 or GRADIENT_SQUARED
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelSobel(kernel_context* context, kernel_image* input, int gradientType, kernel_image* output) {
+  int status = checkImages(input, output, MIN_KERNEL_SIZE, true);
+  if (!status && gradientType != GRADIENT_L2 && gradientType != GRADIENT_L1 && gradientType != GRADIENT_SQUARED)
+    status = KERNEL_INVALID_ARGUMENT;
+  return status ? status : runLibraryFilter(context, input, 's', gradientType, NULL, NULL, output);
+}
+
+/*
+* Function: kernelCanny
+* --------------------------
+* detects edges with canny, edges are 255 and everything else 0
+*
+* windowSize: odd smoothing window of at most MAX_CANNY_WINDOW_SIZE
+* gradientType: GRADIENT_L2, GRADIENT_L1 or GRADIENT_SQUARED
+* low, high: hysteresis thresholds of the gradient magnitude, 0 <= low <= high;
+* thresholds above the largest magnitude find no edges
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelCanny(kernel_context* context, kernel_image* input, int windowSize, int gradientType, int low, int high, kernel_image* output) {
+  kernel_context singleThread = {1, 0};
+  uint8_t* result;
+  int status = KERNEL_INVALID_ARGUMENT;
+  if (windowSize >= 1 && windowSize % 2 && windowSize <= MAX_CANNY_WINDOW_SIZE && low >= 0 && low <= high
+      && (gradientType == GRADIENT_L2 || gradientType == GRADIENT_L1 || gradientType == GRADIENT_SQUARED))
+    status = checkImages(input, output, windowSize + 4, true);
+  if (status)
+    return status;
+  currentContext = context && context->threadCount > 0 ? context : &singleThread;
+  result = filterCannyImage(input->pixels, input->width, input->height, windowSize, gradientType, low, high, output->pixels);
+  currentContext = NULL;
+  return result ? KERNEL_OK : KERNEL_OUT_OF_MEMORY;
+}
+
+/*
+* Function: kernelCustom
+* --------------------------
+* applies a custom kernel
+*
+* matrix: kernelSize*kernelSize kernel values
+* settings: padding, normalization and coefficient, NULL for the defaults of
+* a kernel file (zero post-padding with min-max normalization)
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelCustom(kernel_context* context, kernel_image* input, int* matrix, int kernelSize, kernel_settings* settings, kernel_image* output) {
+  kernel_settings defaults;
+  mask kernel = {kernelSize, matrix, NULL, NULL};
+  int status;
+  if (!settings) {
+    setDefaultSettings(&defaults);
+    settings = &defaults;
   }
-  strtok(arg[i -1], "\n");
-  i=0;
-  if (!strcmp(arg[i], "exit")) {
-    shouldCont = false;
-  } else if (!strcmp(arg[i], "help")) {
-    help();
-  } else if (!strcmp(arg[i], "avg")) {
-    i++;
-    if (strcmp(arg[i++], "NULL")) {
-      if (strcmp(arg[i], "NULL")) {
-        applyAvgPgm(arg[i-1], arg[i]);
-      } else {
-        removeExtension(arg[i-1], arg[i]);
-        strcat(arg[i], "_avg.pgm");
-        applyAvgPgm(arg[i-1], arg[i]);
+  status = checkImages(input, output, kernelSize, settings->postPadding);
+  if (!status && (!matrix || settings->padding.type < PADDING_ZERO || settings->padding.type > PADDING_WRAP
+                  || settings->normalizationType < NORMALIZE_SLICE || settings->normalizationType > NORMALIZE_MINMAX))
+    status = KERNEL_INVALID_ARGUMENT;
+  return status ? status : runLibraryFilter(context, input, 'c', 0, &kernel, settings, output);
+}
+
+/*
+* Function: kernelConvolve
+* --------------------------
+* applies a kernel to the area it fits in without normalizing, the values
+* are the sums of the kernel values times the pixels under them
+*
+* matrix: kernelSize*kernelSize kernel values
+* output: (width-kernelSize+1)*(height-kernelSize+1) values
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelConvolve(kernel_context* context, kernel_image* input, int* matrix, int kernelSize, int* output) {
+  kernel_context singleThread = {1, 0};
+  mask kernel = {kernelSize, matrix, NULL, NULL};
+  int status;
+  if (!input || !input->pixels || !matrix || !output || input->width <= 0 || input->height <= 0 || kernelSize < 1 || !(kernelSize & 1))
+    return KERNEL_INVALID_ARGUMENT;
+  if (!doesKernelFit(kernelSize, input->width, input->height))
+    return KERNEL_WINDOW_TOO_BIG;
+  currentContext = context && context->threadCount > 0 ? context : &singleThread;
+  status = convolveValues(input, &kernel, output);
+  currentContext = NULL;
+  return status;
+}
+
+/*
+* Function: convolveValues
+* --------------------------
+* runs the mask engine into a sink that keeps its raw rows in output
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+int convolveValues(kernel_image* input, mask* kernel, int* output) {
+  row_sink sink;
+  bool success;
+  int padding = kernel->size >> 1;
+  if (!initRowSink(&sink, NORMALIZE_NONE, input->width - padding*2, input->height - padding*2))
+    return KERNEL_OUT_OF_MEMORY;
+  // prepareRowSink keeps values that are already set
+  sink.values = output;
+  success = applyMaskArr(kernel, 1, input->pixels, input->width, input->height, NULL, &sink);
+  sink.values = NULL;
+  freeRowSink(&sink);
+  return success ? KERNEL_OK : KERNEL_OUT_OF_MEMORY;
+}
+
+/*
+* Function: kernelMinMax
+* --------------------------
+* scales values to [0-255], the smallest becoming 0 and the largest 255
+*
+* values: output->width*output->height values
+* output: the image the result is written to
+*
+* returns: KERNEL_OK or the status code of the failure
+*/
+KERNEL_API int kernelMinMax(int* values, kernel_image* output) {
+  if (!values || !output || !output->pixels || output->width <= 0 || output->height <= 0)
+    return KERNEL_INVALID_ARGUMENT;
+  return filterMinMax(values, output->width, output->height, output->pixels) ? KERNEL_OK : KERNEL_OUT_OF_MEMORY;
+}
+
+/*
+* Function: kernelStatusText
+* --------------------------
+* returns: a description of a KERNEL_ status code
+*/
+KERNEL_API const char* kernelStatusText(int status) {
+  if (status == KERNEL_OK)
+    return "success";
+  if (status == KERNEL_INVALID_ARGUMENT)
+    return "invalid argument";
+  if (status == KERNEL_WINDOW_TOO_BIG)
+    return "window too big for the image or the filter";
+  if (status == KERNEL_OUT_OF_MEMORY)
+    return "out of memory";
+  return "unknown status";
+}
+
+/*
+* Function: kernelReleaseMemory
+* --------------------------
+* frees the buffers kept for later calls
+*/
+KERNEL_API void kernelReleaseMemory() {
+  drainBufferPool();
+}
+
+void help() {
+  printf(
+          "Here are the commands you can use:\n"
+          "help\t\t\t\t\t- prints available commands\n"
+          "avg input.pgm [output.pgm] [size]\t- applies size x size averaging filter to input.pgm\n"
+          "median input.pgm [output.pgm] [size]\t- applies size x size median filter to input.pgm\n"
+          "verprewitt input.pgm [output.pgm]\t- applies prewitt vertical operator to input.pgm\n"
+          "sobel input.pgm [output.pgm] [l1|sq]\t- applies sobel filter to input.pgm\n"
+          "canny input.pgm [output.pgm] [l1|sq]\t- detects the edges of input.pgm\n"
+          "custom input.pgm [output.pgm]\t\t- applies a custom filter to input.pgm\n"
+          "threads [count]\t\t\t\t- sets or prints the number of threads per image\n"
+          "format [p2|p5]\t\t\t\t- sets or prints the format of the written files\n"
+          "exit\t\t\t\t\t- quits the program\n"
+        );
+}
+
+bool processInput(char* inputStr, command_options* session) {
+  int i;
+  char* strPointer;
+  bool shouldCont = true;
+  int windowSize, gradientType;
+  char argValues[MAX_ARG_NUMBER][LINE_SIZE], *arg[MAX_ARG_NUMBER];
+  for (i = 0; i < MAX_ARG_NUMBER; i++) {
+    arg[i] = argValues[i];
+    strcpy(arg[i],"NULL");
+  }
+  i = 0;
+  strPointer = strtok(inputStr, " \n");
+  while (strPointer && i < MAX_ARG_NUMBER) {
+    snprintf(arg[i++], LINE_SIZE, "%s", strPointer);
+    strPointer = strtok(NULL, " \n");
+  }
+  i=0;
+  // only the commands that take the option lose a trailing argument to it
+  gradientType = !strcmp(arg[0], "sobel") || !strcmp(arg[0], "canny") ? takeGradientType(arg) : GRADIENT_L2;
+  windowSize = !strcmp(arg[0], "avg") || !strcmp(arg[0], "median") ? takeWindowSize(arg) : DEFAULT_WINDOW_SIZE;
+  if (!strcmp(arg[i], "exit")) {
+    shouldCont = false;
+  } else if (!strcmp(arg[i], "help")) {
+    help();
+  } else if (!strcmp(arg[i], "threads")) {
+    i++;
+    if (strcmp(arg[i], "NULL")) {
+      if (isIntegerStr(arg[i]) && atoi(arg[i]) > 0) {
+        session->context.threadCount = atoi(arg[i]);
+      } else {
+        setColor(RED);
+        printf("Error: thread count must be a positive integer\n");
+        setColor(RESET);
+      }
+    }
+    printf("Using %d thread(s) per image\n", session->context.threadCount);
+  } else if (!strcmp(arg[i], "format")) {
+    i++;
+    if (strcmp(arg[i], "NULL") && !parseOutputVersion(arg[i], &session->outputVersion)) {
+      setColor(RED);
+      printf("Error: format must be p2 or p5\n");
+      setColor(RESET);
+    }
+    printf("Writing P%d files\n", session->outputVersion);
+  } else if (!strcmp(arg[i], "avg")) {
+    i++;
+    if (strcmp(arg[i++], "NULL")) {
+      if (strcmp(arg[i], "NULL")) {
+        applyAvgPgm(arg[i-1], arg[i], windowSize, session->outputVersion);
+      } else {
+        removeExtension(arg[i-1], arg[i]);
+        strcat(arg[i], "_avg.pgm");
+        applyAvgPgm(arg[i-1], arg[i], windowSize, session->outputVersion);
       }
     } else {
       setColor(RED);
@@ -165,11 +1298,11 @@ bool processInput(char* inputStr) {
     i++;
     if (strcmp(arg[i++], "NULL")) {
       if (strcmp(arg[i], "NULL")) {
-        applyMedianPgm(arg[i-1], arg[i]);
+        applyMedianPgm(arg[i-1], arg[i], windowSize, session->outputVersion);
       } else {
         removeExtension(arg[i-1], arg[i]);
         strcat(arg[i], "_median.pgm");
-        applyMedianPgm(arg[i-1], arg[i]);
+        applyMedianPgm(arg[i-1], arg[i], windowSize, session->outputVersion);
       }
     } else {
       setColor(RED);
@@ -182,11 +1315,11 @@ bool processInput(char* inputStr) {
     i++;
     if (strcmp(arg[i++], "NULL")) {
       if (strcmp(arg[i], "NULL")) {
-        applyVerPrewittPgm(arg[i-1], arg[i]);
+        applyVerPrewittPgm(arg[i-1], arg[i], session->outputVersion);
       } else {
         removeExtension(arg[i-1], arg[i]);
         strcat(arg[i], "_verprewitt.pgm");
-        applyVerPrewittPgm(arg[i-1], arg[i]);
+        applyVerPrewittPgm(arg[i-1], arg[i], session->outputVersion);
       }
     } else {
       setColor(RED);
@@ -199,11 +1332,30 @@ bool processInput(char* inputStr) {
     i++;
     if (strcmp(arg[i++], "NULL")) {
       if (strcmp(arg[i], "NULL")) {
-        applySobelPgm(arg[i-1], arg[i]);
+        applySobelPgm(arg[i-1], arg[i], gradientType, session->outputVersion);
       } else {
         removeExtension(arg[i-1], arg[i]);
         strcat(arg[i], "_sobel.pgm");
-        applySobelPgm(arg[i-1], arg[i]);
+        applySobelPgm(arg[i-1], arg[i], gradientType, session->outputVersion);
+      }
+    } else {
+      setColor(RED);
+      printf("Error: no input provided\n");
+      setColor(YELLOW);
+      printf("Tip: type 'help' for usage\n");
+      setColor(RESET);
+    }
+  } else if (!strcmp(arg[i], "canny")) {
+    i++;
+    if (strcmp(arg[i++], "NULL")) {
+      if (strcmp(arg[i], "NULL")) {
+        applyCannyPgm(arg[i-1], arg[i], DEFAULT_CANNY_WINDOW_SIZE, gradientType, DEFAULT_CANNY_LOW, DEFAULT_CANNY_HIGH,
+                      session->outputVersion);
+      } else {
+        removeExtension(arg[i-1], arg[i]);
+        strcat(arg[i], "_canny.pgm");
+        applyCannyPgm(arg[i-1], arg[i], DEFAULT_CANNY_WINDOW_SIZE, gradientType, DEFAULT_CANNY_LOW, DEFAULT_CANNY_HIGH,
+                      session->outputVersion);
       }
     } else {
       setColor(RED);
@@ -216,11 +1368,11 @@ bool processInput(char* inputStr) {
     i++;
     if (strcmp(arg[i++], "NULL")) {
       if (strcmp(arg[i], "NULL")) {
-        processCustomKernel(arg[i-1], arg[i]);
+        processCustomKernel(arg[i-1], arg[i], session->outputVersion);
       } else {
         removeExtension(arg[i-1], arg[i]);
         strcat(arg[i], "_custom.pgm");
-        processCustomKernel(arg[i-1], arg[i]);
+        processCustomKernel(arg[i-1], arg[i], session->outputVersion);
       }
     } else {
       setColor(RED);
@@ -236,19 +1388,124 @@ bool processInput(char* inputStr) {
     setColor(RESET);
   }
 
-  for (i = 0; i < MAX_ARG_NUMBER; i++) {
-    free(arg[i]);
-  }
-  free(arg);
   return shouldCont;
 }
 
-int processCustomKernel(char* inputFileName, char* outputFileName) {
+/*
+* Function: takeWindowSize
+* --------------------------
+* removes a trailing window size from the command arguments
+*
+* arg: the MAX_ARG_NUMBER command arguments, unused ones set to "NULL"
+*
+* returns: the window size or DEFAULT_WINDOW_SIZE if there is none
+*/
+int takeWindowSize(char** arg) {
+  int i = MAX_ARG_NUMBER-1, windowSize;
+  while (i > 0 && !strcmp(arg[i], "NULL"))
+    i--;
+  // the first argument is always the input file
+  if (i < 2 || !isIntegerStr(arg[i]))
+    return DEFAULT_WINDOW_SIZE;
+  windowSize = atoi(arg[i]);
+  strcpy(arg[i], "NULL");
+  return windowSize;
+}
+
+/*
+* Function: takeGradientType
+* --------------------------
+* removes a trailing gradient magnitude type (l2, l1 or sq) from the command arguments
+*
+* arg: the MAX_ARG_NUMBER command arguments, unused ones set to "NULL"
+*
+* returns: the gradient type or GRADIENT_L2 if there is none
+*/
+int takeGradientType(char** arg) {
+  int i = MAX_ARG_NUMBER-1, gradientType;
+  while (i > 0 && !strcmp(arg[i], "NULL"))
+    i--;
+  if (i < 2 || !parseGradientType(arg[i], &gradientType))
+    return GRADIENT_L2;
+  strcpy(arg[i], "NULL");
+  return gradientType;
+}
+
+/*
+* Function: parsePaddingType
+* --------------------------
+* converts a padding name (zero, constant, replicate, mirror or wrap)
+*
+* str: the padding name
+* paddingType: set to the PADDING_ value, left unchanged on failure
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool parsePaddingType(char* str, int* paddingType) {
+  if (!strcmp(str, "zero"))
+    *paddingType = PADDING_ZERO;
+  else if (!strcmp(str, "constant"))
+    *paddingType = PADDING_CONSTANT;
+  else if (!strcmp(str, "replicate"))
+    *paddingType = PADDING_REPLICATE;
+  else if (!strcmp(str, "mirror"))
+    *paddingType = PADDING_MIRROR;
+  else if (!strcmp(str, "wrap"))
+    *paddingType = PADDING_WRAP;
+  else
+    return false;
+  return true;
+}
+
+bool parseGradientType(char* str, int* gradientType) {
+  if (!strcmp(str, "l2"))
+    *gradientType = GRADIENT_L2;
+  else if (!strcmp(str, "l1"))
+    *gradientType = GRADIENT_L1;
+  else if (!strcmp(str, "sq"))
+    *gradientType = GRADIENT_SQUARED;
+  else
+    return false;
+  return true;
+}
+
+/*
+* Function: parseEdgeThresholds
+* --------------------------
+* parses the "low,high" hysteresis thresholds of canny
+*
+* str: the thresholds
+* low, high: set to the thresholds if they are valid
+*
+* returns: false unless both are integers with 0 <= low <= high <= INT_MAX
+*/
+bool parseEdgeThresholds(char* str, int* low, int* high) {
+  char lowStr[LINE_SIZE];
+  char* comma = strchr(str, ',');
+  long lowValue, highValue;
+  if (!comma || comma == str || comma - str >= LINE_SIZE || !comma[1])
+    return false;
+  memcpy(lowStr, str, comma - str);
+  lowStr[comma - str] = '\0';
+  if (!isIntegerStr(lowStr) || !isIntegerStr(comma + 1))
+    return false;
+  // strtol saturates instead of wrapping, so values beyond an int are caught
+  lowValue = strtol(lowStr, NULL, 10);
+  highValue = strtol(comma + 1, NULL, 10);
+  if (lowValue < 0 || lowValue > highValue || highValue > INT_MAX)
+    return false;
+  *low = (int) lowValue;
+  *high = (int) highValue;
+  return true;
+}
+
+int processCustomKernel(char* inputFileName, char* outputFileName, int version) {
   size_t i, j;
-  mask* kernel = (mask*) malloc(sizeof(kernel));
-  kernel_settings* settings = (kernel_settings*) malloc(sizeof(kernel_settings));
-  char* inputStr = (char*) malloc(INPUT_SIZE * sizeof(char));
+  mask kernelValues, *kernel = &kernelValues;
+  kernel_settings settingValues, *settings = &settingValues;
+  char inputStr[INPUT_SIZE];
   kernel->size = 0;
+  kernel->rowVector = kernel->colVector = NULL;
   do {
     printf("Enter kernel size (grater than 0 and odd): ");
     fgets(inputStr, INPUT_SIZE, stdin);
@@ -274,12 +1531,23 @@ int processCustomKernel(char* inputFileName, char* outputFileName) {
   setColor(YELLOW);
   printf("Press Enter to keep (current setting)\n");
   setColor(RESET);
-  settings->paddingType = 0;
-  printf("(zero-padding) apply mirror padding instead? [y/N]: ");
+  settings->padding.type = PADDING_ZERO;
+  settings->padding.value = 0;
+  printf("(zero) padding [zero|constant|replicate|mirror|wrap]: ");
   fgets(inputStr, INPUT_SIZE, stdin);
   strtok(inputStr, "\n");
-  if (!strcmp(inputStr, "y") || !strcmp(inputStr, "Y")) {
-    settings->paddingType = 1;
+  while (strcmp(inputStr, "\n") && !parsePaddingType(inputStr, &(settings->padding.type))) {
+    printf("padding [zero|constant|replicate|mirror|wrap]: ");
+    fgets(inputStr, INPUT_SIZE, stdin);
+    strtok(inputStr, "\n");
+  }
+  if (settings->padding.type == PADDING_CONSTANT) {
+    do {
+      printf("padding value [0-%d]: ", MAX_PIXEL_VAL);
+      fgets(inputStr, INPUT_SIZE, stdin);
+      strtok(inputStr, "\n");
+    } while (!isIntegerStr(inputStr) || atoi(inputStr) < 0 || atoi(inputStr) > MAX_PIXEL_VAL);
+    settings->padding.value = (uint8_t) atoi(inputStr);
   }
   settings->postPadding=true;
   printf("(post-padding) apply padding before kernel instead? [y/N]: ");
@@ -309,713 +1577,5161 @@ int processCustomKernel(char* inputFileName, char* outputFileName) {
       strtok(inputStr, "\n");
     }
   }
-  applyCustomKernelPgm(kernel, settings, inputFileName, outputFileName);
+  applyCustomKernelPgm(kernel, settings, inputFileName, outputFileName, version);
   free(kernel->matrix);
-  free(inputStr);
-  free(settings);
-  free(kernel);
-  return 0;
-}
-
-int applyCustomKernelPgm(mask* kernel, kernel_settings* settings, char* inputFileName, char* outputFileName) {
-  uint8_t *arr, *pixelValues;
-  int width, height, *filteredIntegers, padding, kernelSize = 3;
-  arr = rBinaryPgm(inputFileName, &width, &height);
-  if (!arr) {
-    setColor(YELLOW);
-    printf("Trying ASCII pgm format...\n");
-    setColor(RESET);
-    arr = rAsciiPgm(inputFileName, &width, &height);
-  }
-  if (!arr)
-    return 1;
-  uint8_t* (*normalizeValues)(int*, int, int) = filterSlice;
-  filteredIntegers = applyCustomKernel(kernel, settings->coefficient, arr, width, height, settings->postPadding);
-  free(arr);
-  if (settings->postPadding) {
-    padding = (kernelSize>>1);
-  } else {
-    padding = 0;
-  }
-  if (settings->normalizationType)
-    normalizeValues = filterMinMax;
-  pixelValues = normalizeValues(filteredIntegers, width-padding*2, height-padding*2);
-  free(filteredIntegers);
-  pixelValues = addStaticPad(pixelValues, 0, width-padding*2, height-padding*2, kernelSize);
-  if (settings->paddingType == 1)
-    setPaddingMirror(pixelValues, width, height, kernel->size);
-  writeArrToPgm(pixelValues, width, height, outputFileName, 2);
-  free(pixelValues);
   return 0;
 }
 
 /*
-* Function: applyCustomKernel
+* Function: processBatch
 * --------------------------
-* returns a pointer to an array with custom filter applied
+* runs a command on every PGM file matched by the input argument without
+* any prompt, spreading the files over a number of worker threads
 *
-* kernel: a mask struct containing the mask that will be applied
-* pixelValues: pointer to the array representing image that will be processed
-* width: image width without padding
-* height: image height without padding
-* postPadding: a bool value indicating whether the padding will be applied
-* before (false) or after (true) kernel
+* argc, argv: the program arguments in the form
+*   command input output-dir [-k settings-file] [-s size] [-g l2|l1|sq] [-j workers] [-t threads] [-f p2|p5] [--stream]
+*   [-p stages] [--pool-stats] [--profile csv|json]
+*   or bench output-dir [...], see runBenchmark
 *
-* returns: a pointer to the newly allocated array after processing
+* returns: 0 if every file was processed, 1 otherwise
 */
-int* applyCustomKernel(mask* kernel, float coefficient, uint8_t* pixelValues, int width, int height, bool postPadding) {
-  int padding, *filteredValues;
-  uint8_t *pixelValuesCopy;
-  if (!doesKernelFit(kernel->size, width, height) && !postPadding) {
-    setColor(RED);
-    printf("Kernel too be big to be applied without pre-padding\n");
-    setColor(RESET);
-    return NULL;
+int processBatch(int argc, char const *argv[]) {
+  int i, workerCount = DEFAULT_WORKER_COUNT, startedWorkers;
+  int profileFormat = PROFILE_REPORT_NONE;
+  bool showPoolStats = false;
+  command_options options = {DEFAULT_WINDOW_SIZE, GRADIENT_L2, DEFAULT_CANNY_LOW, DEFAULT_CANNY_HIGH, false, NULL, 0,
+                             {DEFAULT_THREAD_COUNT, 0}, DEFAULT_OUTPUT_VERSION};
+  char *kernelFileName = NULL;
+  mask kernel = {0, NULL, NULL, NULL};
+  kernel_settings settings;
+  file_list files = {0, 0, NULL}, outputs = {0, 0, NULL};
+  batch_job job;
+  worker_thread* workers;
+  struct stat outputStat;
+  if (!strcmp(argv[1], "bench"))
+    return runBenchmark(argc, argv);
+  if (!strcmp(argv[1], "help") || !strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")) {
+    batchUsage();
+    return 0;
   }
-  pixelValuesCopy = (uint8_t*) malloc(width * height * sizeof(uint8_t));
-  memcpy(pixelValuesCopy, pixelValues, width*height * sizeof(uint8_t));
-  if (!postPadding) {
-    pixelValuesCopy = addStaticPad(pixelValuesCopy, coefficient, width, height, kernel->size);
-    padding = ((kernel->size)>>1);
-  } else {
-    padding = 0;
+  if (argc < 4 || !isBatchCommand((char*) argv[1])) {
+    batchUsage();
+    return 1;
   }
-  filteredValues = applyKernelArr(kernel->matrix, kernel->size, 1, pixelValuesCopy, width+padding*2, height+padding*2);
-  free(pixelValuesCopy);
-  return filteredValues;
-}
-
-int applySobelPgm(char* inputFileName, char* outputFileName) {
-  uint8_t *arr, *pixelValues;
-  int width, height, widthNoPad, heightNoPad, xDirValue, yDirValue, *verPrewittArr,
-      *horPrewittArr, *filteredIntegers, padding, kernelSize = 3;
-  size_t i, j;
-  arr = rBinaryPgm(inputFileName, &width, &height);
-  if (!arr) {
-    setColor(YELLOW);
-    printf("Trying ASCII pgm format...\n");
-    setColor(RESET);
-    arr = rAsciiPgm(inputFileName, &width, &height);
+  if (!strcmp(argv[1], "canny"))
+    options.windowSize = DEFAULT_CANNY_WINDOW_SIZE;
+  for (i = 4; i < argc; i++) {
+    if (!strcmp(argv[i], "-k") && i+1 < argc) {
+      kernelFileName = (char*) argv[++i];
+    } else if (!strcmp(argv[i], "-j") && i+1 < argc && isIntegerStr((char*) argv[i+1]) && atoi(argv[i+1]) > 0) {
+      workerCount = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i+1 < argc && isIntegerStr((char*) argv[i+1])) {
+      options.windowSize = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-g") && i+1 < argc && parseGradientType((char*) argv[i+1], &options.gradientType)) {
+      i++;
+    } else if (!strcmp(argv[i], "-e") && i+1 < argc && parseEdgeThresholds((char*) argv[i+1], &options.lowThreshold, &options.highThreshold)) {
+      i++;
+    } else if (!strcmp(argv[i], "-t") && i+1 < argc && isIntegerStr((char*) argv[i+1]) && atoi(argv[i+1]) > 0) {
+      options.context.threadCount = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--tile") && i+1 < argc && isIntegerStr((char*) argv[i+1]) && atoi(argv[i+1]) > 0) {
+      options.context.tileColumns = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-f") && i+1 < argc && parseOutputVersion((char*) argv[i+1], &options.outputVersion)) {
+      i++;
+    } else if (!strcmp(argv[i], "--stream")) {
+      options.streamRows = true;
+    } else if (!strcmp(argv[i], "--pool-stats")) {
+      showPoolStats = true;
+    } else if (!strcmp(argv[i], "--profile") && i+1 < argc && (!strcmp(argv[i+1], "csv") || !strcmp(argv[i+1], "json"))) {
+      profileFormat = !strcmp(argv[++i], "csv") ? PROFILE_REPORT_CSV : PROFILE_REPORT_JSON;
+    } else if (!strcmp(argv[i], "-p") && i+1 < argc && !options.stages) {
+      if (!parsePipeline((char*) argv[++i], &options.stages, &options.stageCount))
+        return 1;
+    } else {
+      setColor(RED);
+      printf("Error: invalid argument '%s'\n", argv[i]);
+      setColor(RESET);
+      batchUsage();
+      return 1;
+    }
   }
-  if (!arr)
-    return 1;
-  verPrewittArr = applyPrewittVertical(arr, width, height, true);
-  horPrewittArr = applyPrewittHorizontal(arr, width, height, true);
-  free(arr);
-  padding = (kernelSize>>1);
-  widthNoPad = width-padding*2;
-  heightNoPad = height-padding*2;
-  filteredIntegers = (int*) malloc(widthNoPad*heightNoPad*sizeof(int));
-  for (i = 0; i < heightNoPad; i++) {
-    for (j = 0; j < widthNoPad; j++) {
-      xDirValue = horPrewittArr[i*widthNoPad+j];
-      yDirValue = verPrewittArr[i*widthNoPad+j];
-      filteredIntegers[i*widthNoPad + j] = sqrt(xDirValue*xDirValue+yDirValue*yDirValue);
-    }
-  }
-  free(verPrewittArr);
-  free(horPrewittArr);
-  pixelValues = filterMinMax(filteredIntegers, width-padding*2, height-padding*2);
-  free(filteredIntegers);
-  pixelValues = addStaticPad(pixelValues, 0, width-padding*2, height-padding*2, kernelSize);
-  writeArrToPgm(pixelValues, width, height, outputFileName, 2);
-  free(pixelValues);
-  return 0;
-}
-
-int applyAvgPgm(char* inputFileName, char* outputFileName) {
-  uint8_t *arr, *pixelValues;
-  int width, height, *filteredIntegers, padding, kernelSize = 3;
-  arr = rBinaryPgm(inputFileName, &width, &height);
-  if (!arr) {
-    setColor(YELLOW);
-    printf("Trying ASCII pgm format...\n");
+  if (stat(argv[3], &outputStat) || !(outputStat.st_mode & S_IFDIR)) {
+    setColor(RED);
+    printf("Error: output directory %s doesn't exist\n", argv[3]);
     setColor(RESET);
-    arr = rAsciiPgm(inputFileName, &width, &height);
+    return 1;
   }
-  if (!arr)
+  if (!strcmp(argv[1], "pipeline") && (!options.stages || options.streamRows)) {
+    setColor(RED);
+    printf(options.stages ? "Error: pipelines can't be streamed\n" : "Error: pipeline command requires stages (-p)\n");
+    setColor(RESET);
+    free(options.stages);
     return 1;
-  filteredIntegers = applyAveraging(arr, width, height, true);
-  free(arr);
-  padding = (kernelSize>>1);
-  pixelValues = filterSlice(filteredIntegers, width-padding*2, height-padding*2);
-  free(filteredIntegers);
-  pixelValues = addStaticPad(pixelValues, 0, width-padding*2, height-padding*2, kernelSize);
-  writeArrToPgm(pixelValues, width, height, outputFileName, 2);
-  free(pixelValues);
-  return 0;
-}
-
-/*
-* Function: applyAveraging
-* --------------------------
-* returns a pointer to an array with averaging filter applied
-*
-* pixelValues: pointer to the array representing image that will be processed
-* width: image width without padding
-* height: image height without padding
-* postPadding: a bool value indicating whether the padding will be applied
-* before (false) or after (true) kernel
-*
-* returns: a pointer to the newly allocated array after processing
-*/
-int* applyAveraging(uint8_t* pixelValues, int width, int height, bool postPadding) {
-  int staticKernel[3*3] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
-  int kernelSize = 3, *kernel, padding, *filteredValues;
-  uint8_t *pixelValuesCopy;
-  if (!doesKernelFit(kernelSize, width, height) && !postPadding) {
+  }
+  setDefaultSettings(&settings);
+  if (!strcmp(argv[1], "custom") || pipelineUses(&options, "custom")) {
+    if (!kernelFileName) {
+      setColor(RED);
+      printf("Error: custom command requires a settings file (-k)\n");
+      setColor(RESET);
+      free(options.stages);
+      return 1;
+    }
+    if (!readKernelFile(kernelFileName, &kernel, &settings)) {
+      free(options.stages);
+      return 1;
+    }
+  }
+  if (!listPgmFiles((char*) argv[2], &files) || !files.count) {
     setColor(RED);
-    printf("Kernel too be big to be applied without pre-padding\n");
+    printf("Error: no PGM files found in %s\n", argv[2]);
     setColor(RESET);
-    return NULL;
+    freeFileList(&files);
+    free(kernel.matrix);
+    free(options.stages);
+    return 1;
+  }
+  qsort(files.names, files.count, sizeof(char*), compareFileNames);
+  if (!listOutputNames(&files, (char*) argv[3], (char*) argv[1], &outputs)) {
+    freeFileList(&outputs);
+    freeFileList(&files);
+    free(kernel.matrix);
+    free(options.stages);
+    return 1;
+  }
+  job.command = (char*) argv[1];
+  job.outputDir = (char*) argv[3];
+  job.files = &files;
+  job.outputs = &outputs;
+  job.kernel = &kernel;
+  job.settings = &settings;
+  job.options = &options;
+  job.nextFile = 0;
+  job.failed = 0;
+  job.profiles = profileFormat ? (image_profile*) calloc(files.count, sizeof(image_profile)) : NULL;
+  memset(&job.totals, 0, sizeof(image_profile));
+  initMutex(&job.lock);
+  if (workerCount > files.count)
+    workerCount = files.count;
+  workers = (worker_thread*) malloc(workerCount * sizeof(worker_thread));
+  // the calling thread takes part as the first worker
+  for (startedWorkers = 0; startedWorkers < workerCount-1; startedWorkers++) {
+    if (!startThread(workers + startedWorkers, batchWorker, &job))
+      break;
   }
-  kernel = staticToDynamicKernel(staticKernel, kernelSize);
-  pixelValuesCopy = (uint8_t*) malloc(width * height * sizeof(uint8_t));
-  memcpy(pixelValuesCopy, pixelValues, width*height * sizeof(uint8_t));
-  if (!postPadding) {
-    pixelValuesCopy = addStaticPad(pixelValuesCopy, 0, width, height, kernelSize);
-    padding = (kernelSize>>1);
+  batchWorker(&job);
+  for (i = 0; i < startedWorkers; i++)
+    joinThread(workers[i]);
+  destroyMutex(&job.lock);
+  if (job.failed) {
+    setColor(RED);
+    printf("%d of %d files failed\n", job.failed, files.count);
   } else {
-    padding = 0;
+    setColor(GREEN);
+    printf("Processed %d files\n", files.count);
   }
-  filteredValues = applyKernelArr(kernel, kernelSize, 0.11111, pixelValuesCopy, width+padding*2, height+padding*2);
-  free(pixelValuesCopy);
-  free(kernel);
-  return filteredValues;
+  setColor(RESET);
+  printProfileSummary(&job.totals);
+  if (showPoolStats)
+    printPoolStats();
+  if (profileFormat && (!job.profiles || !writeProfileReport(job.outputDir, profileFormat, &files, job.profiles)))
+    job.failed++;
+  free(job.profiles);
+  free(workers);
+  freeFileList(&outputs);
+  freeFileList(&files);
+  free(kernel.matrix);
+  free(options.stages);
+  return job.failed ? 1 : 0;
 }
 
-int applyVerPrewittPgm(char* inputFileName, char* outputFileName) {
-  uint8_t *arr, *pixelValues;
-  int width, height, *filteredIntegers, padding, kernelSize = 3;
-  arr = rBinaryPgm(inputFileName, &width, &height);
-  if (!arr) {
-    setColor(YELLOW);
-    printf("Trying ASCII pgm format...\n");
-    setColor(RESET);
-    arr = rAsciiPgm(inputFileName, &width, &height);
-  }
-  if (!arr)
-    return 1;
-  filteredIntegers = applyPrewittVertical(arr, width, height, true);
-  free(arr);
-  padding = (kernelSize>>1);
-  pixelValues = filterSlice(filteredIntegers, width-padding*2, height-padding*2);
-  free(filteredIntegers);
-  pixelValues = addStaticPad(pixelValues, 0, width-padding*2, height-padding*2, kernelSize);
-  writeArrToPgm(pixelValues, width, height, outputFileName, 2);
-  free(pixelValues);
-  return 0;
+void batchUsage() {
+  printf(
+          "Usage: kernel command input output-dir [-k settings-file] [-s size] [-g l2|l1|sq]\n"
+          "                                       [-e low,high] [-j workers] [-t threads] [-f p2|p5] [--stream]\n"
+          "                                       [-p stages] [--pool-stats] [--profile csv|json]\n"
+          "                                       [--tile columns]\n"
+          "command\t\t\t- one of avg, median, verprewitt, sobel, canny, custom, pipeline\n"
+          "input\t\t\t- a directory or a glob pattern (e.g. 'scans/*.pgm')\n"
+          "output-dir\t\t- existing directory for the processed files\n"
+          "-k settings-file\t- kernel and settings for the custom command\n"
+          "-s size\t\t\t- window size of the avg and median commands (default %d), smoothing\n"
+          "\t\t\t  window of canny (default %d, at most %d)\n"
+          "-g l2|l1|sq\t\t- sobel and canny magnitude: exact, |x|+|y| or x*x+y*y (default l2)\n"
+          "-e low,high\t\t- canny keeps the edges above high and the pixels above low\n"
+          "\t\t\t  connected to them (default %d,%d)\n"
+          "-j workers\t\t- number of files processed in parallel (default %d)\n"
+          "-t threads\t\t- number of threads each image is split over (default %d)\n"
+          "-f p2|p5\t\t- writes ASCII (default) or binary PGM files\n"
+          "--stream\t\t- reads, filters and writes a few rows at a time, for images\n"
+          "\t\t\t  that don't fit in memory\n"
+          "-p stages\t\t- steps of the pipeline command, e.g. 'median:5 | avg:3 | sobel | minmax'\n"
+          "\t\t\t  filters: avg[:size] median[:size] verprewitt sobel[:l2|l1|sq] canny[:low,high]\n"
+          "\t\t\t  custom\n"
+          "\t\t\t  pointwise: minmax invert threshold:value\n"
+          "--pool-stats\t\t- prints how often image buffers were reused and the peak memory\n"
+          "--profile csv|json\t- writes the time, bytes and buffers of every stage of every file\n"
+          "\t\t\t  to output-dir/profile.csv or profile.json\n"
+          "--tile columns\t\t- width of the cache tiles of big masks and medians (default\n"
+          "\t\t\t  sized from the L2 cache)\n"
+          "\n"
+          "Usage: kernel bench output-dir [-i input] [-z sizes] [-r repeats] [-t threads] [-o csv|json]\n"
+          "                               [--tile columns]\n"
+          "output-dir\t\t- existing directory for the files of the reader and writer runs\n"
+          "-i input\t\t- PGM files measured next to the generated images\n"
+          "-z sizes\t\t- generated image sizes, e.g. '512,1920x1080' (default %s)\n"
+          "-r repeats\t\t- runs of every operation, the fastest is reported (default %d)\n"
+          "-o csv|json\t\t- format of the report (default csv)\n"
+          "Run without arguments for the interactive mode\n",
+          DEFAULT_WINDOW_SIZE, DEFAULT_CANNY_WINDOW_SIZE, MAX_CANNY_WINDOW_SIZE, DEFAULT_CANNY_LOW, DEFAULT_CANNY_HIGH,
+          DEFAULT_WORKER_COUNT, DEFAULT_THREAD_COUNT, DEFAULT_BENCH_SIZES, DEFAULT_BENCH_REPEATS
+        );
+}
+
+bool isBatchCommand(char* command) {
+  return !strcmp(command, "avg") || !strcmp(command, "median") || !strcmp(command, "verprewitt")
+      || !strcmp(command, "sobel") || !strcmp(command, "canny") || !strcmp(command, "custom")
+      || !strcmp(command, "pipeline");
 }
 
 /*
-* Function: applyPrewittVertical
+* Function: runCommand
 * --------------------------
-* returns a pointer to an array with vertical edge detection filter applied
+* applies a command to a single file
 *
-* pixelValues: pointer to the array representing image that will be processed
-* width: image width without padding
-* height: image height without padding
-* postPadding: a bool value indicating whether the padding will be applied
-* before (false) or after (true) kernel
+* command: one of the batch commands
+* inputFileName: the file that will be processed
+* outputFileName: the file the result will be written to
+* kernel: mask used by the custom command
+* settings: settings used by the custom command
+* options: optional parameters of the command
 *
-* returns: a pointer to the newly allocated array after processing
+* returns: 0 on success
 */
-int* applyPrewittVertical(uint8_t* pixelValues, int width, int height, bool postPadding) {
-  int staticKernel[3*3] = {1, 1, 1, 0, 0, 0, -1, -1, -1};
-  int kernelSize = 3, *kernel, padding, *filteredValues;
-  uint8_t *pixelValuesCopy;
-  if (!doesKernelFit(kernelSize, width, height) && !postPadding) {
-    setColor(RED);
-    printf("Kernel too be big to be applied without pre-padding\n");
-    setColor(RESET);
-    return NULL;
-  }
-  kernel = staticToDynamicKernel(staticKernel, kernelSize);
-  pixelValuesCopy = (uint8_t*) malloc(width * height * sizeof(uint8_t));
-  memcpy(pixelValuesCopy, pixelValues, width*height * sizeof(uint8_t));
-  if (!postPadding) {
-    pixelValuesCopy = addStaticPad(pixelValuesCopy, 0, width, height, kernelSize);
-    padding = (kernelSize>>1);
-  } else {
-    padding = 0;
+int runCommand(char* command, char* inputFileName, char* outputFileName, mask* kernel, kernel_settings* settings, command_options* options) {
+  if (options->streamRows)
+    return streamCommand(command, inputFileName, outputFileName, kernel, settings, options);
+  if (!strcmp(command, "avg"))
+    return applyAvgPgm(inputFileName, outputFileName, options->windowSize, options->outputVersion);
+  if (!strcmp(command, "median"))
+    return applyMedianPgm(inputFileName, outputFileName, options->windowSize, options->outputVersion);
+  if (!strcmp(command, "verprewitt"))
+    return applyVerPrewittPgm(inputFileName, outputFileName, options->outputVersion);
+  if (!strcmp(command, "sobel"))
+    return applySobelPgm(inputFileName, outputFileName, options->gradientType, options->outputVersion);
+  if (!strcmp(command, "canny"))
+    return applyCannyPgm(inputFileName, outputFileName, options->windowSize, options->gradientType,
+                         options->lowThreshold, options->highThreshold, options->outputVersion);
+  if (!strcmp(command, "custom"))
+    return applyCustomKernelPgm(kernel, settings, inputFileName, outputFileName, options->outputVersion);
+  if (!strcmp(command, "pipeline"))
+    return runPipeline(inputFileName, outputFileName, kernel, settings, options);
+  return 1;
+}
+
+void* batchWorker(void* arg) {
+  batch_job* job = (batch_job*) arg;
+  int fileIndex, status;
+  image_profile profile;
+  currentContext = &job->options->context;
+  while (true) {
+    lockMutex(&job->lock);
+    fileIndex = job->nextFile++;
+    unlockMutex(&job->lock);
+    if (fileIndex >= job->files->count)
+      break;
+    startProfile(&profile);
+    status = runCommand(job->command, job->files->names[fileIndex], job->outputs->names[fileIndex], job->kernel, job->settings, job->options);
+    stopProfile();
+    lockMutex(&job->lock);
+    if (status)
+      job->failed++;
+    addProfile(&job->totals, &profile);
+    if (job->profiles)
+      job->profiles[fileIndex] = profile;
+    unlockMutex(&job->lock);
   }
-  filteredValues = applyKernelArr(kernel, kernelSize, 1, pixelValuesCopy, width+padding*2, height+padding*2);
-  free(pixelValuesCopy);
-  free(kernel);
-  return filteredValues;
+  currentContext = NULL;
+  return NULL;
 }
 
 /*
-* Function: applyPrewittHorizontal
+* Function: streamCommand
 * --------------------------
-* returns a pointer to an array with horizontal edge detection filter applied
+* applies a command like runCommand, but holds only a window of
+* STREAM_BLOCK_ROWS + kernelSize - 1 input rows at a time. Rows are read,
+* filtered and written block by block, the last kernelSize-1 rows of a
+* window are kept for the next one. Min-max normalized commands make a
+* first pass that only collects the range of the filter
 *
-* pixelValues: pointer to the array representing image that will be processed
-* width: image width without padding
-* height: image height without padding
-* postPadding: a bool value indicating whether the padding will be applied
-* before (false) or after (true) kernel
+* command: the command to apply
+* inputFileName: the input PGM file
+* outputFileName: the output PGM file
+* kernel: mask used by the custom command, NULL otherwise
+* settings: settings used by the custom command, NULL otherwise
+* options: optional parameters of the command
 *
-* returns: a pointer to the newly allocated array after processing
+* returns: 0 on success, 1 on failure
 */
-int* applyPrewittHorizontal(uint8_t* pixelValues, int width, int height, bool postPadding) {
-  int staticKernel[3*3] = {1, 0, -1, 1, 0, -1, 1, 0, -1};
-  int kernelSize = 3, *kernel, padding, *filteredValues;
-  uint8_t *pixelValuesCopy;
-  if (!doesKernelFit(kernelSize, width, height) && !postPadding) {
+int streamCommand(char* command, char* inputFileName, char* outputFileName, mask* kernel, kernel_settings* settings, command_options* options) {
+  stream_job job;
+  pgm_reader reader;
+  pgm_writer writer;
+  uint8_t *window, *framed, *border;
+  int padding, width, blockRows, windowRows, newRows, readRows, outputRows = 0, pass, i;
+  bool failed = false, repeatEdge;
+  padding_mode frame = {PADDING_ZERO, 0};
+  job.command = command;
+  job.kernel = kernel;
+  job.settings = settings;
+  job.options = options;
+  job.kernelSize = 3;
+  job.normalizationType = NORMALIZE_SLICE;
+  job.rangeFound = false;
+  if (!strcmp(command, "canny")) {
     setColor(RED);
-    printf("Kernel too be big to be applied without pre-padding\n");
+    printf("Error: canny can't be streamed, its edges may cross the whole image\n");
     setColor(RESET);
-    return NULL;
+    return 1;
   }
-  kernel = staticToDynamicKernel(staticKernel, kernelSize);
-  pixelValuesCopy = (uint8_t*) malloc(width * height * sizeof(uint8_t));
-  memcpy(pixelValuesCopy, pixelValues, width*height * sizeof(uint8_t));
-  if (!postPadding) {
-    pixelValuesCopy = addStaticPad(pixelValuesCopy, 0, width, height, kernelSize);
-    padding = (kernelSize>>1);
-  } else {
-    padding = 0;
+  if (!strcmp(command, "avg") || !strcmp(command, "median")) {
+    job.kernelSize = options->windowSize;
+  } else if (!strcmp(command, "sobel")) {
+    job.normalizationType = NORMALIZE_MINMAX;
+  } else if (!strcmp(command, "custom")) {
+    if (!settings->postPadding) {
+      setColor(RED);
+      printf("Error: --stream needs the custom kernel to be applied before padding\n");
+      setColor(RESET);
+      return 1;
+    }
+    job.kernelSize = kernel->size;
+    job.normalizationType = settings->normalizationType ? NORMALIZE_MINMAX : NORMALIZE_SLICE;
+    frame = settings->padding;
+    // only the rows next to the current one are kept, 1 row of mirror is a replicate
+    if (frame.type == PADDING_WRAP || (frame.type == PADDING_MIRROR && kernel->size > 3)) {
+      setColor(RED);
+      printf("Error: --stream supports zero, constant and replicate padding\n");
+      setColor(RESET);
+      return 1;
+    }
   }
-  filteredValues = applyKernelArr(kernel, kernelSize, 1, pixelValuesCopy, width+padding*2, height+padding*2);
-  free(pixelValuesCopy);
-  free(kernel);
-  return filteredValues;
-}
-
-uint8_t* rBinaryPgm(char* fileName, int* width, int* height) {
-  FILE* picture;
-  uint8_t* pixelValues;
-  int numberHolder;
-  if (!(picture = fopen(fileName, "rb"))) {
+  repeatEdge = frame.type == PADDING_REPLICATE || frame.type == PADDING_MIRROR;
+  if (job.kernelSize <= 0 || !(job.kernelSize%2)) {
     setColor(RED);
-    printf("Couldn't read %s\nProbably doesn't exist\n", fileName);
+    printf("Error: window size must be greater than 0 and odd\n");
     setColor(RESET);
-    return NULL;
+    return 1;
   }
-  if (!isBinaryPgm(picture)) {
+  if (!strcmp(command, "median") && job.kernelSize > MAX_MEDIAN_WINDOW_SIZE) {
     setColor(RED);
-    printf("%s is not a binary PGM file\n", fileName);
+    printf("Error: window size must be odd and in [1-%d]\n", MAX_MEDIAN_WINDOW_SIZE);
     setColor(RESET);
-    fclose(picture);
-    return NULL;
+    return 1;
   }
-  skipComments(picture);
-  fscanf(picture, "%d %d", width, height);
-  // get maximum value
-  skipComments(picture);
-  fscanf(picture, "%d", &numberHolder);
-  fgetc(picture);
-  // rowWidth is the width plus the padding on both sides
-  pixelValues = (uint8_t*) malloc((*height) * (*width) * sizeof(uint8_t));
-  if (!pixelValues) {
+  if (!openPgmReader(&reader, inputFileName, NULL))
+    return 1;
+  width = job.width = reader.width;
+  if (!doesKernelFit(job.kernelSize, reader.width, reader.height)) {
+    setColor(RED);
+    printf("Error: %dx%d window doesn't fit in %s\n", job.kernelSize, job.kernelSize, inputFileName);
+    setColor(RESET);
+    closePgmReader(&reader);
+    return 1;
+  }
+  padding = job.kernelSize >> 1;
+  // enough rows for every thread to get a band
+  blockRows = STREAM_BLOCK_ROWS;
+  if (blockRows < MIN_BAND_ROWS * options->context.threadCount)
+    blockRows = MIN_BAND_ROWS * options->context.threadCount;
+  // the buffers of a block are allocated once for the whole image
+  window = (uint8_t*) poolAlloc((size_t)(blockRows + job.kernelSize - 1) * width * sizeof(uint8_t));
+  framed = (uint8_t*) poolAlloc((size_t) blockRows * width * sizeof(uint8_t));
+  border = (uint8_t*) poolAlloc(width * sizeof(uint8_t));
+  job.output = (uint8_t*) poolAlloc((size_t) blockRows * (width - padding*2) * sizeof(uint8_t));
+  if (border)
+    memset(border, getPaddingValue(&frame), width);
+  if (!window || !framed || !border || !job.output
+      || !initFramedRowSink(&job.sink, job.normalizationType, width - padding*2, blockRows, 0, NULL, job.output)) {
     setColor(RED);
     printf("%s:%d > Failed to allocate memory\n", __FILE__, __LINE__);
     setColor(RESET);
-    return NULL;
+    poolRelease(window);
+    poolRelease(framed);
+    poolRelease(border);
+    poolRelease(job.output);
+    closePgmReader(&reader);
+    return 1;
   }
-  fread(pixelValues, sizeof(uint8_t), (*width) * (*height), picture);
-  fclose(picture);
-  return pixelValues;
+  // min-max rows are scaled straight into the output of the block
+  job.sink.pixels = job.output;
+  for (pass = job.normalizationType == NORMALIZE_MINMAX ? 0 : 1; pass < 2 && !failed; pass++) {
+    job.collectRange = !pass;
+    if (pass && job.normalizationType == NORMALIZE_MINMAX)
+      setSinkRange(&job.sink, job.srcMin, job.srcMax);
+    rewindPgmReader(&reader);
+    if (pass && !openPgmWriter(&writer, outputFileName, width, reader.height, options->outputVersion)) {
+      failed = true;
+      break;
+    }
+    windowRows = 0;
+    for (readRows = 0; readRows < reader.height && !failed; readRows += newRows) {
+      newRows = blockRows + job.kernelSize - 1 - windowRows;
+      if (newRows > reader.height - readRows)
+        newRows = reader.height - readRows;
+      beginStage(PROFILE_READ);
+      failed = !readPgmRows(&reader, window + (size_t) windowRows * width, newRows);
+      endStage((size_t) newRows * width);
+      if (failed)
+        break;
+      windowRows += newRows;
+      if (windowRows < job.kernelSize)
+        continue;
+      beginStage(PROFILE_FILTER);
+      failed = !filterStreamRows(&job, window, windowRows);
+      endStage((size_t) windowRows * width * 2);
+      if (failed)
+        break;
+      if (pass) {
+        outputRows = windowRows - job.kernelSize + 1;
+        beginStage(PROFILE_PAD);
+        for (i = 0; i < outputRows; i++)
+          frameStreamRow(framed + (size_t) i*width, job.output + (size_t) i*(width - padding*2), width, padding, &frame);
+        endStage((size_t) outputRows * padding * 2);
+        // the rows above the first output row copy it or are constant
+        for (i = 0; i < padding && readRows == 0; i++)
+          writePgmRows(&writer, repeatEdge ? framed : border, 1);
+        // a failed write is reported when the writer is closed
+        if (!writePgmRows(&writer, framed, outputRows))
+          break;
+      }
+      memmove(window, window + (size_t)(windowRows - job.kernelSize + 1) * width, (size_t)(job.kernelSize - 1) * width);
+      windowRows = job.kernelSize - 1;
+    }
+    // ASCII files must not have pixels after the last row
+    if (!failed && readRows >= reader.height && !checkPgmEnd(&reader))
+      failed = true;
+    if (pass && !failed) {
+      for (i = 0; i < padding; i++)
+        writePgmRows(&writer, repeatEdge ? framed + (size_t)(outputRows - 1) * width : border, 1);
+    }
+    if (pass)
+      failed = !closePgmWriter(&writer, failed ? NULL : outputFileName) || failed;
+  }
+  freeRowSink(&job.sink);
+  poolRelease(window);
+  poolRelease(framed);
+  poolRelease(border);
+  poolRelease(job.output);
+  closePgmReader(&reader);
+  return failed;
 }
 
-uint8_t* rAsciiPgm(char* fileName, int* width, int* height) {
-  FILE* picture;
-  uint8_t* pixelValues;
-  size_t i = 0;
-  int numberHolder;
-  if (!(picture = fopen(fileName, "rb"))) {
-    setColor(RED);
-    printf("Couldn't read %s\nProbably doesn't exist\n", fileName);
-    setColor(RESET);
-    return NULL;
+/*
+* Function: filterStreamRows
+* --------------------------
+* applies the command of a stream job to a window of rows, the
+* (rowCount-kernelSize+1) output rows of (width-kernelSize+1) pixels are
+* left in job->output unless the job only collects its range
+*
+* job: the stream job
+* window: rowCount rows of job->width pixels
+* rowCount: number of rows in window, at least job->kernelSize, at most
+* the block rows the sink of the job was made for plus kernelSize-1
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool filterStreamRows(stream_job* job, uint8_t* window, int rowCount) {
+  row_sink* sink = &job->sink;
+  int kernelSize = job->kernelSize, width = job->width, outputRows = rowCount - kernelSize + 1;
+  bool applied;
+  size_t i;
+  if (!strcmp(job->command, "median"))
+    return applyMedianArr(kernelSize, window, width, rowCount, job->output, width - kernelSize + 1);
+  if (!strcmp(job->command, "avg"))
+    applied = applyBoxFilter(window, width, rowCount, kernelSize, NULL, sink);
+  else if (!strcmp(job->command, "verprewitt"))
+    applied = applyPrewittVertical(window, width, rowCount, NULL, sink);
+  else if (!strcmp(job->command, "sobel"))
+    applied = applyGradientMagnitude(window, width, rowCount, job->options->gradientType, sink);
+  else
+    applied = applyCustomKernel(job->kernel, job->settings->coefficient, window, width, rowCount, NULL, sink);
+  if (!applied || job->normalizationType != NORMALIZE_MINMAX)
+    return applied;
+  if (job->collectRange) {
+    for (i = 0; i < outputRows; i++) {
+      if (!job->rangeFound || sink->rowMin[i] < job->srcMin)
+        job->srcMin = sink->rowMin[i];
+      if (!job->rangeFound || sink->rowMax[i] > job->srcMax)
+        job->srcMax = sink->rowMax[i];
+      job->rangeFound = true;
+    }
+    return true;
+  }
+  beginStage(PROFILE_NORMALIZE);
+  scaleSinkRange(sink, outputRows);
+  endStage((size_t) outputRows * sink->width);
+  return true;
+}
+
+/*
+* Function: frameStreamRow
+* --------------------------
+* adds the left and right padding to an output row, like fillPadding
+*
+* framed: array of width pixels the row is written to
+* row: the width-padding*2 output pixels
+* width: image width
+* padding: padding on each side
+* frame: how the padding is filled
+*/
+void frameStreamRow(uint8_t* framed, uint8_t* row, int width, int padding, padding_mode* frame) {
+  int rowWidth = width - padding*2, i, source;
+  memcpy(framed + padding, row, rowWidth * sizeof(uint8_t));
+  for (i = 1; i <= padding; i++) {
+    source = borderIndex(-i, rowWidth, frame->type);
+    framed[padding - i] = source < 0 ? getPaddingValue(frame) : row[source];
+    source = borderIndex(rowWidth - 1 + i, rowWidth, frame->type);
+    framed[padding + rowWidth - 1 + i] = source < 0 ? getPaddingValue(frame) : row[source];
+  }
+}
+
+/*
+* Function: parsePipeline
+* --------------------------
+* parses a pipeline description, stages separated by '|' such as
+* "median:5 | avg:3 | sobel | minmax" or "canny:30,90"
+*
+* description: the pipeline description
+* stages: set to the newly allocated stages
+* stageCount: set to the number of stages
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool parsePipeline(char* description, pipeline_stage** stages, int* stageCount) {
+  char *copy, *stage, *end, *trail;
+  int capacity = 1;
+  for (end = description; *end; end++)
+    capacity += *end == '|';
+  copy = (char*) malloc(strlen(description) + 1);
+  *stages = (pipeline_stage*) malloc(capacity * sizeof(pipeline_stage));
+  *stageCount = 0;
+  if (!copy || !*stages) {
+    free(copy);
+    free(*stages);
+    *stages = NULL;
+    return false;
+  }
+  strcpy(copy, description);
+  for (stage = copy; stage; stage = end) {
+    end = strchr(stage, '|');
+    if (end)
+      *end++ = '\0';
+    while (isSpace(*stage))
+      stage++;
+    for (trail = stage + strlen(stage); trail > stage && isSpace(*(trail-1)); trail--)
+      *(trail-1) = '\0';
+    if (!parseStage(stage, *stages + *stageCount)) {
+      setColor(RED);
+      printf("Error: invalid pipeline stage '%s'\n", stage);
+      setColor(RESET);
+      free(copy);
+      free(*stages);
+      *stages = NULL;
+      return false;
+    }
+    (*stageCount)++;
+  }
+  free(copy);
+  return true;
+}
+
+/*
+* Function: parseStage
+* --------------------------
+* parses a single "command[:argument]" pipeline stage
+*
+* str: the stage without surrounding spaces
+* stage: the stage to fill
+*
+* returns: false if the command or its argument is not valid
+*/
+bool parseStage(char* str, pipeline_stage* stage) {
+  char* argument = strchr(str, ':');
+  size_t length = argument ? (size_t) (argument++ - str) : strlen(str);
+  if (length >= STAGE_NAME_SIZE)
+    return false;
+  memcpy(stage->command, str, length);
+  stage->command[length] = '\0';
+  str = stage->command;
+  stage->windowSize = DEFAULT_WINDOW_SIZE;
+  stage->gradientType = GRADIENT_L2;
+  stage->threshold = 0;
+  stage->lowThreshold = DEFAULT_CANNY_LOW;
+  stage->highThreshold = DEFAULT_CANNY_HIGH;
+  stage->pointwise = !strcmp(str, "minmax") || !strcmp(str, "invert") || !strcmp(str, "threshold");
+  if (!strcmp(str, "avg") || !strcmp(str, "median")) {
+    if (argument && (!isIntegerStr(argument) || !*argument))
+      return false;
+    if (argument)
+      stage->windowSize = atoi(argument);
+    return stage->windowSize > 0 && stage->windowSize % 2
+        && (strcmp(str, "median") || stage->windowSize <= MAX_MEDIAN_WINDOW_SIZE);
+  }
+  if (!strcmp(str, "sobel"))
+    return !argument || parseGradientType(argument, &stage->gradientType);
+  if (!strcmp(str, "canny")) {
+    stage->windowSize = DEFAULT_CANNY_WINDOW_SIZE;
+    return !argument || parseEdgeThresholds(argument, &stage->lowThreshold, &stage->highThreshold);
+  }
+  if (!strcmp(str, "threshold")) {
+    if (!argument || !*argument || !isIntegerStr(argument))
+      return false;
+    stage->threshold = atoi(argument);
+    return stage->threshold >= 0 && stage->threshold <= MAX_PIXEL_VAL + 1;
+  }
+  return !argument && (stage->pointwise || !strcmp(str, "verprewitt") || !strcmp(str, "custom"));
+}
+
+bool pipelineUses(command_options* options, char* command) {
+  int i;
+  for (i = 0; i < options->stageCount; i++) {
+    if (!strcmp(options->stages[i].command, command))
+      return true;
+  }
+  return false;
+}
+
+/*
+* Function: runPipeline
+* --------------------------
+* applies the stages of options to a PGM file in memory. Each filter stage
+* produces the same image its command would write, and takes over the
+* buffer of the previous stage. Adjacent pointwise stages are fused into a
+* single lookup table applied in place
+*
+* inputFileName: the input PGM file
+* outputFileName: the output PGM file
+* kernel: mask used by custom stages
+* settings: settings used by custom stages
+* options: holds the stages
+*
+* returns: 0 on success, 1 on failure
+*/
+int runPipeline(char* inputFileName, char* outputFileName, mask* kernel, kernel_settings* settings, command_options* options) {
+  pgm_map image;
+  uint8_t *pixelValues, *filteredValues, lut[HISTOGRAM_BINS];
+  int width, height, i, last;
+  bool written;
+  pixelValues = readPgm(inputFileName, &width, &height, &image);
+  if (!pixelValues)
+    return 1;
+  for (i = 0; i < options->stageCount; i = last) {
+    if (options->stages[i].pointwise) {
+      for (last = i; last < options->stageCount && options->stages[last].pointwise; last++);
+      beginStage(PROFILE_FILTER);
+      buildPointwiseLut(options->stages + i, last - i, pixelValues, (size_t) width * height, lut);
+      // the mapped input is read-only, any other buffer is owned by now
+      filteredValues = image.mapped ? (uint8_t*) poolAlloc((size_t) width * height * sizeof(uint8_t)) : pixelValues;
+      if (filteredValues)
+        applyLut(lut, pixelValues, filteredValues, width, height);
+    } else {
+      last = i + 1;
+      beginStage(PROFILE_FILTER);
+      filteredValues = filterStageImage(options->stages + i, pixelValues, width, height, kernel, settings);
+    }
+    endStage(filteredValues ? (size_t) width * height * 2 : 0);
+    if (filteredValues != pixelValues)
+      releasePgm(pixelValues, &image);
+    image.mapped = false;
+    if (!(pixelValues = filteredValues))
+      return 1;
   }
-  if (!isAsciiPgm(picture)) {
+  written = writeArrToPgm(pixelValues, width, height, outputFileName, options->outputVersion);
+  releasePgm(pixelValues, &image);
+  return written ? 0 : 1;
+}
+
+/*
+* Function: filterStageImage
+* --------------------------
+* applies a filter stage of a pipeline
+*
+* stage: a filter stage
+* pixelValues: the image
+* width: image width
+* height: image height
+* kernel: mask used by custom stages
+* settings: settings used by custom stages
+*
+* returns: a pointer to the newly allocated width*height result, NULL on failure
+*/
+uint8_t* filterStageImage(pipeline_stage* stage, uint8_t* pixelValues, int width, int height, mask* kernel, kernel_settings* settings) {
+  int kernelSize = 3;
+  if (!strcmp(stage->command, "avg") || !strcmp(stage->command, "median"))
+    kernelSize = stage->windowSize;
+  else if (!strcmp(stage->command, "custom"))
+    kernelSize = kernel->size;
+  else if (!strcmp(stage->command, "canny"))
+    kernelSize = stage->windowSize + 4;
+  if ((strcmp(stage->command, "custom") || settings->postPadding) && !doesKernelFit(kernelSize, width, height)) {
     setColor(RED);
-    printf("%s is not an ASCII PGM file\n", fileName);
+    printf("Error: %dx%d window of %s doesn't fit in the image\n", kernelSize, kernelSize, stage->command);
     setColor(RESET);
-    fclose(picture);
     return NULL;
   }
-  skipComments(picture);
-  fscanf(picture, "%d %d", width, height);
-  // get maximum value
-  skipComments(picture);
-  fscanf(picture, "%d", &numberHolder);
-  fgetc(picture);
-  pixelValues = (uint8_t*) malloc((*height) * (*width) * sizeof(uint8_t));
-  if (!pixelValues) {
+  if (!strcmp(stage->command, "avg"))
+    return filterAvgImage(pixelValues, width, height, stage->windowSize, NULL);
+  if (!strcmp(stage->command, "median"))
+    return filterMedianImage(pixelValues, width, height, stage->windowSize, NULL);
+  if (!strcmp(stage->command, "verprewitt"))
+    return filterVerPrewittImage(pixelValues, width, height, NULL);
+  if (!strcmp(stage->command, "sobel"))
+    return filterSobelImage(pixelValues, width, height, stage->gradientType, NULL);
+  if (!strcmp(stage->command, "canny"))
+    return filterCannyImage(pixelValues, width, height, stage->windowSize, stage->gradientType,
+                            stage->lowThreshold, stage->highThreshold, NULL);
+  return filterCustomImage(kernel, settings, pixelValues, width, height, NULL);
+}
+
+/*
+* Function: buildPointwiseLut
+* --------------------------
+* composes consecutive pointwise stages into one table. minmax stretches
+* the values present after the previous stages to [0-255] as filterMinMax
+* does, so the image is only scanned once to find the values it holds
+*
+* stages: the pointwise stages
+* stageCount: number of stages
+* pixelValues: the image the table will be applied to
+* pixelCount: number of pixels
+* lut: HISTOGRAM_BINS entries set to the composed mapping
+*/
+void buildPointwiseLut(pipeline_stage* stages, int stageCount, uint8_t* pixelValues, size_t pixelCount, uint8_t* lut) {
+  bool present[HISTOGRAM_BINS] = {false}, needsValues = false;
+  int i, value, srcMin, srcMax;
+  size_t j;
+  for (i = 0; i < stageCount; i++)
+    needsValues = needsValues || !strcmp(stages[i].command, "minmax");
+  for (j = 0; j < pixelCount && needsValues; j++)
+    present[pixelValues[j]] = true;
+  for (value = 0; value < HISTOGRAM_BINS; value++)
+    lut[value] = (uint8_t) value;
+  for (i = 0; i < stageCount; i++) {
+    if (!strcmp(stages[i].command, "minmax")) {
+      srcMin = MAX_PIXEL_VAL;
+      srcMax = 0;
+      for (value = 0; value < HISTOGRAM_BINS; value++) {
+        if (present[value] && lut[value] < srcMin)
+          srcMin = lut[value];
+        if (present[value] && lut[value] > srcMax)
+          srcMax = lut[value];
+      }
+      for (value = 0; value < HISTOGRAM_BINS; value++)
+        lut[value] = srcMax > srcMin ? scaleToPixel(lut[value] - srcMin, srcMax - srcMin, getScaleMultiplier(srcMax - srcMin)) : 0;
+    } else if (!strcmp(stages[i].command, "invert")) {
+      for (value = 0; value < HISTOGRAM_BINS; value++)
+        lut[value] = MAX_PIXEL_VAL - lut[value];
+    } else {
+      for (value = 0; value < HISTOGRAM_BINS; value++)
+        lut[value] = lut[value] >= stages[i].threshold ? MAX_PIXEL_VAL : 0;
+    }
+  }
+}
+
+/*
+* Function: applyLut
+* --------------------------
+* maps every pixel through a table, outputArr may be pixelValues
+*
+* lut: HISTOGRAM_BINS entries
+* pixelValues: the image
+* outputArr: array of width*height pixels for the result
+* width: image width
+* height: image height
+*/
+void applyLut(uint8_t* lut, uint8_t* pixelValues, uint8_t* outputArr, int width, int height) {
+  lut_job job;
+  job.lut = lut;
+  job.pixelValues = pixelValues;
+  job.outputArr = outputArr;
+  job.width = width;
+  runRowBands(height, applyLutRows, &job);
+}
+
+void applyLutRows(void* context, int firstRow, int lastRow) {
+  lut_job* job = (lut_job*) context;
+  size_t i, end = (size_t) lastRow * job->width;
+  for (i = (size_t) firstRow * job->width; i < end; i++)
+    job->outputArr[i] = job->lut[job->pixelValues[i]];
+}
+
+//operations measured by runBenchmark, the readers need the files of the writers before them
+static const char* benchOperations[] = {
+  "write-p2", "read-p2", "write-p5", "read-p5", "avg3", "avg9", "median3", "median5", "median9",
+  "verprewitt", "horprewitt", "sobel", "canny", "custom3", "custom5", "custom7", "custom9", "custom31", "separable9"
+};
+
+/*
+* Function: runBenchmark
+* --------------------------
+* measures every operation of benchOperations on generated images and on the
+* given PGM files and prints one record per image and operation with the
+* fastest time, megapixels per second, nanoseconds per pixel, the peak bytes
+* the operation took from the buffer pool and the peak resident memory of
+* the process so far, which only grows from one record to the next
+*
+* argc, argv: the program arguments in the form
+*   bench output-dir [-i input] [-z sizes] [-r repeats] [-t threads] [-o csv|json]
+*
+* returns: 0 if every operation succeeded, 1 otherwise
+*/
+int runBenchmark(int argc, char const *argv[]) {
+  int i, j, k, width, height, kernelSize, repeats = DEFAULT_BENCH_REPEATS, imageCount = 0, measured, records = 0, failed = 0;
+  int operationCount = sizeof(benchOperations) / sizeof(benchOperations[0]);
+  bool json = false;
+  char *input = NULL, sizes[INPUT_SIZE] = DEFAULT_BENCH_SIZES, *size, scratchName[INPUT_SIZE];
+  double start, seconds, best;
+  size_t baseBytes;
+  bench_image* images = NULL;
+  file_list files = {0, 0, NULL};
+  struct stat outputStat;
+  kernel_context context = {DEFAULT_THREAD_COUNT, 0};
+  if (argc < 3) {
+    batchUsage();
+    return 1;
+  }
+  for (i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "-i") && i+1 < argc) {
+      input = (char*) argv[++i];
+    } else if (!strcmp(argv[i], "-z") && i+1 < argc) {
+      snprintf(sizes, INPUT_SIZE, "%s", argv[++i]);
+    } else if (!strcmp(argv[i], "-r") && i+1 < argc && isIntegerStr((char*) argv[i+1]) && atoi(argv[i+1]) > 0) {
+      repeats = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-t") && i+1 < argc && isIntegerStr((char*) argv[i+1]) && atoi(argv[i+1]) > 0) {
+      context.threadCount = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--tile") && i+1 < argc && isIntegerStr((char*) argv[i+1]) && atoi(argv[i+1]) > 0) {
+      context.tileColumns = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-o") && i+1 < argc && (!strcmp(argv[i+1], "csv") || !strcmp(argv[i+1], "json"))) {
+      json = !strcmp(argv[++i], "json");
+    } else {
+      setColor(RED);
+      printf("Error: invalid argument '%s'\n", argv[i]);
+      setColor(RESET);
+      batchUsage();
+      return 1;
+    }
+  }
+  if (stat(argv[2], &outputStat) || !(outputStat.st_mode & S_IFDIR)) {
     setColor(RED);
-    printf("%s:%d > Failed to allocate memory\n", __FILE__, __LINE__);
+    printf("Error: output directory %s doesn't exist\n", argv[2]);
     setColor(RESET);
-    return NULL;
+    return 1;
   }
-  while (fscanf(picture, " %d ", &numberHolder) == 1) {
-    if (numberHolder > 255 || numberHolder < 0) {
+  for (size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+    if ((k = sscanf(size, "%dx%d", &width, &height)) == 1)
+      height = width;
+    if (k < 1 || width < MIN_KERNEL_SIZE || height < MIN_KERNEL_SIZE || !addBenchImage(&images, &imageCount, "synthetic", generateBenchImage(width, height), width, height)) {
       setColor(RED);
-      printf("Error: corrupt input. Some pixels are not in [0-255]\n");
+      printf("Error: invalid image size '%s'\n", size);
       setColor(RESET);
-      fclose(picture);
-      return NULL;
+      failed = 1;
+      break;
     }
-    pixelValues[i++] = numberHolder;
-  };
-  if (i != (*height) * (*width)) {
+  }
+  if (!failed && input && (!listPgmFiles(input, &files) || !files.count)) {
     setColor(RED);
-    printf("Error: corrupt input. Read %ld pixels, expected %d.\n", i, (*height) * (*width));
+    printf("Error: no PGM files found in %s\n", input);
     setColor(RESET);
-    fclose(picture);
-    return NULL;
+    failed = 1;
   }
-  fclose(picture);
-  return pixelValues;
+  if (files.count)
+    qsort(files.names, files.count, sizeof(char*), compareFileNames);
+  for (i = 0; i < files.count && !failed; i++) {
+    uint8_t* pixelValues = loadBenchImage(files.names[i], &width, &height);
+    if (!addBenchImage(&images, &imageCount, files.names[i], pixelValues, width, height))
+      failed = 1;
+  }
+  freeFileList(&files);
+  snprintf(scratchName, INPUT_SIZE, "%s%cbench.pgm", argv[2], PATH_SEP);
+  // images that couldn't be loaded end the run before the report starts
+  measured = failed ? 0 : imageCount;
+  currentContext = &context;
+  if (measured && json)
+    printf("[");
+  else if (measured)
+    printf("image,width,height,operation,threads,seconds,mpix_per_s,ns_per_pixel,peak_buffer_mb,cumulative_peak_rss_mb\n");
+  for (i = 0; i < measured; i++) {
+    for (j = 0; j < operationCount; j++) {
+      // filters without a size in their name are 3x3, masks bigger than the image are skipped
+      kernelSize = atoi(benchOperations[j] + strcspn(benchOperations[j], "0123456789"));
+      if (!strchr(benchOperations[j], '-') && !doesKernelFit(kernelSize > MIN_KERNEL_SIZE ? kernelSize : MIN_KERNEL_SIZE, images[i].width, images[i].height))
+        continue;
+      best = -1;
+      // the peak is counted from the buffers the images already hold
+      baseBytes = bufferPool.peakBytes = bufferPool.usedBytes;
+      for (k = 0; k < repeats; k++) {
+        start = getSeconds();
+        if (!runBenchOperation(j, images + i, scratchName))
+          break;
+        seconds = getSeconds() - start;
+        if (best < 0 || seconds < best)
+          best = seconds;
+      }
+      if (k < repeats) {
+        // stderr keeps the report on stdout parseable
+        fprintf(stderr, "Error: %s failed on %s\n", benchOperations[j], images[i].name);
+        failed = 1;
+        continue;
+      }
+      if (best <= 0)
+        best = 1e-9;
+      if (json) {
+        printf("%s\n  {\"image\": ", records ? "," : "");
+        printJsonString(stdout, images[i].name);
+      } else {
+        printf("%s", images[i].name);
+      }
+      printf(json ? ", \"width\": %d, \"height\": %d, \"operation\": \"%s\", \"threads\": %d, "
+                    "\"seconds\": %.6f, \"mpix_per_s\": %.2f, \"ns_per_pixel\": %.3f, \"peak_buffer_mb\": %.1f, \"cumulative_peak_rss_mb\": %.1f}"
+                  : ",%d,%d,%s,%d,%.6f,%.2f,%.3f,%.1f,%.1f\n",
+             images[i].width, images[i].height, benchOperations[j], context.threadCount,
+             best, (double) images[i].width * images[i].height / best / 1e6, best * 1e9 / ((double) images[i].width * images[i].height),
+             (bufferPool.peakBytes - baseBytes) / 1048576.0, getPeakMemory() / 1048576.0);
+      records++;
+    }
+  }
+  if (measured && json)
+    printf("\n]\n");
+  currentContext = NULL;
+  remove(scratchName);
+  for (i = 0; i < imageCount; i++)
+    poolRelease(images[i].pixelValues);
+  free(images);
+  return failed;
 }
 
-uint8_t* allocArrWithPad(int width, int height, int kernelSize) {
-  // divide by 2 (floor)
-  int padding = kernelSize>>1;
-  return (uint8_t*) malloc((width+padding*2)*(height+padding*2));
+bool addBenchImage(bench_image** images, int* imageCount, char* name, uint8_t* pixelValues, int width, int height) {
+  bench_image* grown;
+  char* baseName = name + strlen(name);
+  while (baseName > name && *(baseName-1) != '/' && *(baseName-1) != '\\')
+    baseName--;
+  if (!pixelValues)
+    return false;
+  if (!(grown = (bench_image*) realloc(*images, (*imageCount + 1) * sizeof(bench_image)))) {
+    poolRelease(pixelValues);
+    return false;
+  }
+  *images = grown;
+  snprintf(grown[*imageCount].name, BENCH_NAME_SIZE, "%s", baseName);
+  grown[*imageCount].pixelValues = pixelValues;
+  grown[*imageCount].width = width;
+  grown[*imageCount].height = height;
+  (*imageCount)++;
+  return true;
 }
 
 /*
-* Function: addStaticPad
+* Function: generateBenchImage
 * --------------------------
-* returns a pointer to an array with border padding set to paddingVal
-* and frees the pointer specified by pixelValues
+* returns an image of smooth gradients with a deterministic noise on top, so
+* the median sees varied windows and every run measures the same pixels
 *
-* pixelValues: pointer to the array that will be padded
-* paddingVal: the value that padded pixels will be set to
-* width: image width without padding
-* height: image height without padding
-* kernelSize: the length of kernel dimension
+* width: image width
+* height: image height
 *
-* returns: a pointer to the newly allocated array with padding
+* returns: a pointer to the image taken from the buffer pool, NULL on failure
 */
-uint8_t* addStaticPad(uint8_t* pixelValues, uint8_t paddingVal, int width, int height, int kernelSize) {
+uint8_t* generateBenchImage(int width, int height) {
+  uint32_t noise = 2463534242u;
   size_t i, j;
-  uint8_t* arrValues;
-  int padding = kernelSize>>1;
-  // rowWidth is the width plus the padding on both sides
-  int rowWidth = width + padding*2;
-  arrValues = allocArrWithPad(width, height, kernelSize);
-  if (!arrValues) {
-    setColor(RED);
-    printf("%s:%d > Failed to allocate memory\n", __FILE__, __LINE__);
-    setColor(RESET);
+  uint8_t* pixelValues = (uint8_t*) poolAlloc((size_t) width * height * sizeof(uint8_t));
+  if (!pixelValues)
     return NULL;
+  for (i = 0; i < height; i++) {
+    for (j = 0; j < width; j++) {
+      // xorshift32
+      noise ^= noise << 13;
+      noise ^= noise >> 17;
+      noise ^= noise << 5;
+      pixelValues[i*width + j] = (uint8_t)((i * 255 / height + j * 255 / width) / 2 + (noise & 31));
+    }
   }
-  //initialize padding rows with paddingVal
-  for (j=0, i=0; j < padding; i++, j++)
-    memset(arrValues + i*rowWidth, paddingVal, rowWidth);
-  //set pixelvalues adding padding at the beginning and end of each row
-  for (j=0; j < height; i++, j++) {
-    memset(arrValues + i*rowWidth, paddingVal, padding);
-    memcpy(arrValues + i*rowWidth+ padding, pixelValues + j*width, width * sizeof(uint8_t));
-    memset(arrValues + i*rowWidth + padding + width, paddingVal, padding);
+  return pixelValues;
+}
+
+/*
+* Function: loadBenchImage
+* --------------------------
+* reads a binary or ASCII PGM file into a buffer of the pool without the
+* messages of readPgm, which would mix with the report
+*
+* fileName: path of the PGM file
+* width: set to the image width
+* height: set to the image height
+*
+* returns: a pointer to the pixel values, NULL on failure
+*/
+uint8_t* loadBenchImage(char* fileName, int* width, int* height) {
+  char magic[MAGIC_NUMBER_SIZE + 1] = "";
+  uint8_t *view, *pixelValues;
+  pgm_map image;
+  FILE* file = fopen(fileName, "rb");
+  if (file) {
+    fgets(magic, sizeof(magic), file);
+    fclose(file);
   }
-  //initialize last padding rows with paddingVal
-  for (j=0; j < padding; i++,j++)
-    memset(arrValues + i*rowWidth, paddingVal, rowWidth);
-  free(pixelValues);
-  return arrValues;
+  if (strcmp(magic, "P5"))
+    return rAsciiPgm(fileName, width, height);
+  if (!(view = mapBinaryPgm(fileName, width, height, &image)))
+    return NULL;
+  if ((pixelValues = (uint8_t*) poolAlloc((size_t) *width * *height * sizeof(uint8_t))))
+    memcpy(pixelValues, view, (size_t) *width * *height * sizeof(uint8_t));
+  unmapFile(&image);
+  return pixelValues;
 }
 
-void removeExtension(char* filename, char* stripped) {
-  strcpy(stripped, filename);
-  char *end = stripped + strlen(stripped);
-  while (end > stripped && *end != '.' && *end != '\\' && *end != '/') {
-    end--;
+/*
+* Function: buildBenchKernel
+* --------------------------
+* fills a size x size mask for the custom operations, a separable one is the
+* outer product of binomial rows, the others are not separable
+*
+* kernel: the mask, its matrix is allocated
+* size: the mask dimension
+* separable: whether the mask is separable
+*/
+void buildBenchKernel(mask* kernel, int size, bool separable) {
+  int i, j, center = size >> 1, binomial[MAX_MEDIAN_WINDOW_SIZE];
+  kernel->size = size;
+  kernel->rowVector = kernel->colVector = NULL;
+  kernel->matrix = (int*) malloc(size * size * sizeof(int));
+  if (!kernel->matrix)
+    return;
+  for (i = 0; i < size; i++)
+    binomial[i] = i == 0 ? 1 : binomial[i-1] * (size - i) / i;
+  for (i = 0; i < size; i++) {
+    for (j = 0; j < size; j++) {
+      if (separable)
+        kernel->matrix[i*size + j] = binomial[i] * binomial[j];
+      else
+        kernel->matrix[i*size + j] = (i - center)*(i - center) - (j - center)*(j - center) + (i == center && j == center);
+    }
   }
-  if ((end > stripped && *end == '.') &&
-      (*(end - 1) != '\\' && *(end - 1) != '/')) {
-      *end = '\0';
+}
+
+/*
+* Function: runBenchOperation
+* --------------------------
+* runs one operation of benchOperations on an image, filters write to a
+* buffer that is released right away, the readers and writers use a file
+*
+* operation: index into benchOperations
+* image: the input image
+* scratchName: file written by the writers and read by the readers
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool runBenchOperation(int operation, bench_image* image, char* scratchName) {
+  const char* name = benchOperations[operation];
+  uint8_t *pixelValues = image->pixelValues, *filteredValues = NULL;
+  int width = image->width, height = image->height, readWidth, readHeight;
+  size_t i, checksum = 0;
+  pgm_writer writer;
+  pgm_map map;
+  mask kernel;
+  kernel_settings settings;
+  row_sink sink;
+  if (!strncmp(name, "write-", 6)) {
+    if (!openPgmWriter(&writer, scratchName, width, height, name[7] - '0'))
+      return false;
+    writePgmRows(&writer, pixelValues, height);
+    return closePgmWriter(&writer, NULL);
+  }
+  if (!strcmp(name, "read-p2")) {
+    filteredValues = rAsciiPgm(scratchName, &readWidth, &readHeight);
+  } else if (!strcmp(name, "read-p5")) {
+    // the pixels are touched so the mapping is paged in
+    if (!(filteredValues = mapBinaryPgm(scratchName, &readWidth, &readHeight, &map)))
+      return false;
+    for (i = 0; i < (size_t) readWidth * readHeight; i++)
+      checksum += filteredValues[i];
+    unmapFile(&map);
+    return checksum <= (size_t) readWidth * readHeight * MAX_PIXEL_VAL;
+  } else if (!strncmp(name, "avg", 3)) {
+    filteredValues = filterAvgImage(pixelValues, width, height, atoi(name + 3), NULL);
+  } else if (!strncmp(name, "median", 6)) {
+    filteredValues = filterMedianImage(pixelValues, width, height, atoi(name + 6), NULL);
+  } else if (!strcmp(name, "verprewitt")) {
+    filteredValues = filterVerPrewittImage(pixelValues, width, height, NULL);
+  } else if (!strcmp(name, "horprewitt")) {
+    if (initRowSink(&sink, NORMALIZE_SLICE, width - 2, height - 2)) {
+      if (applyPrewittHorizontal(pixelValues, width, height, NULL, &sink))
+        filteredValues = finishRowSink(&sink);
+      else
+        freeRowSink(&sink);
+    }
+  } else if (!strcmp(name, "sobel")) {
+    filteredValues = filterSobelImage(pixelValues, width, height, GRADIENT_L2, NULL);
+  } else if (!strcmp(name, "canny")) {
+    filteredValues = filterCannyImage(pixelValues, width, height, DEFAULT_CANNY_WINDOW_SIZE, GRADIENT_L2, DEFAULT_CANNY_LOW, DEFAULT_CANNY_HIGH, NULL);
+  } else if (!strncmp(name, "custom", 6) || !strncmp(name, "separable", 9)) {
+    setDefaultSettings(&settings);
+    buildBenchKernel(&kernel, atoi(name + strcspn(name, "0123456789")), name[0] == 's');
+    if (kernel.matrix)
+      filteredValues = filterCustomImage(&kernel, &settings, pixelValues, width, height, NULL);
+    free(kernel.matrix);
   }
+  poolRelease(filteredValues);
+  return filteredValues != NULL;
 }
 
-int* applyKernelArr(int* kernel, int kernelSize, float coefficient, uint8_t* pixelValues, int width, int height) {
-  int* outputArr;
-  int padding, areaWidth, areaHeight;
-  size_t i, j;
-  int (*applyKernelPix)(int*, int, float, uint8_t*, int, size_t, size_t) = applyKernelPixWithCo;
-  if (coefficient == 1)
-    applyKernelPix = applyKernelPixNoCo;
-  padding = kernelSize >> 1;
-  areaWidth = width - padding*2;
-  areaHeight = height - padding*2;
-  outputArr = (int*) malloc(areaWidth * areaHeight * sizeof(int));
-  for (i = 0; i < areaHeight; i++) {
-    for (j = 0; j < areaWidth; j++)
-      outputArr[i*areaWidth+j] = applyKernelPix(kernel, kernelSize, coefficient, pixelValues, width, i+padding, j+padding);
+/*
+* Function: runRowBands
+* --------------------------
+* splits rowCount rows into contiguous bands and runs process on each band,
+* using up to the threads of the current context. Every row is processed
+* exactly once by the same code as the serial path, so the result doesn't
+* depend on the number of threads
+*
+* rowCount: number of rows to be processed
+* process: function processing the rows in [firstRow, lastRow)
+* context: data passed to process
+*/
+void runRowBands(int rowCount, void (*process)(void*, int, int), void* context) {
+  int i, bandCount = getThreadCount(), startedBands;
+  row_band* bands;
+  worker_thread* threads;
+  if (bandCount > rowCount / MIN_BAND_ROWS)
+    bandCount = rowCount / MIN_BAND_ROWS;
+  if (bandCount <= 1) {
+    process(context, 0, rowCount);
+    return;
+  }
+  bands = (row_band*) malloc(bandCount * sizeof(row_band));
+  threads = (worker_thread*) malloc((bandCount-1) * sizeof(worker_thread));
+  if (!bands || !threads) {
+    free(bands);
+    free(threads);
+    process(context, 0, rowCount);
+    return;
   }
-  return outputArr;
+  for (i = 0; i < bandCount; i++) {
+    bands[i].process = process;
+    bands[i].context = context;
+    bands[i].profile = currentProfile;
+    bands[i].firstRow = (int)((long long) rowCount * i / bandCount);
+    bands[i].lastRow = (int)((long long) rowCount * (i+1) / bandCount);
+  }
+  // the calling thread takes the first band
+  for (startedBands = 1; startedBands < bandCount; startedBands++) {
+    if (!startThread(threads + startedBands-1, processBand, bands + startedBands))
+      break;
+  }
+  processBand(bands);
+  // bands that couldn't get a thread run on the calling thread
+  for (i = startedBands; i < bandCount; i++)
+    processBand(bands + i);
+  for (i = 1; i < startedBands; i++)
+    joinThread(threads[i-1]);
+  free(threads);
+  free(bands);
 }
 
-int applyKernelPixWithCo(int* kernel, int kernelSize, float coefficient, uint8_t* pixelValues, int width, size_t xLoc, size_t yLoc) {
-  size_t i, j;
-  int result = 0, kernelPadding, row;
-  kernelPadding = kernelSize >> 1;
-  for (i = 0; i < kernelSize; i++) {
-    row = xLoc+i-kernelPadding;
-    for (j = 0; j < kernelSize; j++){
-      result += pixelValues[(yLoc+j-kernelPadding)+row*width] * kernel[i*kernelSize+j];
+void* processBand(void* arg) {
+  row_band* band = (row_band*) arg;
+  currentProfile = band->profile;
+  band->process(band->context, band->firstRow, band->lastRow);
+  return NULL;
+}
+
+/*
+* Function: getThreadCount
+* --------------------------
+* returns the number of threads an image may be split over by the call the
+* thread runs, 1 outside of one
+*/
+int getThreadCount() {
+  return currentContext ? currentContext->threadCount : 1;
+}
+
+/*
+* Function: selectTileColumns
+* --------------------------
+* picks the number of output columns of the tiles a filter walks row by
+* row, so that the rows of a tile stay in half of the L2 cache while the
+* next output row reuses them. The tileColumns of the current context
+* (--tile) overrides the size
+*
+* bytesPerColumn: bytes a filter keeps per input column of a tile
+* haloColumns: input columns a tile reads beyond its output columns
+* areaWidth: number of output columns
+*
+* returns: the tile width, areaWidth when the rows fit without tiling
+*/
+int selectTileColumns(int bytesPerColumn, int haloColumns, int areaWidth) {
+  long columns = currentContext ? currentContext->tileColumns : 0;
+  if (columns <= 0) {
+    columns = getCacheSize() / 2 / bytesPerColumn - haloColumns;
+    // a narrower tile would mostly compute its halo
+    if (columns < TILE_MIN_COLUMNS || columns < haloColumns*4)
+      columns = TILE_MIN_COLUMNS > haloColumns*4 ? TILE_MIN_COLUMNS : haloColumns*4;
+  }
+  return columns < areaWidth ? (int) columns : areaWidth;
+}
+
+/*
+* Function: getCacheSize
+* --------------------------
+* returns the size of the L2 cache in bytes, DEFAULT_CACHE_SIZE if it can't be
+* detected
+*/
+long getCacheSize() {
+#ifdef _WIN32
+  SYSTEM_LOGICAL_PROCESSOR_INFORMATION info[64];
+  DWORD length = sizeof(info), i;
+  if (GetLogicalProcessorInformation(info, &length)) {
+    for (i = 0; i < length / sizeof(info[0]); i++) {
+      if (info[i].Relationship == RelationCache && info[i].Cache.Level == 2)
+        return info[i].Cache.Size;
     }
   }
-  return (int)((float)(result) * coefficient);
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+  long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (size > 0)
+    return size;
+#endif
+  return DEFAULT_CACHE_SIZE;
 }
 
-int applyKernelPixNoCo(int* kernel, int kernelSize, float coefficient, uint8_t* pixelValues, int width, size_t xLoc, size_t yLoc) {
-  size_t i, j;
-  int result = 0, kernelPadding, row;
-  kernelPadding = kernelSize >> 1;
-  for (i = 0; i < kernelSize; i++) {
-    row = xLoc+i-kernelPadding;
-    for (j = 0; j < kernelSize; j++){
-      result += pixelValues[(yLoc+j-kernelPadding)+row*width] * kernel[i*kernelSize+j];
+/*
+* Function: poolAlloc
+* --------------------------
+* returns a POOL_ALIGNMENT aligned buffer of at least size bytes. The smallest
+* released block that isn't more than a quarter bigger than size is reused,
+* otherwise a new block is allocated. Buffers must be given back with
+* poolRelease, never with free
+*
+* size: number of bytes needed
+*
+* returns: a pointer to the buffer, NULL on failure
+*/
+void* poolAlloc(size_t size) {
+  pool_block *block = NULL, **link, **bestLink = NULL;
+  lockMutex(&bufferPool.lock);
+  if (size >= POOL_MIN_SIZE) {
+    for (link = &bufferPool.blocks; *link; link = &(*link)->next) {
+      if ((*link)->size >= size && (*link)->size - size <= (*link)->size / 4 && (!bestLink || (*link)->size < (*bestLink)->size))
+        bestLink = link;
+    }
+  }
+  if (bestLink) {
+    block = *bestLink;
+    *bestLink = block->next;
+    bufferPool.blockCount--;
+    bufferPool.pooledBytes -= block->size;
+    bufferPool.hits++;
+    size = block->size;
+  } else if (size >= POOL_MIN_SIZE) {
+    bufferPool.misses++;
+  }
+  bufferPool.usedBytes += size;
+  if (bufferPool.usedBytes > bufferPool.peakBytes)
+    bufferPool.peakBytes = bufferPool.usedBytes;
+  // bands share the profile of their image, the pool lock serializes them
+  if (currentProfile)
+    currentProfile->stages[currentProfile->activeStage].allocations++;
+  unlockMutex(&bufferPool.lock);
+  if (!block) {
+    if (!(block = (pool_block*) allocAligned(POOL_ALIGNMENT + size))) {
+      lockMutex(&bufferPool.lock);
+      bufferPool.usedBytes -= size;
+      unlockMutex(&bufferPool.lock);
+      return NULL;
     }
+    block->size = size;
+  }
+  return (uint8_t*) block + POOL_ALIGNMENT;
+}
+
+/*
+* Function: poolRelease
+* --------------------------
+* gives a buffer of poolAlloc back. It is kept for the next request unless
+* it is small or the pool already holds POOL_MAX_BLOCKS blocks or
+* POOL_MAX_BYTES bytes
+*
+* buffer: a buffer returned by poolAlloc or NULL
+*/
+void poolRelease(void* buffer) {
+  pool_block* block;
+  if (!buffer)
+    return;
+  block = (pool_block*)((uint8_t*) buffer - POOL_ALIGNMENT);
+  lockMutex(&bufferPool.lock);
+  bufferPool.usedBytes -= block->size;
+  if (block->size >= POOL_MIN_SIZE && bufferPool.blockCount < POOL_MAX_BLOCKS && bufferPool.pooledBytes + block->size <= POOL_MAX_BYTES) {
+    block->next = bufferPool.blocks;
+    bufferPool.blocks = block;
+    bufferPool.blockCount++;
+    bufferPool.pooledBytes += block->size;
+    block = NULL;
+  }
+  unlockMutex(&bufferPool.lock);
+  freeAligned(block);
+}
+
+/*
+* Function: drainBufferPool
+* --------------------------
+* frees every released block, buffers still in use stay valid
+*/
+void drainBufferPool() {
+  pool_block* block;
+  lockMutex(&bufferPool.lock);
+  while ((block = bufferPool.blocks)) {
+    bufferPool.blocks = block->next;
+    freeAligned(block);
+  }
+  bufferPool.blockCount = 0;
+  bufferPool.pooledBytes = 0;
+  unlockMutex(&bufferPool.lock);
+}
+
+void printPoolStats() {
+  long requests = bufferPool.hits + bufferPool.misses;
+  printf("Buffer pool: %ld of %ld requests reused a buffer, peak %.1f MiB in use, %.1f MiB pooled\n",
+    bufferPool.hits, requests, bufferPool.peakBytes / 1048576.0, bufferPool.pooledBytes / 1048576.0);
+}
+
+/*
+* Function: startProfile
+* --------------------------
+* clears a profile and makes it the current profile of the calling thread,
+* the time until stopProfile is counted as PROFILE_OTHER unless a stage
+* is active
+*
+* profile: the profile of the image about to be processed
+*/
+void startProfile(image_profile* profile) {
+  memset(profile, 0, sizeof(image_profile));
+  profile->activeStage = PROFILE_OTHER;
+  profile->stageStart = getSeconds();
+  currentProfile = profile;
+}
+
+void stopProfile() {
+  if (currentProfile)
+    currentProfile->stages[currentProfile->activeStage].seconds += getSeconds() - currentProfile->stageStart;
+  currentProfile = NULL;
+}
+
+/*
+* Function: beginStage
+* --------------------------
+* counts the time from now on for stage until the matching endStage, the
+* stage it interrupts continues after that. Does nothing without a current
+* profile, so the interactive mode and the benchmark pay one branch
+*
+* stage: one of the PROFILE_ stage types
+*/
+void beginStage(int stage) {
+  image_profile* profile = currentProfile;
+  double now;
+  if (!profile)
+    return;
+  // stages nested deeper than PROFILE_DEPTH are counted for their parent
+  if (profile->depth++ >= PROFILE_DEPTH)
+    return;
+  now = getSeconds();
+  profile->stages[profile->activeStage].seconds += now - profile->stageStart;
+  profile->stageStart = now;
+  profile->previousStages[profile->depth - 1] = profile->activeStage;
+  profile->activeStage = stage;
+}
+
+/*
+* Function: endStage
+* --------------------------
+* ends the stage of the last beginStage
+*
+* bytes: bytes the stage read or produced
+*/
+void endStage(size_t bytes) {
+  image_profile* profile = currentProfile;
+  double now;
+  if (!profile || !profile->depth)
+    return;
+  if (--profile->depth >= PROFILE_DEPTH)
+    return;
+  now = getSeconds();
+  profile->stages[profile->activeStage].seconds += now - profile->stageStart;
+  profile->stages[profile->activeStage].bytes += bytes;
+  profile->stageStart = now;
+  profile->activeStage = profile->previousStages[profile->depth];
+}
+
+void addProfile(image_profile* total, image_profile* profile) {
+  int i;
+  for (i = 0; i < PROFILE_STAGE_COUNT; i++) {
+    total->stages[i].seconds += profile->stages[i].seconds;
+    total->stages[i].bytes += profile->stages[i].bytes;
+    total->stages[i].allocations += profile->stages[i].allocations;
+  }
+}
+
+/*
+* Function: printProfileSummary
+* --------------------------
+* prints the time of every stage added up over the files of a run, with
+* several workers it is the sum of their times
+*
+* total: the added up profiles
+*/
+void printProfileSummary(image_profile* total) {
+  int i;
+  printf("Time per stage:");
+  for (i = 0; i < PROFILE_STAGE_COUNT; i++)
+    printf("%s %s %.3fs", i ? "," : "", profileStageNames[i], total->stages[i].seconds);
+  printf("\n");
+}
+
+/*
+* Function: writeProfileReport
+* --------------------------
+* writes the profile of every file to outputDir/profile.csv or
+* outputDir/profile.json, one record per file and stage
+*
+* outputDir: directory of the report
+* format: PROFILE_REPORT_CSV or PROFILE_REPORT_JSON
+* files: the processed files
+* profiles: a profile per file
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool writeProfileReport(char* outputDir, int format, file_list* files, image_profile* profiles) {
+  char reportName[INPUT_SIZE];
+  int i, j;
+  stage_counter* counter;
+  FILE* file;
+  bool written;
+  snprintf(reportName, INPUT_SIZE, "%s%cprofile.%s", outputDir, PATH_SEP, format == PROFILE_REPORT_CSV ? "csv" : "json");
+  if (!(file = fopen(reportName, "w"))) {
+    setColor(RED);
+    printf("Failed to write %s\n", reportName);
+    setColor(RESET);
+    return false;
+  }
+  fprintf(file, format == PROFILE_REPORT_CSV ? "file,stage,seconds,bytes,allocations\n" : "[");
+  for (i = 0; i < files->count; i++) {
+    if (format == PROFILE_REPORT_JSON) {
+      fprintf(file, "%s\n  {\"file\": ", i ? "," : "");
+      printJsonString(file, files->names[i]);
+      fprintf(file, ", \"stages\": {");
+    }
+    for (j = 0; j < PROFILE_STAGE_COUNT; j++) {
+      counter = profiles[i].stages + j;
+      if (format == PROFILE_REPORT_CSV)
+        fprintf(file, "%s,%s,%.6f,%zu,%ld\n", files->names[i], profileStageNames[j], counter->seconds, counter->bytes, counter->allocations);
+      else
+        fprintf(file, "%s\"%s\": {\"seconds\": %.6f, \"bytes\": %zu, \"allocations\": %ld}",
+                j ? ", " : "", profileStageNames[j], counter->seconds, counter->bytes, counter->allocations);
+    }
+    if (format == PROFILE_REPORT_JSON)
+      fprintf(file, "}}");
+  }
+  if (format == PROFILE_REPORT_JSON)
+    fprintf(file, "\n]\n");
+  written = !ferror(file);
+  written = !fclose(file) && written;
+  if (!written) {
+    setColor(RED);
+    printf("Failed to write %s\n", reportName);
+    setColor(RESET);
+    return false;
+  }
+  printf("Wrote profile to %s\n", reportName);
+  return true;
+}
+
+void printJsonString(FILE* file, char* str) {
+  fputc('"', file);
+  for (; *str; str++) {
+    // control characters can't appear raw in a JSON string
+    if ((unsigned char) *str < ' ') {
+      fprintf(file, "\\u%04x", *str);
+      continue;
+    }
+    if (*str == '"' || *str == '\\')
+      fputc('\\', file);
+    fputc(*str, file);
+  }
+  fputc('"', file);
+}
+
+/*
+* Function: buildOutputName
+* --------------------------
+* builds outputDir/name_command.pgm from the input file name
+*
+* outputFileName: buffer of INPUT_SIZE characters that will hold the result
+* outputDir: directory of the output file
+* inputFileName: path of the input file
+* command: the command suffix
+*
+* returns: false if the name doesn't fit in INPUT_SIZE characters
+*/
+bool buildOutputName(char* outputFileName, char* outputDir, char* inputFileName, char* command) {
+  char stripped[INPUT_SIZE];
+  char* baseName = inputFileName + strlen(inputFileName);
+  while (baseName > inputFileName && *(baseName-1) != '/' && *(baseName-1) != '\\')
+    baseName--;
+  removeExtension(baseName, stripped);
+  return snprintf(outputFileName, INPUT_SIZE, "%s%c%s_%s.pgm", outputDir, PATH_SEP, stripped, command) < INPUT_SIZE;
+}
+
+/*
+* Function: listOutputNames
+* --------------------------
+* builds the output file of every input file and makes sure no two inputs,
+* e.g. dirA/x.pgm and dirB/x.pgm, would be written to the same file
+*
+* files: list of input files
+* outputDir: directory of the output files
+* command: the command suffix
+* outputs: empty list that will hold the output file of every input file
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool listOutputNames(file_list* files, char* outputDir, char* command, file_list* outputs) {
+  char outputFileName[INPUT_SIZE];
+  char** sorted;
+  int i, j;
+  for (i = 0; i < files->count; i++) {
+    if (!buildOutputName(outputFileName, outputDir, files->names[i], command)) {
+      setColor(RED);
+      printf("Error: output file name of %s is too long\n", files->names[i]);
+      setColor(RESET);
+      return false;
+    }
+    if (!addFileName(outputs, outputFileName))
+      return false;
+  }
+  if (!(sorted = (char**) malloc(outputs->count * sizeof(char*))))
+    return false;
+  memcpy(sorted, outputs->names, outputs->count * sizeof(char*));
+  qsort(sorted, outputs->count, sizeof(char*), compareFileNames);
+  for (i = 1; i < outputs->count && strcmp(sorted[i-1], sorted[i]); i++);
+  if (i < outputs->count) {
+    // the inputs are looked up again only to name them
+    for (j = 0; strcmp(outputs->names[j], sorted[i]); j++);
+    setColor(RED);
+    printf("Error: %s and ", files->names[j]);
+    for (j++; strcmp(outputs->names[j], sorted[i]); j++);
+    printf("%s would both be written to %s\n", files->names[j], sorted[i]);
+    setColor(RESET);
+  }
+  free(sorted);
+  return i >= outputs->count;
+}
+
+void setDefaultSettings(kernel_settings* settings) {
+  settings->padding.type = PADDING_ZERO;
+  settings->padding.value = 0;
+  settings->normalizationType = 1;
+  settings->postPadding = true;
+  settings->coefficient = 1;
+}
+
+/*
+* Function: readKernelFile
+* --------------------------
+* reads a custom kernel and its settings from a text file. The file starts
+* with the kernel size followed by size*size integers, then optional
+* "key value" pairs. Lines starting with '#' are ignored:
+*
+*   3
+*   0  1 0
+*   1 -4 1
+*   0  1 0
+*   padding mirror          (zero|constant|replicate|mirror|wrap)
+*   padding-value 128       (value of constant padding)
+*   stage pre               (post|pre)
+*   normalization slice     (minmax|slice)
+*   coefficient 0.5
+*
+* fileName: the settings file
+* kernel: mask that will hold the allocated kernel
+* settings: settings that will be updated
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool readKernelFile(char* fileName, mask* kernel, kernel_settings* settings) {
+  FILE* file;
+  size_t i;
+  bool isValid;
+  char key[LINE_SIZE], value[LINE_SIZE];
+  if (!(file = fopen(fileName, "r"))) {
+    setColor(RED);
+    printf("Couldn't read %s\nProbably doesn't exist\n", fileName);
+    setColor(RESET);
+    return false;
+  }
+  skipComments(file);
+  if (fscanf(file, "%d", &(kernel->size)) != 1 || kernel->size <= 0 || !(kernel->size % 2)) {
+    setColor(RED);
+    printf("%s: kernel size must be greater than 0 and odd\n", fileName);
+    setColor(RESET);
+    fclose(file);
+    return false;
+  }
+  kernel->matrix = (int*) malloc((size_t)(kernel->size)*(kernel->size)*sizeof(int));
+  if (!kernel->matrix) {
+    setColor(RED);
+    printf("%s: not enough memory for a %dx%d kernel\n", fileName, kernel->size, kernel->size);
+    setColor(RESET);
+    fclose(file);
+    return false;
+  }
+  for (i = 0; i < (kernel->size)*(kernel->size); i++) {
+    skipComments(file);
+    if (fscanf(file, "%d", kernel->matrix + i) != 1) {
+      setColor(RED);
+      printf("%s: expected %d kernel values, read %ld\n", fileName, (kernel->size)*(kernel->size), i);
+      setColor(RESET);
+      free(kernel->matrix);
+      kernel->matrix = NULL;
+      fclose(file);
+      return false;
+    }
+  }
+  skipComments(file);
+  while (fscanf(file, "%99s %99s", key, value) == 2) {
+    isValid = true;
+    if (!strcmp(key, "padding")) {
+      isValid = parsePaddingType(value, &(settings->padding.type));
+    } else if (!strcmp(key, "padding-value")) {
+      isValid = isIntegerStr(value) && atoi(value) >= 0 && atoi(value) <= MAX_PIXEL_VAL;
+      settings->padding.value = (uint8_t) atoi(value);
+    } else if (!strcmp(key, "stage") && (!strcmp(value, "post") || !strcmp(value, "pre"))) {
+      settings->postPadding = !strcmp(value, "post");
+    } else if (!strcmp(key, "normalization") && (!strcmp(value, "minmax") || !strcmp(value, "slice"))) {
+      settings->normalizationType = !strcmp(value, "minmax");
+    } else if (!strcmp(key, "coefficient")) {
+      isValid = sscanf(value, "%f", &(settings->coefficient)) == 1;
+    } else {
+      isValid = false;
+    }
+    if (!isValid) {
+      setColor(RED);
+      printf("%s: invalid setting '%s %s'\n", fileName, key, value);
+      setColor(RESET);
+      free(kernel->matrix);
+      kernel->matrix = NULL;
+      fclose(file);
+      return false;
+    }
+    skipComments(file);
+  }
+  fclose(file);
+  return true;
+}
+
+bool addFileName(file_list* files, char* name) {
+  char** names;
+  if (files->count == files->capacity) {
+    files->capacity = files->capacity ? files->capacity*2 : 64;
+    names = (char**) realloc(files->names, files->capacity * sizeof(char*));
+    if (!names)
+      return false;
+    files->names = names;
+  }
+  files->names[files->count] = (char*) malloc(strlen(name)+1);
+  if (!files->names[files->count])
+    return false;
+  strcpy(files->names[files->count++], name);
+  return true;
+}
+
+void freeFileList(file_list* files) {
+  int i;
+  for (i = 0; i < files->count; i++)
+    free(files->names[i]);
+  free(files->names);
+  files->names = NULL;
+  files->count = files->capacity = 0;
+}
+
+bool hasPgmExtension(char* name) {
+  size_t length = strlen(name);
+  return length > 4 && (!strcmp(name + length - 4, ".pgm") || !strcmp(name + length - 4, ".PGM"));
+}
+
+int compareFileNames(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+int applyCustomKernelPgm(mask* kernel, kernel_settings* settings, char* inputFileName, char* outputFileName, int version) {
+  pgm_map image;
+  uint8_t *arr, *pixelValues;
+  int width, height;
+  bool written;
+  arr = readPgm(inputFileName, &width, &height, &image);
+  if (!arr)
+    return 1;
+  beginStage(PROFILE_FILTER);
+  pixelValues = filterCustomImage(kernel, settings, arr, width, height, NULL);
+  endStage(pixelValues ? (size_t) width * height * 2 : 0);
+  releasePgm(arr, &image);
+  if (!pixelValues)
+    return 1;
+  written = writeArrToPgm(pixelValues, width, height, outputFileName, version);
+  poolRelease(pixelValues);
+  return written ? 0 : 1;
+}
+
+/*
+* Function: filterCustomImage
+* --------------------------
+* applies a custom filter and normalizes the result. With post-padding the
+* border the kernel doesn't fit in is filled afterwards, with pre-padding
+* the kernel reads the pixels outside of the image
+*
+* kernel: the mask that will be applied
+* settings: padding, normalization and coefficient of the filter
+* pixelValues: the image
+* width: image width
+* height: image height
+* output: width*height buffer for the result, NULL to take one from the pool
+*
+* returns: a pointer to the width*height result, NULL on failure
+*/
+uint8_t* filterCustomImage(mask* kernel, kernel_settings* settings, uint8_t* pixelValues, int width, int height, uint8_t* output) {
+  int padding = settings->postPadding ? kernel->size >> 1 : 0;
+  row_sink sink;
+  if (!initFramedRowSink(&sink, settings->normalizationType ? NORMALIZE_MINMAX : NORMALIZE_SLICE,
+                         width-padding*2, height-padding*2, padding, &(settings->padding), output))
+    return NULL;
+  if (!applyCustomKernel(kernel, settings->coefficient, pixelValues, width, height, settings->postPadding ? NULL : &(settings->padding), &sink)) {
+    freeRowSink(&sink);
+    return NULL;
+  }
+  return finishRowSink(&sink);
+}
+
+/*
+* Function: applyCustomKernel
+* --------------------------
+* applies a custom filter and hands the result rows to sink
+*
+* kernel: a mask struct containing the mask that will be applied
+* coefficient: a float multiplied with each result, see initFixedScale
+* pixelValues: pointer to the array representing image that will be processed
+* width: image width
+* height: image height
+* padding: how the pixels outside of the image are read, the output then has
+* the image size. NULL only filters the area the kernel fits in
+* sink: row sink initialized for the output size
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyCustomKernel(mask* kernel, float coefficient, uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  if (!padding && !checkUnpaddedFit(kernel->size, width, height))
+    return false;
+  return applyMaskArr(kernel, coefficient, pixelValues, width, height, padding, sink);
+}
+
+int applySobelPgm(char* inputFileName, char* outputFileName, int gradientType, int version) {
+  pgm_map image;
+  uint8_t *arr, *pixelValues;
+  int width, height;
+  bool written;
+  arr = readPgm(inputFileName, &width, &height, &image);
+  if (!arr)
+    return 1;
+  beginStage(PROFILE_FILTER);
+  pixelValues = filterSobelImage(arr, width, height, gradientType, NULL);
+  endStage(pixelValues ? (size_t) width * height * 2 : 0);
+  releasePgm(arr, &image);
+  if (!pixelValues)
+    return 1;
+  written = writeArrToPgm(pixelValues, width, height, outputFileName, version);
+  poolRelease(pixelValues);
+  return written ? 0 : 1;
+}
+
+/*
+* Function: filterSobelImage
+* --------------------------
+* applies the sobel filter, min-max normalizes the magnitude and pads it
+* back to the image size with zeros
+*
+* pixelValues: the image
+* width: image width
+* height: image height
+* gradientType: GRADIENT_L2, GRADIENT_L1 or GRADIENT_SQUARED
+* output: width*height buffer for the result, NULL to take one from the pool
+*
+* returns: a pointer to the width*height result, NULL on failure
+*/
+uint8_t* filterSobelImage(uint8_t* pixelValues, int width, int height, int gradientType, uint8_t* output) {
+  int padding = 1;
+  padding_mode frame = {PADDING_ZERO, 0};
+  row_sink sink;
+  if (!initFramedRowSink(&sink, NORMALIZE_MINMAX, width-padding*2, height-padding*2, padding, &frame, output))
+    return NULL;
+  if (!applyGradientMagnitude(pixelValues, width, height, gradientType, &sink)) {
+    freeRowSink(&sink);
+    return NULL;
+  }
+  return finishRowSink(&sink);
+}
+
+/*
+* Function: applyGradientMagnitude
+* --------------------------
+* computes the magnitude of the vertical and horizontal prewitt gradients
+* and hands the (width-2)*(height-2) result rows to sink. Both gradients and
+* the magnitude are computed in a single pass without intermediate images
+*
+* pixelValues: pointer to the array representing image that will be processed
+* width: image width
+* height: image height
+* gradientType: GRADIENT_L2 for sqrt(x*x+y*y), GRADIENT_L1 for |x|+|y| or
+* GRADIENT_SQUARED for x*x+y*y
+* sink: row sink initialized for the output size
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyGradientMagnitude(uint8_t* pixelValues, int width, int height, int gradientType, row_sink* sink) {
+  gradient_job job;
+  // each gradient is at most 3*255 in magnitude
+  long long maxGradient = 3 * MAX_PIXEL_VAL, maxMagnitude;
+  if (gradientType == GRADIENT_L1)
+    maxMagnitude = maxGradient * 2;
+  else if (gradientType == GRADIENT_SQUARED)
+    maxMagnitude = maxGradient * maxGradient * 2;
+  else
+    maxMagnitude = (long long) sqrt(maxGradient * maxGradient * 2);
+  if (!prepareRowSink(sink, 0, maxMagnitude))
+    return false;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.gradientType = gradientType;
+  job.sink = sink;
+  job.failed = false;
+  initMutex(&job.lock);
+  runRowBands(height-2, applyGradientRows, &job);
+  destroyMutex(&job.lock);
+  return !job.failed;
+}
+
+/*
+* Function: applyPrewittArr
+* --------------------------
+* applies a prewitt operator to the (width-2)*(height-2) area it fits in
+* with the column sums and differences of applyGradientRows: 3 additions per
+* pixel instead of the 9 multiply-adds of the mask
+*
+* pixelValues: pointer to the array representing image that will be processed
+* width: image width
+* height: image height
+* operator: PREWITT_VERTICAL or PREWITT_HORIZONTAL
+* sink: row sink initialized for the output size
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyPrewittArr(uint8_t* pixelValues, int width, int height, int operator, row_sink* sink) {
+  gradient_job job;
+  if (!prepareRowSink(sink, -3 * MAX_PIXEL_VAL, 3 * MAX_PIXEL_VAL))
+    return false;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.gradientType = operator;
+  job.sink = sink;
+  job.failed = false;
+  initMutex(&job.lock);
+  runRowBands(height-2, applyGradientRows, &job);
+  destroyMutex(&job.lock);
+  return !job.failed;
+}
+
+void applyGradientRows(void* context, int firstRow, int lastRow) {
+  gradient_job* job = (gradient_job*) context;
+  int width = job->width, areaWidth = width - 2, horizontal, vertical, *outputRow, *scratch;
+  int16_t *columnSums, *columnDiffs;
+  uint8_t *top, *middle, *bottom;
+  size_t i, j;
+  // the horizontal operator is a difference of column sums and the vertical
+  // one a sum of column differences, each column is read once per row
+  columnSums = (int16_t*) poolAlloc(width * sizeof(int16_t));
+  columnDiffs = (int16_t*) poolAlloc(width * sizeof(int16_t));
+  scratch = (int*) poolAlloc(areaWidth * sizeof(int));
+  if (!columnSums || !columnDiffs || !scratch) {
+    poolRelease(columnSums);
+    poolRelease(columnDiffs);
+    poolRelease(scratch);
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  for (i = firstRow; i < lastRow; i++) {
+    top = job->pixelValues + i*width;
+    middle = top + width;
+    bottom = middle + width;
+    outputRow = getSinkRow(job->sink, i, scratch);
+    // the single operators only need one of the two
+    sumPrewittColumns(top, middle, bottom, 0, width, job->gradientType == PREWITT_VERTICAL ? NULL : columnSums,
+                      job->gradientType == PREWITT_HORIZONTAL ? NULL : columnDiffs);
+    if (job->gradientType == PREWITT_VERTICAL) {
+      for (j = 0; j < areaWidth; j++)
+        outputRow[j] = columnDiffs[j] + columnDiffs[j+1] + columnDiffs[j+2];
+    } else if (job->gradientType == PREWITT_HORIZONTAL) {
+      for (j = 0; j < areaWidth; j++)
+        outputRow[j] = columnSums[j] - columnSums[j+2];
+    } else {
+      for (j = 0; j < areaWidth; j++) {
+        horizontal = columnSums[j] - columnSums[j+2];
+        vertical = columnDiffs[j] + columnDiffs[j+1] + columnDiffs[j+2];
+        outputRow[j] = getGradientMagnitude(horizontal, vertical, job->gradientType);
+      }
+    }
+    putSinkRow(job->sink, i, outputRow);
+  }
+  poolRelease(columnSums);
+  poolRelease(columnDiffs);
+  poolRelease(scratch);
+}
+
+/*
+* Function: sumPrewittColumns
+* --------------------------
+* computes the column sums and differences of three image rows. The
+* horizontal prewitt gradient of the window starting at column j is
+* sums[j] - sums[j+2], the vertical one diffs[j] + diffs[j+1] + diffs[j+2]
+*
+* top, middle, bottom: the rows
+* first, last: columns in [first, last) are computed
+* sums: set to top+middle+bottom, NULL to skip them
+* diffs: set to top-bottom, NULL to skip them
+*/
+static inline void sumPrewittColumns(uint8_t* top, uint8_t* middle, uint8_t* bottom, int first, int last, int16_t* sums, int16_t* diffs) {
+  int j;
+  if (!sums) {
+    for (j = first; j < last; j++)
+      diffs[j] = top[j] - bottom[j];
+  } else if (!diffs) {
+    for (j = first; j < last; j++)
+      sums[j] = top[j] + middle[j] + bottom[j];
+  } else {
+    for (j = first; j < last; j++) {
+      sums[j] = top[j] + middle[j] + bottom[j];
+      diffs[j] = top[j] - bottom[j];
+    }
+  }
+}
+
+/*
+* Function: getGradientMagnitude
+* --------------------------
+* horizontal, vertical: the gradients
+* gradientType: GRADIENT_L2, GRADIENT_L1 or GRADIENT_SQUARED
+*
+* returns: the magnitude of the gradients, truncated for GRADIENT_L2
+*/
+static inline int getGradientMagnitude(int horizontal, int vertical, int gradientType) {
+  if (gradientType == GRADIENT_L1)
+    return abs(horizontal) + abs(vertical);
+  if (gradientType == GRADIENT_SQUARED)
+    return horizontal*horizontal + vertical*vertical;
+  return (int) sqrt(horizontal*horizontal + vertical*vertical);
+}
+
+int applyCannyPgm(char* inputFileName, char* outputFileName, int windowSize, int gradientType, int low, int high, int version) {
+  pgm_map image;
+  uint8_t *arr, *pixelValues;
+  int width, height;
+  bool written;
+  if (windowSize <= 0 || !(windowSize%2) || windowSize > MAX_CANNY_WINDOW_SIZE) {
+    setColor(RED);
+    printf("Error: smoothing window size must be odd and between 1 and %d\n", MAX_CANNY_WINDOW_SIZE);
+    setColor(RESET);
+    return 1;
+  }
+  arr = readPgm(inputFileName, &width, &height, &image);
+  if (!arr)
+    return 1;
+  // smoothing, gradients and non-maximum suppression each need a border
+  if (!doesKernelFit(windowSize + 4, width, height)) {
+    setColor(RED);
+    printf("Error: %dx%d smoothing window doesn't fit in %s\n", windowSize, windowSize, inputFileName);
+    setColor(RESET);
+    releasePgm(arr, &image);
+    return 1;
+  }
+  beginStage(PROFILE_FILTER);
+  pixelValues = filterCannyImage(arr, width, height, windowSize, gradientType, low, high, NULL);
+  endStage(pixelValues ? (size_t) width * height * 2 : 0);
+  releasePgm(arr, &image);
+  if (!pixelValues)
+    return 1;
+  written = writeArrToPgm(pixelValues, width, height, outputFileName, version);
+  poolRelease(pixelValues);
+  return written ? 0 : 1;
+}
+
+/*
+* Function: filterCannyImage
+* --------------------------
+* canny edge detector: binomial smoothing, prewitt gradients, non-maximum
+* suppression along the gradient direction and hysteresis. The first three
+* run fused over the rows of each band, keeping only the few smoothed and
+* gradient rows they share; hysteresis keeps the pixels above low that are
+* connected to one above high, see traceEdges. Edges are 255, everything
+* else, including the border the windows don't fit in, is 0
+*
+* pixelValues: the image
+* width: image width
+* height: image height
+* windowSize: odd smoothing window of at most MAX_CANNY_WINDOW_SIZE, its
+* binomial weights approximate a gaussian of sigma sqrt(windowSize-1)/2
+* gradientType: GRADIENT_L2, GRADIENT_L1 or GRADIENT_SQUARED
+* low, high: hysteresis thresholds of the gradient magnitude
+* output: width*height buffer for the result, NULL to take one from the pool
+*
+* returns: a pointer to the width*height result, NULL on failure
+*/
+uint8_t* filterCannyImage(uint8_t* pixelValues, int width, int height, int windowSize, int gradientType, int low, int high, uint8_t* output) {
+  canny_job job;
+  uint8_t lut[HISTOGRAM_BINS] = {0};
+  int margin = (windowSize >> 1) + 2, i;
+  long long limit, lowValue = low, highValue = high;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.height = height;
+  job.windowSize = windowSize;
+  job.weights[0] = 1;
+  for (i = 1; i < windowSize; i++)
+    job.weights[i] = job.weights[i-1] * (windowSize - i) / i;
+  job.gradientType = gradientType;
+  // thresholds above the largest magnitude all find nothing, clamping them
+  // keeps the GRADIENT_L2 squares and the comparisons in an int
+  limit = gradientType == GRADIENT_L1 ? MAX_PREWITT_GRADIENT*2 + 1 : (long long) MAX_PREWITT_GRADIENT*MAX_PREWITT_GRADIENT*2 + 1;
+  if (gradientType == GRADIENT_L2) {
+    lowValue *= lowValue;
+    highValue *= highValue;
+  }
+  job.low = (int) (lowValue < limit ? lowValue : limit);
+  job.high = (int) (highValue < limit ? highValue : limit);
+  job.edges = output ? output : (uint8_t*) poolAlloc((size_t) width * height * sizeof(uint8_t));
+  job.failed = false;
+  if (!job.edges)
+    return NULL;
+  initMutex(&job.lock);
+  memset(job.edges, EDGE_NONE, (size_t) margin * width);
+  memset(job.edges + (size_t) (height - margin) * width, EDGE_NONE, (size_t) margin * width);
+  runRowBands(height - margin*2, applyCannyRows, &job);
+  if (!job.failed)
+    traceEdges(&job);
+  destroyMutex(&job.lock);
+  if (job.failed) {
+    if (!output)
+      poolRelease(job.edges);
+    return NULL;
+  }
+  lut[EDGE_TRACED] = MAX_PIXEL_VAL;
+  applyLut(lut, job.edges, job.edges, width, height);
+  return job.edges;
+}
+
+/*
+* Function: applyCannyRows
+* --------------------------
+* classifies the pixels of the rows in [firstRow, lastRow) of the area
+* canny fits in as EDGE_NONE, EDGE_WEAK or EDGE_STRONG. Each row is
+* smoothed, turned into gradients and suppressed as soon as the rows it
+* needs are there, in rings of three rows that stay in cache
+*
+* context: pointer to the canny_job
+* firstRow: first row (without the margin)
+* lastRow: row after the last row
+*/
+void applyCannyRows(void* context, int firstRow, int lastRow) {
+  canny_job* job = (canny_job*) context;
+  int width = job->width, padding = job->windowSize >> 1, margin = padding + 2;
+  int first = firstRow + margin - 1, row, gx, gy, ax, ay, value, shift, j;
+  // the hysteresis compares squares with the squared thresholds of GRADIENT_L2
+  int magnitudeType = job->gradientType == GRADIENT_L1 ? GRADIENT_L1 : GRADIENT_SQUARED;
+  int *buffer, *columnSums, *magnitudes[3], *previous, *current, *next, *before, *after;
+  int16_t *sums, *diffs;
+  uint8_t *bytes, *smoothed[3], *sectors[3], *top, *middle, *bottom, *sector, *edgeRow;
+  buffer = (int*) poolAlloc((size_t) width * 4 * sizeof(int));
+  sums = (int16_t*) poolAlloc((size_t) width * 2 * sizeof(int16_t));
+  bytes = (uint8_t*) poolAlloc((size_t) width * 6 * sizeof(uint8_t));
+  if (!buffer || !sums || !bytes) {
+    poolRelease(buffer);
+    poolRelease(sums);
+    poolRelease(bytes);
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  columnSums = buffer;
+  diffs = sums + width;
+  for (j = 0; j < 3; j++) {
+    magnitudes[j] = buffer + width*(1+j);
+    smoothed[j] = bytes + width*j;
+    sectors[j] = bytes + width*(3+j);
+  }
+  // image row row is smoothed, gradient row row-1 follows from the smoothed
+  // rows around it and row-2 is suppressed with the gradient rows around it
+  for (row = first - 1; row <= lastRow + margin + 1; row++) {
+    smoothCannyRow(job, row, columnSums, smoothed[row % 3]);
+    if (row < first + 1)
+      continue;
+    top = smoothed[(row-2) % 3];
+    middle = smoothed[(row-1) % 3];
+    bottom = smoothed[row % 3];
+    current = magnitudes[(row-1) % 3];
+    sector = sectors[(row-1) % 3];
+    sumPrewittColumns(top, middle, bottom, padding, width - padding, sums, diffs);
+    for (j = padding + 1; j < width - padding - 1; j++) {
+      gx = sums[j-1] - sums[j+1];
+      gy = diffs[j-1] + diffs[j] + diffs[j+1];
+      ax = abs(gx);
+      ay = abs(gy);
+      current[j] = getGradientMagnitude(gx, gy, magnitudeType);
+      // 0: across the columns, 1: across the rows, 2 and 3: across a diagonal
+      if (ay * 32768 <= ax * TAN_22_5)
+        sector[j] = 0;
+      else if (ax * 32768 <= ay * TAN_22_5)
+        sector[j] = 1;
+      else
+        sector[j] = (gx > 0) == (gy > 0) ? 2 : 3;
+    }
+    if (row < first + 3)
+      continue;
+    previous = magnitudes[(row-3) % 3];
+    next = current;
+    current = magnitudes[(row-2) % 3];
+    sector = sectors[(row-2) % 3];
+    edgeRow = job->edges + (size_t) (row-2) * width;
+    memset(edgeRow, EDGE_NONE, margin);
+    memset(edgeRow + width - margin, EDGE_NONE, margin);
+    for (j = margin; j < width - margin; j++) {
+      value = current[j];
+      if (value < job->low) {
+        edgeRow[j] = EDGE_NONE;
+        continue;
+      }
+      // the two neighbours along the gradient, ties go to the second one
+      shift = sector[j] == 1 ? 0 : (sector[j] == 3 ? -1 : 1);
+      before = sector[j] ? previous : current;
+      after = sector[j] ? next : current;
+      if (value > before[j - shift] && value >= after[j + shift])
+        edgeRow[j] = value >= job->high ? EDGE_STRONG : EDGE_WEAK;
+      else
+        edgeRow[j] = EDGE_NONE;
+    }
+  }
+  poolRelease(buffer);
+  poolRelease(sums);
+  poolRelease(bytes);
+}
+
+/*
+* Function: smoothCannyRow
+* --------------------------
+* smooths an image row with the binomial weights of a canny_job, rounding
+* to the nearest pixel value. Only the columns the window fits in are set
+*
+* job: the canny job
+* row: image row, the window must fit above and below it
+* columnSums: scratch array of width values
+* smoothed: width values the row is written to
+*/
+void smoothCannyRow(canny_job* job, int row, int* columnSums, uint8_t* smoothed) {
+  int size = job->windowSize, padding = size >> 1, width = job->width, shift = (size - 1)*2, sum, k, j;
+  uint8_t* window = job->pixelValues + (size_t) (row - padding) * width;
+  for (j = 0; j < width; j++)
+    columnSums[j] = window[j];
+  for (k = 1; k < size; k++) {
+    for (j = 0; j < width; j++)
+      columnSums[j] += job->weights[k] * window[(size_t) k*width + j];
+  }
+  for (j = padding; j < width - padding; j++) {
+    sum = 0;
+    for (k = 0; k < size; k++)
+      sum += job->weights[k] * columnSums[j - padding + k];
+    smoothed[j] = (uint8_t) ((sum + ((1 << shift) >> 1)) >> shift);
+  }
+}
+
+/*
+* Function: traceEdges
+* --------------------------
+* hysteresis of canny: marks EDGE_TRACED every pixel connected to an
+* EDGE_STRONG one through EDGE_WEAK ones (8-connectivity). Each band traces
+* the edges inside its own rows in parallel; weak pixels an edge reaches in
+* the rows of another band are handed on and seed that band in the next
+* round, until a round hands on nothing. The traced set doesn't depend on
+* the bands, so the result doesn't depend on the number of threads
+*
+* job: a canny job whose edges are classified
+*/
+void traceEdges(canny_job* job) {
+  size_t i, seedCount;
+  job->seeds = NULL;
+  do {
+    job->crossings = NULL;
+    job->crossingCount = 0;
+    runRowBands(job->height, traceEdgeRows, job);
+    free(job->seeds);
+    for (i = 0, seedCount = 0; i < job->crossingCount; i++) {
+      if (job->edges[job->crossings[i]] == EDGE_WEAK) {
+        job->edges[job->crossings[i]] = EDGE_TRACED;
+        job->crossings[seedCount++] = job->crossings[i];
+      }
+    }
+    job->seeds = job->crossings;
+    job->seedCount = seedCount;
+  } while (seedCount && !job->failed);
+  free(job->seeds);
+}
+
+/*
+* Function: traceEdgeRows
+* --------------------------
+* one hysteresis round over the rows in [firstRow, lastRow), see traceEdges.
+* Only pixels of these rows are read or written, the neighbours in other
+* rows are added to the crossings of the job
+*
+* context: pointer to the canny_job
+* firstRow: first image row
+* lastRow: row after the last image row
+*/
+void traceEdgeRows(void* context, int firstRow, int lastRow) {
+  canny_job* job = (canny_job*) context;
+  size_t width = job->width, first = (size_t) firstRow * width, last = (size_t) lastRow * width;
+  size_t *stack = NULL, *crossings = NULL, stackCount = 0, stackCapacity = 0, crossingCount = 0, crossingCapacity = 0;
+  size_t index, neighbour, i;
+  size_t* merged;
+  int dy, dx;
+  bool traced = true;
+  uint8_t* edges = job->edges;
+  if (!job->seeds) {
+    for (index = first; index < last && traced; index++) {
+      if (edges[index] == EDGE_STRONG) {
+        edges[index] = EDGE_TRACED;
+        traced = pushEdge(&stack, &stackCount, &stackCapacity, index);
+      }
+    }
+  } else {
+    for (i = 0; i < job->seedCount && traced; i++) {
+      if (job->seeds[i] >= first && job->seeds[i] < last)
+        traced = pushEdge(&stack, &stackCount, &stackCapacity, job->seeds[i]);
+    }
+  }
+  while (traced && stackCount) {
+    index = stack[--stackCount];
+    // edge pixels are inside the margin, so the neighbours never leave the image
+    for (dy = -1; dy <= 1 && traced; dy++) {
+      for (dx = -1; dx <= 1 && traced; dx++) {
+        neighbour = index + dy*width + dx;
+        if (neighbour < first || neighbour >= last)
+          traced = pushEdge(&crossings, &crossingCount, &crossingCapacity, neighbour);
+        else if (edges[neighbour] == EDGE_WEAK) {
+          edges[neighbour] = EDGE_TRACED;
+          traced = pushEdge(&stack, &stackCount, &stackCapacity, neighbour);
+        }
+      }
+    }
+  }
+  lockMutex(&job->lock);
+  if (traced && crossingCount) {
+    merged = (size_t*) realloc(job->crossings, (job->crossingCount + crossingCount) * sizeof(size_t));
+    if (merged) {
+      memcpy(merged + job->crossingCount, crossings, crossingCount * sizeof(size_t));
+      job->crossings = merged;
+      job->crossingCount += crossingCount;
+    }
+    traced = merged != NULL;
+  }
+  if (!traced)
+    job->failed = true;
+  unlockMutex(&job->lock);
+  free(stack);
+  free(crossings);
+}
+
+/*
+* Function: pushEdge
+* --------------------------
+* appends a pixel index to a growing array
+*
+* stack: the array, NULL when empty
+* count: number of indexes in the array
+* capacity: number of indexes the array has room for
+* index: the index to append
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool pushEdge(size_t** stack, size_t* count, size_t* capacity, size_t index) {
+  size_t* grown;
+  if (*count == *capacity) {
+    grown = (size_t*) realloc(*stack, (*capacity ? *capacity*2 : EDGE_STACK_SIZE) * sizeof(size_t));
+    if (!grown)
+      return false;
+    *stack = grown;
+    *capacity = *capacity ? *capacity*2 : EDGE_STACK_SIZE;
+  }
+  (*stack)[(*count)++] = index;
+  return true;
+}
+
+int applyAvgPgm(char* inputFileName, char* outputFileName, int kernelSize, int version) {
+  pgm_map image;
+  uint8_t *arr, *pixelValues;
+  int width, height;
+  bool written;
+  if (kernelSize <= 0 || !(kernelSize%2)) {
+    setColor(RED);
+    printf("Error: window size must be greater than 0 and odd\n");
+    setColor(RESET);
+    return 1;
+  }
+  arr = readPgm(inputFileName, &width, &height, &image);
+  if (!arr)
+    return 1;
+  if (!doesKernelFit(kernelSize, width, height)) {
+    setColor(RED);
+    printf("Error: %dx%d window doesn't fit in %s\n", kernelSize, kernelSize, inputFileName);
+    setColor(RESET);
+    releasePgm(arr, &image);
+    return 1;
+  }
+  beginStage(PROFILE_FILTER);
+  pixelValues = filterAvgImage(arr, width, height, kernelSize, NULL);
+  endStage(pixelValues ? (size_t) width * height * 2 : 0);
+  releasePgm(arr, &image);
+  if (!pixelValues)
+    return 1;
+  written = writeArrToPgm(pixelValues, width, height, outputFileName, version);
+  poolRelease(pixelValues);
+  return written ? 0 : 1;
+}
+
+/*
+* Function: filterAvgImage
+* --------------------------
+* applies a kernelSize x kernelSize averaging filter and pads the result
+* back to the image size with zeros
+*
+* pixelValues: the image
+* width: image width
+* height: image height
+* kernelSize: odd window dimension that fits in the image
+* output: width*height buffer for the result, NULL to take one from the pool
+*
+* returns: a pointer to the width*height result, NULL on failure
+*/
+uint8_t* filterAvgImage(uint8_t* pixelValues, int width, int height, int kernelSize, uint8_t* output) {
+  int padding = (kernelSize>>1);
+  padding_mode frame = {PADDING_ZERO, 0};
+  row_sink sink;
+  if (!initFramedRowSink(&sink, NORMALIZE_SLICE, width-padding*2, height-padding*2, padding, &frame, output))
+    return NULL;
+  if (!applyBoxFilter(pixelValues, width, height, kernelSize, NULL, &sink)) {
+    freeRowSink(&sink);
+    return NULL;
+  }
+  return finishRowSink(&sink);
+}
+
+/*
+* Function: applyBoxFilter
+* --------------------------
+* applies a windowSize x windowSize averaging filter and hands the result
+* rows to sink. Window sums are kept as running column and row sums so
+* the cost per pixel doesn't depend on windowSize, and each mean is
+* rounded to the nearest integer (halves up)
+*
+* pixelValues: pointer to the array representing image that will be processed
+* width: image width
+* height: image height
+* windowSize: odd window dimension
+* padding: how the pixels outside of the image are read, the output then has
+* the image size. NULL only filters the area the window fits in
+* sink: row sink initialized for the output size
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyBoxFilter(uint8_t* pixelValues, int width, int height, int windowSize, padding_mode* padding, row_sink* sink) {
+  if (!padding && !checkUnpaddedFit(windowSize, width, height))
+    return false;
+  return applyBoxArr(windowSize, pixelValues, width, height, padding, sink);
+}
+
+bool applyBoxArr(int windowSize, uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  box_job job;
+  if (!prepareRowSink(sink, 0, MAX_PIXEL_VAL))
+    return false;
+  job.windowSize = windowSize;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.height = height;
+  job.padding = padding;
+  job.sink = sink;
+  job.failed = false;
+  initMutex(&job.lock);
+  runRowBands(padding ? height : height - windowSize + 1, applyBoxRows, &job);
+  destroyMutex(&job.lock);
+  return !job.failed;
+}
+
+void applyBoxRows(void* context, int firstRow, int lastRow) {
+  box_job* job = (box_job*) context;
+  int windowSize = job->windowSize, area = windowSize*windowSize, width = job->width, padding = windowSize >> 1;
+  int areaWidth = job->padding ? width : width - windowSize + 1, topRow = job->padding ? firstRow - padding : firstRow;
+  int sum, column, source, *columnSums, *outputRow, *scratch;
+  uint8_t *leavingRow, *enteringRow;
+  size_t i, j;
+  // columnSums[j] is the sum of column j over the window rows of output row i
+  columnSums = (int*) poolAlloc(width * sizeof(int));
+  scratch = (int*) poolAlloc(areaWidth * sizeof(int));
+  if (!columnSums || !scratch) {
+    poolRelease(columnSums);
+    poolRelease(scratch);
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  memset(columnSums, 0, width * sizeof(int));
+  for (i = 0; i < windowSize; i++)
+    addBoxRow(job, topRow + i, columnSums, 1);
+  for (i = firstRow; i < lastRow; i++) {
+    outputRow = getSinkRow(job->sink, i, scratch);
+    if (job->padding) {
+      // columns whose window crosses the border read the padding
+      sum = 0;
+      for (column = 0; column < width; column++) {
+        if (column > padding && column + padding < width) {
+          sum += columnSums[column+padding] - columnSums[column-padding-1];
+        } else {
+          sum = 0;
+          for (j = 0; j < windowSize; j++) {
+            source = borderIndex(column + j - padding, width, job->padding->type);
+            sum += source < 0 ? getPaddingValue(job->padding) * windowSize : columnSums[source];
+          }
+        }
+        outputRow[column] = (sum + area/2) / area;
+      }
+    } else {
+      sum = 0;
+      for (j = 0; j < windowSize; j++)
+        sum += columnSums[j];
+      outputRow[0] = (sum + area/2) / area;
+      for (j = 1; j < areaWidth; j++) {
+        sum += columnSums[j+windowSize-1] - columnSums[j-1];
+        outputRow[j] = (sum + area/2) / area;
+      }
+    }
+    putSinkRow(job->sink, i, outputRow);
+    if (i+1 < lastRow && job->padding) {
+      addBoxRow(job, i - padding, columnSums, -1);
+      addBoxRow(job, i + padding + 1, columnSums, 1);
+    } else if (i+1 < lastRow) {
+      leavingRow = job->pixelValues + i*width;
+      enteringRow = job->pixelValues + (i+windowSize)*width;
+      for (j = 0; j < width; j++)
+        columnSums[j] += enteringRow[j] - leavingRow[j];
+    }
+  }
+  poolRelease(columnSums);
+  poolRelease(scratch);
+}
+
+/*
+* Function: addBoxRow
+* --------------------------
+* adds (sign 1) or removes (sign -1) an input row to the column sums of a
+* box job, rows outside of the image are read through the job padding
+*
+* job: the box job
+* row: input row index, may be outside of the image if the job is padded
+* columnSums: width column sums
+* sign: 1 or -1
+*/
+void addBoxRow(box_job* job, int row, int* columnSums, int sign) {
+  uint8_t* inputRow;
+  int value;
+  size_t j;
+  if (job->padding)
+    row = borderIndex(row, job->height, job->padding->type);
+  if (row < 0) {
+    value = getPaddingValue(job->padding) * sign;
+    for (j = 0; j < job->width; j++)
+      columnSums[j] += value;
+    return;
+  }
+  inputRow = job->pixelValues + (size_t) row * job->width;
+  for (j = 0; j < job->width; j++)
+    columnSums[j] += inputRow[j] * sign;
+}
+
+int applyVerPrewittPgm(char* inputFileName, char* outputFileName, int version) {
+  pgm_map image;
+  uint8_t *arr, *pixelValues;
+  int width, height;
+  bool written;
+  arr = readPgm(inputFileName, &width, &height, &image);
+  if (!arr)
+    return 1;
+  beginStage(PROFILE_FILTER);
+  pixelValues = filterVerPrewittImage(arr, width, height, NULL);
+  endStage(pixelValues ? (size_t) width * height * 2 : 0);
+  releasePgm(arr, &image);
+  if (!pixelValues)
+    return 1;
+  written = writeArrToPgm(pixelValues, width, height, outputFileName, version);
+  poolRelease(pixelValues);
+  return written ? 0 : 1;
+}
+
+/*
+* Function: filterVerPrewittImage
+* --------------------------
+* applies the vertical prewitt operator, slices the result and pads it back
+* to the image size with zeros
+*
+* pixelValues: the image
+* width: image width
+* height: image height
+* output: width*height buffer for the result, NULL to take one from the pool
+*
+* returns: a pointer to the width*height result, NULL on failure
+*/
+uint8_t* filterVerPrewittImage(uint8_t* pixelValues, int width, int height, uint8_t* output) {
+  int padding = 1;
+  padding_mode frame = {PADDING_ZERO, 0};
+  row_sink sink;
+  if (!initFramedRowSink(&sink, NORMALIZE_SLICE, width-padding*2, height-padding*2, padding, &frame, output))
+    return NULL;
+  if (!applyPrewittVertical(pixelValues, width, height, NULL, &sink)) {
+    freeRowSink(&sink);
+    return NULL;
+  }
+  return finishRowSink(&sink);
+}
+
+/*
+* Function: applyPrewittVertical
+* --------------------------
+* applies a vertical edge detection filter and hands the result rows to sink
+*
+* pixelValues: pointer to the array representing image that will be processed
+* width: image width
+* height: image height
+* padding: how the pixels outside of the image are read, the output then has
+* the image size. NULL only filters the area the kernel fits in
+* sink: row sink initialized for the output size
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyPrewittVertical(uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  int staticKernel[3*3] = {1, 1, 1, 0, 0, 0, -1, -1, -1};
+  int rowVector[3] = {1, 1, 1}, colVector[3] = {1, 0, -1};
+  int kernelSize = 3;
+  mask kernel = {3, staticKernel, rowVector, colVector};
+  if (!padding && !checkUnpaddedFit(kernelSize, width, height))
+    return false;
+  if (!padding)
+    return applyPrewittArr(pixelValues, width, height, PREWITT_VERTICAL, sink);
+  return applyMaskArr(&kernel, 1, pixelValues, width, height, padding, sink);
+}
+
+/*
+* Function: applyPrewittHorizontal
+* --------------------------
+* applies a horizontal edge detection filter and hands the result rows to sink
+*
+* pixelValues: pointer to the array representing image that will be processed
+* width: image width
+* height: image height
+* padding: how the pixels outside of the image are read, the output then has
+* the image size. NULL only filters the area the kernel fits in
+* sink: row sink initialized for the output size
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyPrewittHorizontal(uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  int staticKernel[3*3] = {1, 0, -1, 1, 0, -1, 1, 0, -1};
+  int rowVector[3] = {1, 0, -1}, colVector[3] = {1, 1, 1};
+  int kernelSize = 3;
+  mask kernel = {3, staticKernel, rowVector, colVector};
+  if (!padding && !checkUnpaddedFit(kernelSize, width, height))
+    return false;
+  if (!padding)
+    return applyPrewittArr(pixelValues, width, height, PREWITT_HORIZONTAL, sink);
+  return applyMaskArr(&kernel, 1, pixelValues, width, height, padding, sink);
+}
+
+/*
+* Function: mapBinaryPgm
+* --------------------------
+* maps a binary PGM file and returns its raster in place. The pixels are
+* read-only and stay valid until unmapFile(image)
+*
+* fileName: path of the PGM file
+* width: set to the image width
+* height: set to the image height
+* image: set to the mapping that holds the pixels
+*
+* returns: a pointer to the first pixel, NULL on failure
+*/
+uint8_t* mapBinaryPgm(char* fileName, int* width, int* height, pgm_map* image) {
+  pgm_reader reader;
+  if (!openPgmReader(&reader, fileName, "P5"))
+    return NULL;
+  *width = reader.width;
+  *height = reader.height;
+  *image = reader.image;
+  return image->data + reader.rasterOffset;
+}
+
+/*
+* Function: openPgmReader
+* --------------------------
+* maps a PGM file and parses its header
+*
+* reader: the reader to open
+* fileName: path of the PGM file
+* magic: expected magic number ("P5" or "P2"), NULL for either
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool openPgmReader(pgm_reader* reader, char* fileName, char* magic) {
+  if (!mapFile(fileName, &reader->image)) {
+    setColor(RED);
+    printf("Couldn't read %s\nProbably doesn't exist\n", fileName);
+    setColor(RESET);
+    return false;
+  }
+  if (!magic)
+    magic = reader->image.length >= MAGIC_NUMBER_SIZE && !memcmp(reader->image.data, "P2", MAGIC_NUMBER_SIZE) ? "P2" : "P5";
+  reader->fileName = fileName;
+  reader->version = magic[1] - '0';
+  if (!parsePgmHeader(&reader->image, fileName, magic, &reader->width, &reader->height, &reader->maxValue, &reader->rasterOffset)) {
+    unmapFile(&reader->image);
+    return false;
+  }
+  if (reader->version == 5 && reader->image.length - reader->rasterOffset < (size_t) reader->width * reader->height) {
+    setColor(RED);
+    printf("%s is truncated: %dx%d pixels expected, %zu bytes found\n", fileName, reader->width, reader->height, reader->image.length - reader->rasterOffset);
+    setColor(RESET);
+    unmapFile(&reader->image);
+    return false;
+  }
+  rewindPgmReader(reader);
+  return true;
+}
+
+/*
+* Function: readPgmRows
+* --------------------------
+* reads the next rowCount rows, the pages already read are released so a
+* sequential read keeps little of the file resident
+*
+* reader: an open reader
+* rows: array of rowCount*width pixels
+* rowCount: number of rows to read
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool readPgmRows(pgm_reader* reader, uint8_t* rows, int rowCount) {
+  size_t count = (size_t) rowCount * reader->width;
+  if (reader->version == 5) {
+    memcpy(rows, reader->image.data + reader->position, count);
+    reader->position += count;
+    reader->pixelIndex += count;
+  } else if (!parseAsciiPixels(reader, rows, count)) {
+    return false;
+  }
+  if (reader->position - reader->releasedOffset >= SEQUENTIAL_HINT_MIN_SIZE)
+    reader->releasedOffset = releaseFileRange(&reader->image, reader->releasedOffset, reader->position);
+  return true;
+}
+
+/*
+* Function: parseAsciiPixels
+* --------------------------
+* tokenizes the next count decimal pixels of an ASCII PGM file in a single
+* pass, comments are allowed between pixels
+*
+* reader: an open reader of a P2 file
+* pixels: array of count pixels
+* count: number of pixels to read
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool parseAsciiPixels(pgm_reader* reader, uint8_t* pixels, size_t count) {
+  uint8_t *position = reader->image.data + reader->position, *end = reader->image.data + reader->image.length;
+  size_t i;
+  int value, maxValue = reader->maxValue;
+  for (i = 0; i < count; i++) {
+    while (position < end && (isSpace(*position) || *position == '#')) {
+      if (*position == '#') {
+        while (position < end && *position != '\n')
+          position++;
+      } else {
+        position++;
+      }
+    }
+    if (position == end) {
+      setColor(RED);
+      printf("Error: corrupt input. Read %zu pixels, expected %zu.\n", reader->pixelIndex + i, (size_t) reader->width * reader->height);
+      setColor(RESET);
+      return false;
+    }
+    if (*position < '0' || *position > '9') {
+      setColor(RED);
+      printf("Error: corrupt input. Unexpected character '%c' at byte %zu of %s\n", *position, (size_t)(position - reader->image.data), reader->fileName);
+      setColor(RESET);
+      return false;
+    }
+    // values past maxValue stop growing so long digit runs can't overflow
+    value = 0;
+    while (position < end && *position >= '0' && *position <= '9') {
+      if (value <= maxValue)
+        value = value*10 + (*position - '0');
+      position++;
+    }
+    if (value > maxValue) {
+      setColor(RED);
+      printf("Error: corrupt input. Pixel at row %zu, column %zu is not in [0-%d]\n", (reader->pixelIndex + i) / reader->width, (reader->pixelIndex + i) % reader->width, maxValue);
+      setColor(RESET);
+      return false;
+    }
+    pixels[i] = (uint8_t) value;
+  }
+  reader->position = position - reader->image.data;
+  reader->pixelIndex += count;
+  return true;
+}
+
+/*
+* Function: checkPgmEnd
+* --------------------------
+* checks that an ASCII PGM file has no pixels left after the last row
+*
+* reader: a reader that has read every row
+*
+* returns: false if there are extra pixels
+*/
+bool checkPgmEnd(pgm_reader* reader) {
+  uint8_t *position = reader->image.data + reader->position, *end = reader->image.data + reader->image.length;
+  if (reader->version == 5)
+    return true;
+  while (position < end && (isSpace(*position) || *position == '#')) {
+    if (*position == '#') {
+      while (position < end && *position != '\n')
+        position++;
+    } else {
+      position++;
+    }
+  }
+  if (position == end)
+    return true;
+  setColor(RED);
+  printf("Error: corrupt input. %s has more than the %zu pixels expected\n", reader->fileName, (size_t) reader->width * reader->height);
+  setColor(RESET);
+  return false;
+}
+
+void rewindPgmReader(pgm_reader* reader) {
+  reader->position = reader->rasterOffset;
+  reader->pixelIndex = 0;
+  reader->releasedOffset = 0;
+}
+
+void closePgmReader(pgm_reader* reader) {
+  unmapFile(&reader->image);
+}
+
+/*
+* Function: parsePgmHeader
+* --------------------------
+* parses the magic number, size and maximum value of a mapped PGM file
+*
+* image: the mapped file
+* fileName: used in error messages
+* magic: expected magic number ("P5" or "P2")
+* width: set to the image width
+* height: set to the image height
+* maxValue: set to the maximum pixel value
+* rasterOffset: set to the offset of the first pixel, past the single
+* whitespace that ends the header
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool parsePgmHeader(pgm_map* image, char* fileName, char* magic, int* width, int* height, int* maxValue, size_t* rasterOffset) {
+  size_t offset = MAGIC_NUMBER_SIZE;
+  if (image->length < MAGIC_NUMBER_SIZE || memcmp(image->data, magic, MAGIC_NUMBER_SIZE)) {
+    setColor(RED);
+    printf("%s is not a%s PGM file\n", fileName, magic[1] == '5' ? " binary" : "n ASCII");
+    setColor(RESET);
+    return false;
+  }
+  if (!readHeaderValue(image, &offset, width) || !readHeaderValue(image, &offset, height)
+      || *width <= 0 || *height <= 0) {
+    setColor(RED);
+    printf("%s has an invalid image size\n", fileName);
+    setColor(RESET);
+    return false;
+  }
+  if (!readHeaderValue(image, &offset, maxValue) || *maxValue <= 0 || *maxValue > MAX_PIXEL_VAL) {
+    setColor(RED);
+    printf("%s has an invalid maximum value, expected [1-%d]\n", fileName, MAX_PIXEL_VAL);
+    setColor(RESET);
+    return false;
+  }
+  if (offset >= image->length || !isSpace(image->data[offset])) {
+    setColor(RED);
+    printf("%s has no pixel data\n", fileName);
+    setColor(RESET);
+    return false;
+  }
+  *rasterOffset = offset + 1;
+  return true;
+}
+
+/*
+* Function: readHeaderValue
+* --------------------------
+* reads the next decimal value of a PGM header, skipping whitespace and
+* comment lines
+*
+* image: the mapped file
+* offset: position to read from, moved past the value
+* value: set to the value read
+*
+* returns: false if there is no valid value at offset
+*/
+bool readHeaderValue(pgm_map* image, size_t* offset, int* value) {
+  size_t i = *offset;
+  long long result = 0;
+  while (i < image->length && (isSpace(image->data[i]) || image->data[i] == '#')) {
+    if (image->data[i] == '#') {
+      while (i < image->length && image->data[i] != '\n')
+        i++;
+    } else {
+      i++;
+    }
+  }
+  if (i >= image->length || image->data[i] < '0' || image->data[i] > '9')
+    return false;
+  while (i < image->length && image->data[i] >= '0' && image->data[i] <= '9') {
+    result = result*10 + (image->data[i] - '0');
+    if (result > INT32_MAX)
+      return false;
+    i++;
+  }
+  *value = (int) result;
+  *offset = i;
+  return true;
+}
+
+/*
+* Function: readPgm
+* --------------------------
+* loads a PGM file for the filters, binary files are mapped in place and
+* ASCII files are parsed into a new array
+*
+* fileName: path of the PGM file
+* width: set to the image width
+* height: set to the image height
+* image: keeps track of how the pixels are stored, pass it to releasePgm
+*
+* returns: a pointer to the read-only pixel values, NULL on failure
+*/
+uint8_t* readPgm(char* fileName, int* width, int* height, pgm_map* image) {
+  uint8_t* pixelValues;
+  beginStage(PROFILE_READ);
+  pixelValues = mapBinaryPgm(fileName, width, height, image);
+  if (!pixelValues) {
+    setColor(YELLOW);
+    printf("Trying ASCII pgm format...\n");
+    setColor(RESET);
+    image->mapped = false;
+    image->data = pixelValues = rAsciiPgm(fileName, width, height);
+  }
+  endStage(pixelValues ? (size_t) *width * *height : 0);
+  return pixelValues;
+}
+
+void releasePgm(uint8_t* pixelValues, pgm_map* image) {
+  if (image->mapped)
+    unmapFile(image);
+  else
+    poolRelease(pixelValues);
+}
+
+/*
+* Function: rAsciiPgm
+* --------------------------
+* reads an ASCII PGM file into a newly allocated array, see parseAsciiPixels
+*
+* fileName: path of the PGM file
+* width: set to the image width
+* height: set to the image height
+*
+* returns: a pointer to the allocated pixel values, NULL on failure
+*/
+uint8_t* rAsciiPgm(char* fileName, int* width, int* height) {
+  pgm_reader reader;
+  uint8_t* pixelValues;
+  if (!openPgmReader(&reader, fileName, "P2"))
+    return NULL;
+  pixelValues = (uint8_t*) poolAlloc((size_t) reader.width * reader.height * sizeof(uint8_t));
+  if (!pixelValues) {
+    setColor(RED);
+    printf("%s:%d > Failed to allocate memory\n", __FILE__, __LINE__);
+    setColor(RESET);
+    closePgmReader(&reader);
+    return NULL;
+  }
+  if (!readPgmRows(&reader, pixelValues, reader.height) || !checkPgmEnd(&reader)) {
+    poolRelease(pixelValues);
+    closePgmReader(&reader);
+    return NULL;
+  }
+  *width = reader.width;
+  *height = reader.height;
+  closePgmReader(&reader);
+  return pixelValues;
+}
+
+void removeExtension(char* filename, char* stripped) {
+  strcpy(stripped, filename);
+  char *end = stripped + strlen(stripped);
+  while (end > stripped && *end != '.' && *end != '\\' && *end != '/') {
+    end--;
+  }
+  if ((end > stripped && *end == '.') &&
+      (*(end - 1) != '\\' && *(end - 1) != '/')) {
+      *end = '\0';
+  }
+}
+
+/*
+* Function: applyMaskArr
+* --------------------------
+* applies a mask to an image, as two 1D passes if the mask is
+* separable and big enough for it to pay off, else as a 2D convolution
+*
+* kernel: the mask, rowVector and colVector may declare it separable
+* coefficient: a float multiplied with each result
+* pixelValues: the image
+* width: image width
+* height: image height
+* padding: how the pixels outside of the image are read for a width*height
+* output, NULL for the (width-kernelSize+1)*(height-kernelSize+1) area the
+* mask fits in
+* sink: row sink initialized for the output size
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyMaskArr(mask* kernel, float coefficient, uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  int *rowVector = kernel->rowVector, *colVector = kernel->colVector, method, fftSize, border = padding ? 0 : (kernel->size >> 1)*2;
+  long long minBound, maxBound, bound;
+  bool separable, applied;
+  fixed_scale scale, unit = {1, 0};
+  initFixedScale(&scale, coefficient);
+  getMaskBounds(kernel->matrix, kernel->size, &scale, &minBound, &maxBound);
+  if (!prepareRowSink(sink, minBound, maxBound))
+    return false;
+  if (kernel->size < SEPARABLE_MIN_SIZE)
+    return applyKernelArr(kernel->matrix, kernel->size, &scale, pixelValues, width, height, padding, sink);
+  separable = rowVector && colVector;
+  if (!separable) {
+    rowVector = (int*) malloc(kernel->size * sizeof(int));
+    colVector = (int*) malloc(kernel->size * sizeof(int));
+    separable = rowVector && colVector && findSeparableFactors(kernel->matrix, kernel->size, rowVector, colVector);
+  }
+  // the bound of the unscaled sums decides if the FFT rounds them exactly
+  getMaskBounds(kernel->matrix, kernel->size, &unit, &minBound, &maxBound);
+  bound = -minBound > maxBound ? -minBound : maxBound;
+  method = selectMaskMethod(kernel->matrix, kernel->size, separable, width - border, height - border, bound, &fftSize);
+  if (method == MASK_SEPARABLE)
+    applied = applySeparableArr(rowVector, colVector, kernel->size, &scale, pixelValues, width, height, padding, sink);
+  else if (method == MASK_FFT)
+    applied = applyFftArr(kernel->matrix, kernel->size, fftSize, &scale, pixelValues, width, height, padding, sink);
+  else
+    applied = applyKernelArr(kernel->matrix, kernel->size, &scale, pixelValues, width, height, padding, sink);
+  // either malloc may have failed alone, so each vector is freed on its own
+  if (rowVector != kernel->rowVector)
+    free(rowVector);
+  if (colVector != kernel->colVector)
+    free(colVector);
+  return applied;
+}
+
+/*
+* Function: selectMaskMethod
+* --------------------------
+* estimates the work of the direct, separable and FFT convolutions of a mask
+* and picks the cheapest. The direct cost is kernelSize^2 taps per pixel, or
+* the operations of the compiled plan applyKernelArr runs instead, cheaper
+* when the row kernels are vectorised; the separable one is 2*kernelSize taps
+* and the FFT one the butterflies of the tiles covering the output.
+* The FFT is only used while its double precision results round to the
+* exact integer sums
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+* separable: whether the mask has separable factors
+* areaWidth: output width
+* areaHeight: output height
+* bound: largest absolute sum the mask can produce
+* fftSize: set to the tile size of the FFT
+*
+* returns: MASK_DIRECT, MASK_SEPARABLE or MASK_FFT
+*/
+int selectMaskMethod(int* kernel, int kernelSize, bool separable, int areaWidth, int areaHeight, long long bound, int* fftSize) {
+  double pixels = (double) areaWidth * areaHeight, taps = (double) kernelSize * kernelSize, best, cost;
+  int method = MASK_DIRECT, size, tileSize, levels, tiles, tapCost;
+  plan_row_function planRow = selectPlanRow();
+  mask_plan plan;
+  tapCost = selectConvolveRow(kernel, kernelSize) == convolveRowScalar ? SCALAR_TAP_COST : SIMD_TAP_COST;
+  // a plan tap is an addition and a group a multiply-add, a dense tap a multiply-add
+  if (planRow && compileMaskPlan(kernel, kernelSize, areaWidth, &plan)) {
+    taps = (plan.groupEnds[plan.groupCount-1] + plan.groupCount*2) / 2.0;
+    tapCost = planRow == convolveRowPlanScalar ? SCALAR_TAP_COST : SIMD_TAP_COST;
+    poolRelease(plan.weights);
+  }
+  best = pixels * taps * tapCost;
+  if (separable && pixels * 2 * kernelSize * SEPARABLE_TAP_COST < best) {
+    best = pixels * 2 * kernelSize * SEPARABLE_TAP_COST;
+    method = MASK_SEPARABLE;
+  }
+  if (bound > FFT_MAX_BOUND)
+    return method;
+  for (size = FFT_MIN_SIZE, levels = 5; size <= FFT_MAX_SIZE; size *= 2, levels++) {
+    tileSize = size - kernelSize + 1;
+    if (tileSize < kernelSize)
+      continue;
+    tiles = ((areaWidth + tileSize - 1) / tileSize) * ((areaHeight + tileSize - 1) / tileSize);
+    // a forward and an inverse 2D transform per pair of tiles
+    cost = (double) tiles * size * size * levels * FFT_TILE_COST;
+    if (cost < best) {
+      best = cost;
+      method = MASK_FFT;
+      *fftSize = size;
+    }
+    // bigger tiles only add padding once one tile covers the output
+    if (tileSize >= areaWidth && tileSize >= areaHeight)
+      break;
+  }
+  return method;
+}
+
+/*
+* Function: getMaskBounds
+* --------------------------
+* computes the range a mask can produce on 8-bit pixels, so row sinks can
+* pick the narrowest intermediate type
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+* scale: the coefficient multiplied with each result
+* minBound: set to a value not greater than any result
+* maxBound: set to a value not less than any result
+*/
+void getMaskBounds(int* kernel, int kernelSize, fixed_scale* scale, long long* minBound, long long* maxBound) {
+  long long negativeSum = 0, positiveSum = 0;
+  double low, high, coefficient = ldexp((double) scale->multiplier, -scale->shift);
+  size_t i;
+  for (i = 0; i < kernelSize*kernelSize; i++) {
+    if (kernel[i] < 0)
+      negativeSum += kernel[i];
+    else
+      positiveSum += kernel[i];
+  }
+  low = (double) negativeSum * MAX_PIXEL_VAL * coefficient;
+  high = (double) positiveSum * MAX_PIXEL_VAL * coefficient;
+  // one extra step on each side covers the double rounding of the bounds
+  *minBound = (long long) floor(low < high ? low : high) - 1;
+  *maxBound = (long long) ceil(low < high ? high : low) + 1;
+}
+
+/*
+* Function: initFixedScale
+* --------------------------
+* turns a float coefficient into an integer multiply-shift. A float is
+* exactly mantissa * 2^exponent with a 24 bit mantissa, so value * coefficient
+* is computed exactly as (value * multiplier) / 2^shift in 64 bits and then
+* rounded toward zero, which is what the (int) cast of the float product did
+* apart from the rounding of the float product itself. Coefficients of 1 and
+* other powers of two need no multiplication, coefficients of 2^31 and more
+* (or infinite) are clamped to it and NaN counts as 0
+*
+* scale: the scale to initialize
+* coefficient: the float coefficient
+*/
+void initFixedScale(fixed_scale* scale, float coefficient) {
+  int exponent = 32;
+  double mantissa = isnan(coefficient) ? 0 : (isinf(coefficient) ? copysign(0.5, coefficient) : frexp(coefficient, &exponent));
+  scale->multiplier = (long long) ldexp(mantissa, 24);
+  scale->shift = 24 - exponent;
+  if (!scale->multiplier || scale->shift > 62) {
+    scale->multiplier = 0;
+    scale->shift = 0;
+    return;
+  }
+  if (scale->shift < -7) {
+    scale->multiplier = scale->multiplier < 0 ? -(1LL << 31) : (1LL << 31);
+    scale->shift = 0;
+  }
+  for (; scale->shift < 0; scale->shift++)
+    scale->multiplier *= 2;
+  while (scale->shift > 0 && !(scale->multiplier & 1)) {
+    scale->multiplier /= 2;
+    scale->shift--;
+  }
+}
+
+/*
+* Function: scaleRowFixed
+* --------------------------
+* multiplies count values with a fixed scale, rounding toward zero. The loop
+* has no branches or floats so the compiler can vectorise it
+*
+* values: the row to scale in place
+* count: number of values
+* scale: the coefficient, see initFixedScale
+*/
+void scaleRowFixed(int* values, int count, fixed_scale* scale) {
+  long long multiplier = scale->multiplier, product, bias = (1LL << scale->shift) - 1;
+  int shift = scale->shift, k;
+  if (multiplier == 1 && !shift)
+    return;
+  for (k = 0; k < count; k++) {
+    product = values[k] * multiplier;
+    // arithmetic shifts round toward minus infinity, the bias makes negative products round toward zero
+    values[k] = (int)((product + ((product >> 63) & bias)) >> shift);
+  }
+}
+
+/*
+* Function: findSeparableFactors
+* --------------------------
+* checks if the kernel is the outer product of two integer vectors
+* (kernel[i][j] == colVector[i] * rowVector[j]) and computes them
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+* rowVector: array of kernelSize values that will hold the row factor
+* colVector: array of kernelSize values that will hold the column factor
+*
+* returns: true if the kernel is separable
+*/
+bool findSeparableFactors(int* kernel, int kernelSize, int* rowVector, int* colVector) {
+  int i, j, pivotRow = -1, pivotCol = -1, divisor = 0, a, b;
+  long long numerator;
+  for (i = 0; i < kernelSize*kernelSize && pivotRow < 0; i++) {
+    if (kernel[i]) {
+      pivotRow = i / kernelSize;
+      pivotCol = i % kernelSize;
+    }
+  }
+  if (pivotRow < 0)
+    return false;
+  // the row factor is the pivot row divided by the gcd of its values
+  for (j = 0; j < kernelSize; j++) {
+    a = abs(divisor);
+    b = abs(kernel[pivotRow*kernelSize+j]);
+    while (b) {
+      a %= b;
+      a ^= b;
+      b ^= a;
+      a ^= b;
+    }
+    divisor = a;
+  }
+  for (j = 0; j < kernelSize; j++)
+    rowVector[j] = kernel[pivotRow*kernelSize+j] / divisor;
+  // the column factor follows from the pivot column, it must be integer
+  for (i = 0; i < kernelSize; i++) {
+    numerator = (long long) kernel[i*kernelSize+pivotCol] * divisor;
+    if (numerator % kernel[pivotRow*kernelSize+pivotCol])
+      return false;
+    colVector[i] = (int)(numerator / kernel[pivotRow*kernelSize+pivotCol]);
+  }
+  for (i = 0; i < kernelSize; i++) {
+    for (j = 0; j < kernelSize; j++) {
+      if ((long long) colVector[i] * rowVector[j] != kernel[i*kernelSize+j])
+        return false;
+    }
+  }
+  return true;
+}
+
+/*
+* Function: applySeparableArr
+* --------------------------
+* applies the mask colVector * rowVector to an image as a horizontal
+* pass followed by a vertical pass. Integer sums are the same as the 2D
+* convolution, so the result is identical to applyKernelArr
+*
+* rowVector: horizontal factor of the mask
+* colVector: vertical factor of the mask
+* kernelSize: the length of kernel dimension
+* scale: the coefficient multiplied with each result
+* pixelValues: the image
+* width: image width
+* height: image height
+* padding: border handling, see applyMaskArr
+* sink: row sink prepared for the mask range
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applySeparableArr(int* rowVector, int* colVector, int kernelSize, fixed_scale* scale, uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  separable_job job;
+  job.rowVector = rowVector;
+  job.colVector = colVector;
+  job.kernelSize = kernelSize;
+  job.scale = *scale;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.height = height;
+  job.padding = padding;
+  job.sink = sink;
+  job.failed = false;
+  initMutex(&job.lock);
+  runRowBands(padding ? height : height - (kernelSize >> 1)*2, applySeparableRows, &job);
+  destroyMutex(&job.lock);
+  return !job.failed;
+}
+
+void applySeparableRows(void* context, int firstRow, int lastRow) {
+  separable_job* job = (separable_job*) context;
+  int kernelSize = job->kernelSize, padding = kernelSize >> 1, entering;
+  int areaWidth = job->padding ? job->width : job->width - padding*2;
+  int topRow = job->padding ? firstRow - padding : firstRow, *horizontal, *horizontalRow, *outputRow, *scratch;
+  size_t i, j, k;
+  // the horizontal pass of input row r is kept in slot (r - topRow) % kernelSize
+  // of a ring holding the kernelSize rows the current output row reads
+  horizontal = (int*) poolAlloc((size_t) kernelSize * areaWidth * sizeof(int));
+  scratch = (int*) poolAlloc(areaWidth * sizeof(int));
+  if (!horizontal || !scratch) {
+    poolRelease(horizontal);
+    poolRelease(scratch);
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  for (entering = 0; entering < kernelSize - 1; entering++)
+    separableHorizontalRow(job, topRow + entering, horizontal + (size_t) entering*areaWidth);
+  // vertical pass
+  for (i = firstRow; i < lastRow; i++) {
+    entering = i - firstRow + kernelSize - 1;
+    separableHorizontalRow(job, topRow + entering, horizontal + (size_t)(entering % kernelSize)*areaWidth);
+    outputRow = getSinkRow(job->sink, i, scratch);
+    memset(outputRow, 0, areaWidth * sizeof(int));
+    for (j = 0; j < job->kernelSize; j++) {
+      horizontalRow = horizontal + ((i - firstRow + j) % kernelSize) * areaWidth;
+      for (k = 0; k < areaWidth; k++)
+        outputRow[k] += horizontalRow[k] * job->colVector[j];
+    }
+    scaleRowFixed(outputRow, areaWidth, &(job->scale));
+    putSinkRow(job->sink, i, outputRow);
+  }
+  poolRelease(horizontal);
+  poolRelease(scratch);
+}
+
+/*
+* Function: separableHorizontalRow
+* --------------------------
+* applies the row factor of a separable job to one input row. Padded jobs
+* read rows and columns outside of the image through the job padding
+*
+* job: the separable job
+* row: input row index, may be outside of the image if the job is padded
+* horizontalRow: output row of the job width (padded) or area width
+*/
+void separableHorizontalRow(separable_job* job, int row, int* horizontalRow) {
+  int kernelSize = job->kernelSize, padding = kernelSize >> 1, width = job->width, sum, column, source;
+  int interiorWidth = width > padding*2 ? width - padding*2 : 0, offset = job->padding ? padding : 0;
+  uint8_t* inputRow;
+  size_t j, k;
+  if (job->padding && (row = borderIndex(row, job->height, job->padding->type)) < 0) {
+    sum = 0;
+    for (j = 0; j < kernelSize; j++)
+      sum += job->rowVector[j];
+    for (k = 0; k < width; k++)
+      horizontalRow[k] = sum * getPaddingValue(job->padding);
+    return;
+  }
+  inputRow = job->pixelValues + (size_t) row * width;
+  memset(horizontalRow + offset, 0, interiorWidth * sizeof(int));
+  for (j = 0; j < kernelSize; j++) {
+    for (k = 0; k < interiorWidth; k++)
+      horizontalRow[offset+k] += inputRow[j+k] * job->rowVector[j];
+  }
+  if (!job->padding)
+    return;
+  // columns on both sides whose window crosses the border
+  for (column = 0; column < width; column++) {
+    if (column == padding && interiorWidth)
+      column += interiorWidth;
+    sum = 0;
+    for (j = 0; j < kernelSize; j++) {
+      source = borderIndex(column + (int) j - padding, width, job->padding->type);
+      sum += (source < 0 ? getPaddingValue(job->padding) : inputRow[source]) * job->rowVector[j];
+    }
+    horizontalRow[column] = sum;
+  }
+}
+
+/*
+* Function: applyKernelArr
+* --------------------------
+* applies a kernel to an image as a 2D convolution
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+* scale: the coefficient multiplied with each result
+* pixelValues: the image
+* width: image width
+* height: image height
+* padding: border handling, see applyMaskArr
+* sink: row sink prepared for the kernel range
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyKernelArr(int* kernel, int kernelSize, fixed_scale* scale, uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  kernel_job job;
+  mask_plan plan;
+  job.kernel = kernel;
+  job.kernelSize = kernelSize;
+  job.scale = *scale;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.height = height;
+  job.padding = padding;
+  job.sink = sink;
+  job.plan = selectPlanRow() && compileMaskPlan(kernel, kernelSize, width, &plan) ? &plan : NULL;
+  // a tile keeps kernelSize input rows and an int output row per column
+  job.tileColumns = selectTileColumns(kernelSize + sizeof(int), kernelSize - 1, width - (kernelSize >> 1)*2);
+  job.failed = false;
+  initMutex(&job.lock);
+  runRowBands(padding ? height : height - (kernelSize >> 1)*2, applyKernelRows, &job);
+  destroyMutex(&job.lock);
+  if (job.plan)
+    poolRelease(plan.weights);
+  return !job.failed;
+}
+
+/*
+* Function: applyKernelRows
+* --------------------------
+* applies the kernel of a kernel_job to the output rows in [firstRow, lastRow).
+* When the kernel rows of a full image row don't fit in cache, strips of
+* TILE_ROWS rows are computed a tile of columns at a time
+*
+* context: pointer to the kernel_job
+* firstRow: first output row (without padding)
+* lastRow: row after the last output row
+*/
+void applyKernelRows(void* context, int firstRow, int lastRow) {
+  kernel_job* job = (kernel_job*) context;
+  int padding = job->kernelSize >> 1, width = job->width, interiorWidth = width - padding*2;
+  int areaWidth = job->padding ? width : interiorWidth, stripRows, top, bottom, left, count, *scratch;
+  int* outputRows[TILE_ROWS];
+  uint8_t* window;
+  bool borderRow;
+  size_t i;
+  convolve_row_function convolveRow = selectConvolveRow(job->kernel, job->kernelSize);
+  plan_row_function planRow = selectPlanRow();
+  // rows are only gathered in strips when the interior is cut in tiles
+  stripRows = job->tileColumns < interiorWidth ? TILE_ROWS : 1;
+  scratch = (int*) poolAlloc((size_t) stripRows * areaWidth * sizeof(int));
+  if (!scratch) {
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  for (top = firstRow; top < lastRow; top = bottom) {
+    bottom = top + stripRows < lastRow ? top + stripRows : lastRow;
+    for (i = top; i < bottom; i++) {
+      outputRows[i-top] = getSinkRow(job->sink, i, scratch + (i-top)*areaWidth);
+      if (!job->padding) {
+        continue;
+      } else if (i < padding || i >= job->height - padding || interiorWidth <= 0) {
+        convolvePaddedPixels(job, i, 0, width, outputRows[i-top]);
+      } else {
+        // only the columns whose window crosses the border read the padding
+        convolvePaddedPixels(job, i, 0, padding, outputRows[i-top]);
+        convolvePaddedPixels(job, i, width - padding, width, outputRows[i-top]);
+      }
+    }
+    // the strip walks every tile down, the input rows of a tile staying in cache
+    for (left = 0; left < interiorWidth; left += job->tileColumns) {
+      count = left + job->tileColumns < interiorWidth ? job->tileColumns : interiorWidth - left;
+      for (i = top; i < bottom; i++) {
+        borderRow = job->padding && (i < padding || i >= job->height - padding);
+        if (borderRow)
+          continue;
+        window = job->pixelValues + (job->padding ? i - padding : i)*width + left;
+        if (job->plan)
+          planRow(job->plan, window, outputRows[i-top] + (job->padding ? padding : 0) + left, count);
+        else
+          convolveRow(job->kernel, job->kernelSize, window, width, outputRows[i-top] + (job->padding ? padding : 0) + left, count);
+      }
+    }
+    for (i = top; i < bottom; i++) {
+      scaleRowFixed(outputRows[i-top], areaWidth, &(job->scale));
+      putSinkRow(job->sink, i, outputRows[i-top]);
+    }
+  }
+  poolRelease(scratch);
+}
+
+/*
+* Function: convolvePaddedPixels
+* --------------------------
+* applies the kernel of a padded kernel_job to the pixels of an output row
+* whose window crosses the image border
+*
+* job: the kernel job
+* row: output row (image row)
+* firstColumn: first output column
+* lastColumn: column after the last output column
+* outputRow: output row of the image width
+*/
+void convolvePaddedPixels(kernel_job* job, int row, int firstColumn, int lastColumn, int* outputRow) {
+  int kernelSize = job->kernelSize, padding = kernelSize >> 1, result, column, i, j;
+  for (column = firstColumn; column < lastColumn; column++) {
+    result = 0;
+    for (i = 0; i < kernelSize; i++) {
+      for (j = 0; j < kernelSize; j++)
+        result += getPaddedPixel(job->pixelValues, job->width, job->height, row + i - padding, column + j - padding, job->padding) * job->kernel[i*kernelSize+j];
+    }
+    outputRow[column] = result;
+  }
+}
+
+/*
+* Function: selectConvolveRow
+* --------------------------
+* picks the fastest row convolution the CPU supports for the kernel
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+*
+* returns: a pointer to the selected row function
+*/
+convolve_row_function selectConvolveRow(int* kernel, int kernelSize) {
+#ifdef X86_SIMD
+  size_t i;
+  bool fitsInt16 = true;
+  if (__builtin_cpu_supports("avx2"))
+    return convolveRowAvx2;
+  // the SSE2 path multiplies 16-bit lanes
+  for (i = 0; i < kernelSize*kernelSize; i++) {
+    if (kernel[i] < INT16_MIN || kernel[i] > INT16_MAX)
+      fitsInt16 = false;
+  }
+  if (fitsInt16 && __builtin_cpu_supports("sse2"))
+    return convolveRowSse2;
+#endif
+  return convolveRowScalar;
+}
+
+/*
+* Function: convolveRowScalar
+* --------------------------
+* applies the kernel to count adjacent pixels of a padded image row
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+* window: top left pixel of the window of the first output pixel
+* width: padded image width (row stride of window)
+* outputRow: array the count results are written to
+* count: number of output pixels
+*/
+void convolveRowScalar(int* kernel, int kernelSize, uint8_t* window, int width, int* outputRow, int count) {
+  size_t i, j, k;
+  int result;
+  for (k = 0; k < count; k++) {
+    result = 0;
+    for (i = 0; i < kernelSize; i++) {
+      for (j = 0; j < kernelSize; j++)
+        result += window[i*width+j+k] * kernel[i*kernelSize+j];
+    }
+    outputRow[k] = result;
+  }
+}
+
+/*
+* Function: compileMaskPlan
+* --------------------------
+* groups the taps of a mask by absolute weight, see mask_plan. The plan is
+* only worth it when it does fewer operations than the dense mask: a tap
+* costs an addition and a group a multiplication and an addition, where
+* every dense tap is a multiply-add
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+* width: row stride of the image the plan reads
+* plan: set to the compiled plan, plan->weights owns its arrays
+*
+* returns: true if the plan was compiled and is cheaper than the mask
+*/
+bool compileMaskPlan(int* kernel, int kernelSize, int width, mask_plan* plan) {
+  int taps = kernelSize * kernelSize, tapCount = 0, weight, g, i, *cursors;
+  plan->groupCount = 0;
+  plan->weights = (int*) poolAlloc((size_t) taps * 5 * sizeof(int));
+  if (!plan->weights)
+    return false;
+  plan->positiveEnds = plan->weights + taps;
+  plan->groupEnds = plan->positiveEnds + taps;
+  plan->offsets = plan->groupEnds + taps;
+  cursors = plan->offsets + taps;
+  // positiveEnds and groupEnds count the taps of each group first
+  for (i = 0; i < taps; i++) {
+    if (!kernel[i])
+      continue;
+    weight = abs(kernel[i]);
+    for (g = 0; g < plan->groupCount && plan->weights[g] != weight; g++);
+    if (g == plan->groupCount) {
+      plan->weights[g] = weight;
+      plan->positiveEnds[g] = plan->groupEnds[g] = 0;
+      plan->groupCount++;
+    }
+    if (kernel[i] > 0)
+      plan->positiveEnds[g]++;
+    plan->groupEnds[g]++;
+    tapCount++;
+  }
+  if (!tapCount || tapCount + plan->groupCount*2 >= taps*2) {
+    poolRelease(plan->weights);
+    return false;
+  }
+  for (g = 0, i = 0; g < plan->groupCount; g++) {
+    cursors[g] = i;
+    i += plan->groupEnds[g];
+    plan->groupEnds[g] = i;
+    plan->positiveEnds[g] += cursors[g];
+  }
+  // positive taps fill each group from its start, negative ones from the end of its positive taps
+  for (i = 0; i < taps; i++) {
+    if (!kernel[i])
+      continue;
+    for (g = 0; plan->weights[g] != abs(kernel[i]); g++);
+    if (kernel[i] > 0)
+      plan->offsets[cursors[g]++] = (i / kernelSize) * width + i % kernelSize;
+  }
+  for (g = 0; g < plan->groupCount; g++)
+    cursors[g] = plan->positiveEnds[g];
+  for (i = 0; i < taps; i++) {
+    if (kernel[i] >= 0)
+      continue;
+    for (g = 0; plan->weights[g] != -kernel[i]; g++);
+    plan->offsets[cursors[g]++] = (i / kernelSize) * width + i % kernelSize;
+  }
+  return true;
+}
+
+/*
+* Function: selectPlanRow
+* --------------------------
+* picks the row function of compiled masks. Plans replace the dense
+* kernels with AVX2 or without SIMD; the 16-bit products of the SSE2 dense
+* kernel beat a plan evaluated without 32-bit multiplies
+*
+* returns: a pointer to the selected row function, NULL to keep the dense kernels
+*/
+plan_row_function selectPlanRow() {
+#ifdef X86_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    return convolveRowPlanAvx2;
+  if (__builtin_cpu_supports("sse2"))
+    return NULL;
+#endif
+  return convolveRowPlanScalar;
+}
+
+/*
+* Function: convolveRowPlanScalar
+* --------------------------
+* applies a compiled mask to count adjacent pixels of an image row
+*
+* plan: the compiled mask
+* window: top left pixel of the window of the first output pixel
+* outputRow: array the count results are written to
+* count: number of output pixels
+*/
+void convolveRowPlanScalar(mask_plan* plan, uint8_t* window, int* outputRow, int count) {
+  int g, t, k, sum, groupSum;
+  for (k = 0; k < count; k++) {
+    sum = 0;
+    for (g = 0, t = 0; g < plan->groupCount; g++) {
+      groupSum = 0;
+      for (; t < plan->positiveEnds[g]; t++)
+        groupSum += window[plan->offsets[t] + k];
+      for (; t < plan->groupEnds[g]; t++)
+        groupSum -= window[plan->offsets[t] + k];
+      sum += plan->weights[g] == 1 ? groupSum : groupSum * plan->weights[g];
+    }
+    outputRow[k] = sum;
+  }
+}
+
+#ifdef X86_SIMD
+/*
+* Function: convolveRowSse2Body
+* --------------------------
+* SSE2 version of convolveRowScalar, 16 pixels per iteration. Kernel values
+* must fit in 16 bits; the products are rebuilt to 32 bits from mullo/mulhi.
+* Inlined with a constant kernelSize so 3x3 and 5x5 get unrolled tap loops
+*/
+static inline __attribute__((always_inline, target("sse2")))
+void convolveRowSse2Body(int* kernel, int kernelSize, uint8_t* window, int width, int* outputRow, int count) {
+  int i, j, k = 0;
+  __m128i zero = _mm_setzero_si128(), weight, pixels, low, high, productLow, productHigh, sum[4];
+  for (; k + 16 <= count; k += 16) {
+    sum[0] = sum[1] = sum[2] = sum[3] = zero;
+    for (i = 0; i < kernelSize; i++) {
+      for (j = 0; j < kernelSize; j++) {
+        weight = _mm_set1_epi16((short) kernel[i*kernelSize+j]);
+        pixels = _mm_loadu_si128((__m128i*)(window + i*width + j + k));
+        low = _mm_unpacklo_epi8(pixels, zero);
+        high = _mm_unpackhi_epi8(pixels, zero);
+        productLow = _mm_mullo_epi16(low, weight);
+        productHigh = _mm_mulhi_epi16(low, weight);
+        sum[0] = _mm_add_epi32(sum[0], _mm_unpacklo_epi16(productLow, productHigh));
+        sum[1] = _mm_add_epi32(sum[1], _mm_unpackhi_epi16(productLow, productHigh));
+        productLow = _mm_mullo_epi16(high, weight);
+        productHigh = _mm_mulhi_epi16(high, weight);
+        sum[2] = _mm_add_epi32(sum[2], _mm_unpacklo_epi16(productLow, productHigh));
+        sum[3] = _mm_add_epi32(sum[3], _mm_unpackhi_epi16(productLow, productHigh));
+      }
+    }
+    for (i = 0; i < 4; i++)
+      _mm_storeu_si128((__m128i*)(outputRow + k + i*4), sum[i]);
+  }
+  convolveRowScalar(kernel, kernelSize, window + k, width, outputRow + k, count - k);
+}
+
+__attribute__((target("sse2")))
+void convolveRowSse2(int* kernel, int kernelSize, uint8_t* window, int width, int* outputRow, int count) {
+  if (kernelSize == 3)
+    convolveRowSse2Body(kernel, 3, window, width, outputRow, count);
+  else if (kernelSize == 5)
+    convolveRowSse2Body(kernel, 5, window, width, outputRow, count);
+  else
+    convolveRowSse2Body(kernel, kernelSize, window, width, outputRow, count);
+}
+
+/*
+* Function: convolveRowAvx2Body
+* --------------------------
+* AVX2 version of convolveRowScalar, 32 pixels per iteration with 32-bit
+* products so any kernel value is supported
+*/
+static inline __attribute__((always_inline, target("avx2")))
+void convolveRowAvx2Body(int* kernel, int kernelSize, uint8_t* window, int width, int* outputRow, int count) {
+  int i, j, l, k = 0;
+  uint8_t* tap;
+  __m256i weight, sum[4];
+  for (; k + 32 <= count; k += 32) {
+    sum[0] = sum[1] = sum[2] = sum[3] = _mm256_setzero_si256();
+    for (i = 0; i < kernelSize; i++) {
+      for (j = 0; j < kernelSize; j++) {
+        weight = _mm256_set1_epi32(kernel[i*kernelSize+j]);
+        tap = window + i*width + j + k;
+        for (l = 0; l < 4; l++)
+          sum[l] = _mm256_add_epi32(sum[l], _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(tap + l*8))), weight));
+      }
+    }
+    for (l = 0; l < 4; l++)
+      _mm256_storeu_si256((__m256i*)(outputRow + k + l*8), sum[l]);
+  }
+  convolveRowScalar(kernel, kernelSize, window + k, width, outputRow + k, count - k);
+}
+
+/*
+* Function: convolveRowPlanAvx2
+* --------------------------
+* AVX2 version of convolveRowPlanScalar, 32 pixels per iteration
+*/
+__attribute__((target("avx2")))
+void convolveRowPlanAvx2(mask_plan* plan, uint8_t* window, int* outputRow, int count) {
+  int g, t, l, k = 0;
+  uint8_t* tap;
+  __m256i weight, sum[4], groupSum[4];
+  for (; k + 32 <= count; k += 32) {
+    sum[0] = sum[1] = sum[2] = sum[3] = _mm256_setzero_si256();
+    for (g = 0, t = 0; g < plan->groupCount; g++) {
+      groupSum[0] = groupSum[1] = groupSum[2] = groupSum[3] = _mm256_setzero_si256();
+      for (; t < plan->positiveEnds[g]; t++) {
+        tap = window + plan->offsets[t] + k;
+        for (l = 0; l < 4; l++)
+          groupSum[l] = _mm256_add_epi32(groupSum[l], _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(tap + l*8))));
+      }
+      for (; t < plan->groupEnds[g]; t++) {
+        tap = window + plan->offsets[t] + k;
+        for (l = 0; l < 4; l++)
+          groupSum[l] = _mm256_sub_epi32(groupSum[l], _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(tap + l*8))));
+      }
+      if (plan->weights[g] != 1) {
+        weight = _mm256_set1_epi32(plan->weights[g]);
+        for (l = 0; l < 4; l++)
+          groupSum[l] = _mm256_mullo_epi32(groupSum[l], weight);
+      }
+      for (l = 0; l < 4; l++)
+        sum[l] = _mm256_add_epi32(sum[l], groupSum[l]);
+    }
+    for (l = 0; l < 4; l++)
+      _mm256_storeu_si256((__m256i*)(outputRow + k + l*8), sum[l]);
+  }
+  convolveRowPlanScalar(plan, window + k, outputRow + k, count - k);
+}
+
+__attribute__((target("avx2")))
+void convolveRowAvx2(int* kernel, int kernelSize, uint8_t* window, int width, int* outputRow, int count) {
+  if (kernelSize == 3)
+    convolveRowAvx2Body(kernel, 3, window, width, outputRow, count);
+  else if (kernelSize == 5)
+    convolveRowAvx2Body(kernel, 5, window, width, outputRow, count);
+  else
+    convolveRowAvx2Body(kernel, kernelSize, window, width, outputRow, count);
+}
+#endif
+
+/*
+* Function: applyFftArr
+* --------------------------
+* applies a kernel to an image through the frequency domain. The output is
+* cut in tiles of fftSize-kernelSize+1 rows and columns whose fftSize*fftSize
+* input windows are transformed two at a time (one as the real and one as
+* the imaginary part, the mask being real), so the memory stays bounded by
+* the tile size. Results are rounded to the integer sums applyKernelArr
+* computes, see selectMaskMethod
+*
+* kernel: pointer to the kernel values
+* kernelSize: the length of kernel dimension
+* fftSize: transform size, a power of two
+* scale: the coefficient multiplied with each result
+* pixelValues: the image
+* width: image width
+* height: image height
+* padding: border handling, see applyMaskArr
+* sink: row sink prepared for the kernel range
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyFftArr(int* kernel, int kernelSize, int fftSize, fixed_scale* scale, uint8_t* pixelValues, int width, int height, padding_mode* padding, row_sink* sink) {
+  fft_job job;
+  size_t i, j, size = (size_t) fftSize * fftSize;
+  job.kernel = kernel;
+  job.kernelSize = kernelSize;
+  job.scale = *scale;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.height = height;
+  job.padding = padding;
+  job.sink = sink;
+  job.tileSize = fftSize - kernelSize + 1;
+  job.areaWidth = padding ? width : width - (kernelSize >> 1)*2;
+  job.areaHeight = padding ? height : height - (kernelSize >> 1)*2;
+  if (!initFftPlan(&(job.plan), fftSize))
+    return false;
+  job.spectrum = (double*) poolAlloc(size * 2 * sizeof(double));
+  if (!job.spectrum) {
+    freeFftPlan(&(job.plan));
+    return false;
+  }
+  memset(job.spectrum, 0, size * 2 * sizeof(double));
+  for (i = 0; i < kernelSize; i++) {
+    for (j = 0; j < kernelSize; j++)
+      job.spectrum[(i*fftSize + j)*2] = kernel[i*kernelSize+j];
+  }
+  fftRows(&(job.plan), job.spectrum, kernelSize, false);
+  fftColumns(&(job.plan), job.spectrum, false);
+  // the conjugate turns the product of the transforms into a correlation
+  for (i = 0; i < size; i++)
+    job.spectrum[i*2+1] = -job.spectrum[i*2+1];
+  job.failed = false;
+  initMutex(&job.lock);
+  runRowBands(job.areaHeight, applyFftRows, &job);
+  destroyMutex(&job.lock);
+  poolRelease(job.spectrum);
+  freeFftPlan(&(job.plan));
+  return !job.failed;
+}
+
+/*
+* Function: applyFftRows
+* --------------------------
+* computes the output rows in [firstRow, lastRow) of an fft_job tile row by
+* tile row
+*
+* context: pointer to the fft_job
+* firstRow: first output row
+* lastRow: row after the last output row
+*/
+void applyFftRows(void* context, int firstRow, int lastRow) {
+  fft_job* job = (fft_job*) context;
+  int size = job->plan.size, tileSize = job->tileSize, areaWidth = job->areaWidth, top, left, rows, row, column, c;
+  double *data, *spectrum = job->spectrum, real, imaginary, inverseScale = 1.0 / ((double) size * size);
+  int *strip, *scratch, *outputRow;
+  size_t i, count = (size_t) size * size;
+  data = (double*) poolAlloc(count * 2 * sizeof(double));
+  strip = (int*) poolAlloc((size_t) tileSize * areaWidth * sizeof(int));
+  scratch = (int*) poolAlloc(areaWidth * sizeof(int));
+  if (!data || !strip || !scratch) {
+    poolRelease(data);
+    poolRelease(strip);
+    poolRelease(scratch);
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  for (top = firstRow; top < lastRow; top += tileSize) {
+    rows = lastRow - top < tileSize ? lastRow - top : tileSize;
+    for (left = 0; left < areaWidth; left += tileSize*2) {
+      loadFftTile(job, data, top, left, 0);
+      loadFftTile(job, data, top, left + tileSize, 1);
+      fftRows(&(job->plan), data, size, false);
+      fftColumns(&(job->plan), data, false);
+      for (i = 0; i < count; i++) {
+        real = data[i*2]*spectrum[i*2] - data[i*2+1]*spectrum[i*2+1];
+        imaginary = data[i*2]*spectrum[i*2+1] + data[i*2+1]*spectrum[i*2];
+        data[i*2] = real;
+        data[i*2+1] = imaginary;
+      }
+      fftColumns(&(job->plan), data, true);
+      fftRows(&(job->plan), data, rows, true);
+      // the first tile is the real part, the second one the imaginary part
+      for (row = 0; row < rows; row++) {
+        for (c = 0; c < tileSize*2; c++) {
+          column = left + c;
+          if (column >= areaWidth)
+            break;
+          strip[(size_t) row*areaWidth + column] = (int) lround(data[((size_t) row*size + c % tileSize)*2 + c / tileSize] * inverseScale);
+        }
+      }
+    }
+    for (row = 0; row < rows; row++) {
+      outputRow = getSinkRow(job->sink, top + row, scratch);
+      memcpy(outputRow, strip + (size_t) row*areaWidth, areaWidth * sizeof(int));
+      scaleRowFixed(outputRow, areaWidth, &(job->scale));
+      putSinkRow(job->sink, top + row, outputRow);
+    }
+  }
+  poolRelease(data);
+  poolRelease(strip);
+  poolRelease(scratch);
+}
+
+/*
+* Function: loadFftTile
+* --------------------------
+* copies the input window of the output tile at (top, left) into the real
+* or imaginary parts of a transform buffer. Pixels outside of the image are
+* read through the padding of the job, or as 0 where no output needs them
+*
+* job: the fft job
+* data: size*size complex values
+* top: first output row of the tile
+* left: first output column of the tile
+* part: 0 for the real and 1 for the imaginary parts
+*/
+void loadFftTile(fft_job* job, double* data, int top, int left, int part) {
+  int size = job->plan.size, offset = job->padding ? job->kernelSize >> 1 : 0, row, column, r, c;
+  int lastRow = job->areaHeight + job->kernelSize - 1 - offset, lastColumn = job->areaWidth + job->kernelSize - 1 - offset;
+  double* values;
+  for (r = 0; r < size; r++) {
+    values = data + (size_t) r*size*2 + part;
+    row = top + r - offset;
+    for (c = 0; c < size; c++) {
+      column = left + c - offset;
+      if (left >= job->areaWidth || row >= lastRow || column >= lastColumn)
+        values[c*2] = 0;
+      else if (row >= 0 && row < job->height && column >= 0 && column < job->width)
+        values[c*2] = job->pixelValues[(size_t) row*job->width + column];
+      else
+        values[c*2] = getPaddedPixel(job->pixelValues, job->width, job->height, row, column, job->padding);
+    }
+  }
+}
+
+/*
+* Function: initFftPlan
+* --------------------------
+* computes the twiddle factors and the bit reversed order of a transform
+*
+* plan: the plan to initialize
+* size: transform length, a power of two
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool initFftPlan(fft_plan* plan, int size) {
+  int i, bit, levels = 0;
+  plan->size = size;
+  plan->twiddles = (double*) poolAlloc(size * sizeof(double));
+  plan->reversed = (int*) poolAlloc(size * sizeof(int));
+  if (!plan->twiddles || !plan->reversed) {
+    freeFftPlan(plan);
+    return false;
+  }
+  while ((1 << levels) < size)
+    levels++;
+  for (i = 0; i < size/2; i++) {
+    plan->twiddles[i*2] = cos(2 * M_PI * i / size);
+    plan->twiddles[i*2+1] = -sin(2 * M_PI * i / size);
+  }
+  for (i = 0; i < size; i++) {
+    plan->reversed[i] = 0;
+    for (bit = 0; bit < levels; bit++)
+      plan->reversed[i] |= ((i >> bit) & 1) << (levels - 1 - bit);
+  }
+  return true;
+}
+
+void freeFftPlan(fft_plan* plan) {
+  poolRelease(plan->twiddles);
+  poolRelease(plan->reversed);
+  plan->twiddles = NULL;
+  plan->reversed = NULL;
+}
+
+/*
+* Function: fftRows
+* --------------------------
+* transforms the first count rows of a size*size complex array in place with
+* an iterative radix-2 FFT. The inverse transform is not divided by size
+*
+* plan: tables of the transform
+* data: size*size complex values
+* count: number of rows to transform
+* inverse: whether to apply the inverse transform
+*/
+void fftRows(fft_plan* plan, double* data, int count, bool inverse) {
+  int size = plan->size, half, step, row, i, j, k;
+  double sign = inverse ? -1 : 1, twiddleReal, twiddleImaginary, real, imaginary, *values, *a, *b;
+  for (row = 0; row < count; row++) {
+    values = data + (size_t) row*size*2;
+    for (i = 0; i < size; i++) {
+      j = plan->reversed[i];
+      if (i < j) {
+        real = values[i*2];
+        imaginary = values[i*2+1];
+        values[i*2] = values[j*2];
+        values[i*2+1] = values[j*2+1];
+        values[j*2] = real;
+        values[j*2+1] = imaginary;
+      }
+    }
+    for (half = 1, step = size/2; half < size; half *= 2, step /= 2) {
+      for (i = 0; i < size; i += half*2) {
+        for (k = 0; k < half; k++) {
+          twiddleReal = plan->twiddles[k*step*2];
+          twiddleImaginary = sign * plan->twiddles[k*step*2+1];
+          a = values + (i+k)*2;
+          b = a + half*2;
+          real = b[0]*twiddleReal - b[1]*twiddleImaginary;
+          imaginary = b[0]*twiddleImaginary + b[1]*twiddleReal;
+          b[0] = a[0] - real;
+          b[1] = a[1] - imaginary;
+          a[0] += real;
+          a[1] += imaginary;
+        }
+      }
+    }
+  }
+}
+
+/*
+* Function: fftColumns
+* --------------------------
+* transforms the columns of a size*size complex array in place. The
+* butterflies combine whole rows, so the inner loop runs over contiguous
+* values instead of striding down a column
+*
+* plan: tables of the transform
+* data: size*size complex values
+* inverse: whether to apply the inverse transform
+*/
+void fftColumns(fft_plan* plan, double* data, bool inverse) {
+  int size = plan->size, half, step, i, j, k;
+  size_t c, rowLength = (size_t) size*2;
+  double sign = inverse ? -1 : 1, twiddleReal, twiddleImaginary, real, imaginary, *a, *b;
+  for (i = 0; i < size; i++) {
+    j = plan->reversed[i];
+    if (i < j) {
+      a = data + i*rowLength;
+      b = data + j*rowLength;
+      for (c = 0; c < rowLength; c++) {
+        real = a[c];
+        a[c] = b[c];
+        b[c] = real;
+      }
+    }
+  }
+  for (half = 1, step = size/2; half < size; half *= 2, step /= 2) {
+    for (i = 0; i < size; i += half*2) {
+      for (k = 0; k < half; k++) {
+        twiddleReal = plan->twiddles[k*step*2];
+        twiddleImaginary = sign * plan->twiddles[k*step*2+1];
+        a = data + (i+k)*rowLength;
+        b = a + half*rowLength;
+        for (c = 0; c < rowLength; c += 2) {
+          real = b[c]*twiddleReal - b[c+1]*twiddleImaginary;
+          imaginary = b[c]*twiddleImaginary + b[c+1]*twiddleReal;
+          b[c] = a[c] - real;
+          b[c+1] = a[c+1] - imaginary;
+          a[c] += real;
+          a[c+1] += imaginary;
+        }
+      }
+    }
+  }
+}
+
+int applyMedianPgm(char* inputFileName, char* outputFileName, int kernelSize, int version) {
+  pgm_map image;
+  uint8_t *arr, *pixelValues;
+  int width, height;
+  bool written;
+  if (kernelSize <= 0 || !(kernelSize%2) || kernelSize > MAX_MEDIAN_WINDOW_SIZE) {
+    setColor(RED);
+    printf("Error: window size must be odd and in [1-%d]\n", MAX_MEDIAN_WINDOW_SIZE);
+    setColor(RESET);
+    return 1;
+  }
+  arr = readPgm(inputFileName, &width, &height, &image);
+  if (!arr)
+    return 1;
+  if (!doesKernelFit(kernelSize, width, height)) {
+    setColor(RED);
+    printf("Error: %dx%d window doesn't fit in %s\n", kernelSize, kernelSize, inputFileName);
+    setColor(RESET);
+    releasePgm(arr, &image);
+    return 1;
+  }
+  beginStage(PROFILE_FILTER);
+  pixelValues = filterMedianImage(arr, width, height, kernelSize, NULL);
+  endStage(pixelValues ? (size_t) width * height * 2 : 0);
+  releasePgm(arr, &image);
+  if (!pixelValues)
+    return 1;
+  written = writeArrToPgm(pixelValues, width, height, outputFileName, version);
+  poolRelease(pixelValues);
+  return written ? 0 : 1;
+}
+
+/*
+* Function: filterMedianImage
+* --------------------------
+* applies a kernelSize x kernelSize median filter and pads the result back
+* to the image size with zeros
+*
+* pixelValues: the image
+* width: image width
+* height: image height
+* kernelSize: odd window dimension that fits in the image
+* output: width*height buffer for the result, NULL to take one from the pool
+*
+* returns: a pointer to the width*height result, NULL on failure
+*/
+uint8_t* filterMedianImage(uint8_t* pixelValues, int width, int height, int kernelSize, uint8_t* output) {
+  uint8_t* filteredValues;
+  int padding = (kernelSize>>1);
+  padding_mode frame = {PADDING_ZERO, 0};
+  filteredValues = output ? output : (uint8_t*) poolAlloc((size_t) width * height * sizeof(uint8_t));
+  if (!filteredValues)
+    return NULL;
+  if (!applyMedianArr(kernelSize, pixelValues, width, height, filteredValues + (size_t) padding*width + padding, width)) {
+    if (!output)
+      poolRelease(filteredValues);
+    return NULL;
+  }
+  fillPadding(filteredValues, width, height, padding, &frame);
+  return filteredValues;
+}
+
+/*
+* Function: applyMedianArr
+* --------------------------
+* applies the median filter to the area of an image the window fits in
+*
+* kernelSize: odd window dimension
+* pixelValues: the image
+* width: image width
+* height: image height
+* outputArr: first pixel of the (width-kernelSize+1)*(height-kernelSize+1) output
+* outputWidth: row stride of outputArr
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool applyMedianArr(int kernelSize, uint8_t* pixelValues, int width, int height, uint8_t* outputArr, int outputWidth) {
+  median_job job;
+  int areaHeight = height - (kernelSize >> 1)*2;
+  job.kernelSize = kernelSize;
+  job.pixelValues = pixelValues;
+  job.width = width;
+  job.outputArr = outputArr;
+  job.outputWidth = outputWidth;
+  // a tile keeps the fine and coarse histograms of every input column
+  job.tileColumns = selectTileColumns((HISTOGRAM_BINS + HISTOGRAM_COARSE_BINS) * sizeof(uint16_t), kernelSize - 1, width - kernelSize + 1);
+  job.failed = false;
+  initMutex(&job.lock);
+  if (kernelSize == 3 || kernelSize == 5)
+    runRowBands(areaHeight, applyNetworkMedianRows, &job);
+  else if (kernelSize >= HISTOGRAM_MEDIAN_MIN_SIZE)
+    runRowBands(areaHeight, applyHistogramMedianRows, &job);
+  else
+    runRowBands(areaHeight, applyMedianRows, &job);
+  destroyMutex(&job.lock);
+  return !job.failed;
+}
+
+/*
+* Function: applyMedianRows
+* --------------------------
+* applies the median filter of a median_job to the output rows in [firstRow, lastRow)
+*
+* context: pointer to the median_job
+* firstRow: first output row (without padding)
+* lastRow: row after the last output row
+*/
+void applyMedianRows(void* context, int firstRow, int lastRow) {
+  median_job* job = (median_job*) context;
+  int padding = job->kernelSize >> 1, areaWidth = job->width - padding*2;
+  size_t i, j;
+  // every band needs its own scratch window since quick select reorders it
+  uint8_t* arr = (uint8_t*) malloc(job->kernelSize*job->kernelSize*sizeof(uint8_t));
+  if (!arr) {
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  for (i = firstRow; i < lastRow; i++) {
+    for (j = 0; j < areaWidth; j++)
+      job->outputArr[i*job->outputWidth+j] = getMedianForPix(arr, job->kernelSize, job->pixelValues, job->width, i+padding, j+padding);
+  }
+  free(arr);
+}
+
+/*
+* Function: applyNetworkMedianRows
+* --------------------------
+* median filter for 3x3 and 5x5 windows built from branchless min/max
+* networks. The columns of each output row are sorted once into kernelSize
+* planes (planes[r*width+x] is the r-th smallest value of column x) and
+* shared by the kernelSize windows that contain them
+*
+* context: pointer to the median_job
+* firstRow: first output row (without padding)
+* lastRow: row after the last output row
+*/
+void applyNetworkMedianRows(void* context, int firstRow, int lastRow) {
+  median_job* job = (median_job*) context;
+  int areaWidth = job->width - job->kernelSize + 1;
+  size_t i;
+  median_row_function medianRow = selectMedianRow();
+  uint8_t* planes = (uint8_t*) poolAlloc(job->kernelSize * job->width * sizeof(uint8_t));
+  if (!planes) {
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  for (i = firstRow; i < lastRow; i++)
+    medianRow(job->kernelSize, job->pixelValues + i*job->width, job->width, planes, job->outputArr + i*job->outputWidth, areaWidth);
+  poolRelease(planes);
+}
+
+median_row_function selectMedianRow() {
+#ifdef X86_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    return medianRowAvx2;
+  if (__builtin_cpu_supports("sse2"))
+    return medianRowSse2;
+#endif
+  return medianRowScalar;
+}
+
+/*
+* sorts the kernelSize values of a column, v[0] ends up the smallest
+*/
+#define COLUMN3_NETWORK(SORT) SORT(0, 1) SORT(1, 2) SORT(0, 1)
+#define COLUMN5_NETWORK(SORT) \
+  SORT(0, 1) SORT(3, 4) SORT(2, 4) SORT(2, 3) SORT(1, 4) SORT(0, 3) SORT(0, 2) SORT(1, 3) SORT(1, 2)
+
+/*
+* 5x5 median selection network. v[column*5+row] holds the window with every
+* column already sorted; afterwards v[12] is the median. SORT(a, b) orders
+* v[a] <= v[b], LOWER(a, b) only keeps the minimum in v[a] and UPPER(a, b)
+* only keeps the maximum in v[b]. Derived from Batcher's odd-even merge sort,
+* pruned to the comparators the median depends on and checked against every
+* 0-1 input with sorted columns
+*/
+#define MEDIAN25_NETWORK(SORT, LOWER, UPPER) \
+  SORT(4, 5) SORT(14, 15) SORT(5, 7) SORT(8, 10) SORT(9, 11) SORT(12, 14) \
+  SORT(5, 6) SORT(9, 10) SORT(13, 14) SORT(0, 4) SORT(1, 5) SORT(2, 6) \
+  SORT(8, 12) SORT(10, 14) SORT(11, 15) SORT(16, 20) SORT(17, 21) \
+  SORT(18, 22) SORT(19, 23) SORT(2, 4) SORT(3, 5) SORT(10, 12) SORT(11, 13) \
+  SORT(1, 2) SORT(3, 4) SORT(5, 6) SORT(9, 10) SORT(11, 12) SORT(13, 14) \
+  UPPER(0, 8) UPPER(1, 9) SORT(2, 10) SORT(3, 11) SORT(4, 12) SORT(5, 13) \
+  LOWER(6, 14) LOWER(7, 15) SORT(4, 8) SORT(5, 9) SORT(6, 10) SORT(7, 11) \
+  SORT(20, 24) UPPER(2, 4) SORT(3, 5) SORT(6, 8) SORT(7, 9) SORT(10, 12) \
+  SORT(11, 13) SORT(18, 20) SORT(19, 21) SORT(22, 24) SORT(3, 4) SORT(5, 6) \
+  SORT(7, 8) SORT(9, 10) SORT(11, 12) SORT(17, 18) SORT(19, 20) SORT(21, 22) \
+  SORT(23, 24) UPPER(3, 19) UPPER(4, 20) UPPER(5, 21) LOWER(6, 22) \
+  LOWER(7, 23) LOWER(8, 24) UPPER(8, 16) UPPER(9, 17) LOWER(10, 18) \
+  LOWER(11, 19) LOWER(12, 20) LOWER(13, 21) UPPER(6, 10) UPPER(7, 11) \
+  LOWER(12, 16) LOWER(13, 17) UPPER(10, 12) LOWER(11, 13) UPPER(11, 12)
+
+#define MEDIAN_SORT(a, b) { lower = MEDIAN_MIN(v[a], v[b]); v[b] = MEDIAN_MAX(v[a], v[b]); v[a] = lower; }
+#define MEDIAN_LOWER(a, b) v[a] = MEDIAN_MIN(v[a], v[b]);
+#define MEDIAN_UPPER(a, b) v[b] = MEDIAN_MAX(v[a], v[b]);
+// median of three values
+#define MEDIAN_MED3(a, b, c) MEDIAN_MAX(MEDIAN_MIN(a, b), MEDIAN_MIN(MEDIAN_MAX(a, b), c))
+
+static inline uint8_t minU8(uint8_t a, uint8_t b) {
+  return a < b ? a : b;
+}
+
+static inline uint8_t maxU8(uint8_t a, uint8_t b) {
+  return a > b ? a : b;
+}
+
+#define MEDIAN_MIN minU8
+#define MEDIAN_MAX maxU8
+/*
+* Function: sortColumns
+* --------------------------
+* writes the sorted columns [from, to) of a kernelSize rows window into planes
+*
+* kernelSize: 3 or 5
+* window: first pixel of the top window row
+* width: padded image width (row stride of window and planes)
+* planes: kernelSize rows of width values
+*/
+void sortColumns(int kernelSize, uint8_t* window, int width, uint8_t* planes, int from, int to) {
+  int x, r;
+  uint8_t v[5], lower;
+  for (x = from; x < to; x++) {
+    for (r = 0; r < kernelSize; r++)
+      v[r] = window[r*width + x];
+    if (kernelSize == 3) {
+      COLUMN3_NETWORK(MEDIAN_SORT)
+    } else {
+      COLUMN5_NETWORK(MEDIAN_SORT)
+    }
+    for (r = 0; r < kernelSize; r++)
+      planes[r*width + x] = v[r];
+  }
+}
+
+/*
+* Function: medianFromPlanes
+* --------------------------
+* writes the medians of the output pixels [from, to) using sorted columns.
+* For 3x3 the median is the median of the largest lower value, the median
+* middle value and the smallest upper value of the three columns
+*/
+void medianFromPlanes(int kernelSize, uint8_t* planes, int width, uint8_t* outputRow, int from, int to) {
+  int x, r, c;
+  uint8_t v[25], lower, *low = planes, *middle = planes + width, *high = planes + 2*width;
+  for (x = from; x < to; x++) {
+    if (kernelSize == 3) {
+      outputRow[x] = MEDIAN_MED3(maxU8(maxU8(low[x], low[x+1]), low[x+2]),
+                                 MEDIAN_MED3(middle[x], middle[x+1], middle[x+2]),
+                                 minU8(minU8(high[x], high[x+1]), high[x+2]));
+    } else {
+      for (c = 0; c < 5; c++) {
+        for (r = 0; r < 5; r++)
+          v[c*5 + r] = planes[r*width + x + c];
+      }
+      MEDIAN25_NETWORK(MEDIAN_SORT, MEDIAN_LOWER, MEDIAN_UPPER)
+      outputRow[x] = v[12];
+    }
+  }
+}
+
+/*
+* Function: medianRowScalar
+* --------------------------
+* applies a 3x3 or 5x5 median filter to count adjacent pixels of a padded row
+*
+* kernelSize: 3 or 5
+* window: top left pixel of the window of the first output pixel
+* width: padded image width
+* planes: scratch buffer of kernelSize*width values
+* outputRow: array the count results are written to
+* count: number of output pixels
+*/
+void medianRowScalar(int kernelSize, uint8_t* window, int width, uint8_t* planes, uint8_t* outputRow, int count) {
+  sortColumns(kernelSize, window, width, planes, 0, width);
+  medianFromPlanes(kernelSize, planes, width, outputRow, 0, count);
+}
+#undef MEDIAN_MIN
+#undef MEDIAN_MAX
+
+#ifdef X86_SIMD
+#define MEDIAN_MIN _mm_min_epu8
+#define MEDIAN_MAX _mm_max_epu8
+// SSE2 version of medianRowScalar, 16 pixels per iteration
+__attribute__((target("sse2")))
+void medianRowSse2(int kernelSize, uint8_t* window, int width, uint8_t* planes, uint8_t* outputRow, int count) {
+  int x, r, c;
+  __m128i v[25], lower;
+  for (x = 0; x + 16 <= width; x += 16) {
+    for (r = 0; r < kernelSize; r++)
+      v[r] = _mm_loadu_si128((__m128i*)(window + r*width + x));
+    if (kernelSize == 3) {
+      COLUMN3_NETWORK(MEDIAN_SORT)
+    } else {
+      COLUMN5_NETWORK(MEDIAN_SORT)
+    }
+    for (r = 0; r < kernelSize; r++)
+      _mm_storeu_si128((__m128i*)(planes + r*width + x), v[r]);
+  }
+  sortColumns(kernelSize, window, width, planes, x, width);
+  for (x = 0; x + 16 <= count; x += 16) {
+    for (c = 0; c < kernelSize; c++) {
+      for (r = 0; r < kernelSize; r++)
+        v[c*kernelSize + r] = _mm_loadu_si128((__m128i*)(planes + r*width + x + c));
+    }
+    if (kernelSize == 3) {
+      v[4] = MEDIAN_MED3(MEDIAN_MAX(MEDIAN_MAX(v[0], v[3]), v[6]),
+                         MEDIAN_MED3(v[1], v[4], v[7]),
+                         MEDIAN_MIN(MEDIAN_MIN(v[2], v[5]), v[8]));
+      _mm_storeu_si128((__m128i*)(outputRow + x), v[4]);
+    } else {
+      MEDIAN25_NETWORK(MEDIAN_SORT, MEDIAN_LOWER, MEDIAN_UPPER)
+      _mm_storeu_si128((__m128i*)(outputRow + x), v[12]);
+    }
+  }
+  medianFromPlanes(kernelSize, planes, width, outputRow, x, count);
+}
+#undef MEDIAN_MIN
+#undef MEDIAN_MAX
+
+#define MEDIAN_MIN _mm256_min_epu8
+#define MEDIAN_MAX _mm256_max_epu8
+// AVX2 version of medianRowScalar, 32 pixels per iteration
+__attribute__((target("avx2")))
+void medianRowAvx2(int kernelSize, uint8_t* window, int width, uint8_t* planes, uint8_t* outputRow, int count) {
+  int x, r, c;
+  __m256i v[25], lower;
+  for (x = 0; x + 32 <= width; x += 32) {
+    for (r = 0; r < kernelSize; r++)
+      v[r] = _mm256_loadu_si256((__m256i*)(window + r*width + x));
+    if (kernelSize == 3) {
+      COLUMN3_NETWORK(MEDIAN_SORT)
+    } else {
+      COLUMN5_NETWORK(MEDIAN_SORT)
+    }
+    for (r = 0; r < kernelSize; r++)
+      _mm256_storeu_si256((__m256i*)(planes + r*width + x), v[r]);
+  }
+  sortColumns(kernelSize, window, width, planes, x, width);
+  for (x = 0; x + 32 <= count; x += 32) {
+    for (c = 0; c < kernelSize; c++) {
+      for (r = 0; r < kernelSize; r++)
+        v[c*kernelSize + r] = _mm256_loadu_si256((__m256i*)(planes + r*width + x + c));
+    }
+    if (kernelSize == 3) {
+      v[4] = MEDIAN_MED3(MEDIAN_MAX(MEDIAN_MAX(v[0], v[3]), v[6]),
+                         MEDIAN_MED3(v[1], v[4], v[7]),
+                         MEDIAN_MIN(MEDIAN_MIN(v[2], v[5]), v[8]));
+      _mm256_storeu_si256((__m256i*)(outputRow + x), v[4]);
+    } else {
+      MEDIAN25_NETWORK(MEDIAN_SORT, MEDIAN_LOWER, MEDIAN_UPPER)
+      _mm256_storeu_si256((__m256i*)(outputRow + x), v[12]);
+    }
+  }
+  medianFromPlanes(kernelSize, planes, width, outputRow, x, count);
+}
+#undef MEDIAN_MIN
+#undef MEDIAN_MAX
+#endif
+
+/*
+* Function: applyHistogramMedianRows
+* --------------------------
+* median filter for big windows (Perreault and Hebert). Every column keeps a
+* histogram of its pixels inside the window rows; the window histogram
+* slides along the row by adding the entering column histogram and
+* subtracting the leaving one, so the cost per pixel is a constant number of
+* histogram bins regardless of the window size. Bins are kept at two levels
+* (16 coarse bins of 16 values): the coarse bins of the window slide with
+* every pixel, its fine bins only when the median falls in their coarse bin,
+* catching up on the columns that went by or being rebuilt from the column
+* histograms when more than a window went by. Wide images
+* are cut in tiles of columns (see selectTileColumns) so the column
+* histograms stay in cache
+*
+* context: pointer to the median_job
+* firstRow: first output row (without padding)
+* lastRow: row after the last output row
+*/
+void applyHistogramMedianRows(void* context, int firstRow, int lastRow) {
+  median_job* job = (median_job*) context;
+  int kernelSize = job->kernelSize, width = job->width, areaWidth = width - kernelSize + 1;
+  int rank = kernelSize*kernelSize/2, left, count, columns, bin, finePosition[HISTOGRAM_COARSE_BINS];
+  uint16_t *columnFine, *columnCoarse, windowFine[HISTOGRAM_BINS], windowCoarse[HISTOGRAM_COARSE_BINS];
+  uint8_t *tile, *leavingRow, *enteringRow, *outputRow;
+  size_t i, j;
+  columns = job->tileColumns + kernelSize - 1;
+  columnFine = (uint16_t*) poolAlloc((size_t) columns * HISTOGRAM_BINS * sizeof(uint16_t));
+  columnCoarse = (uint16_t*) poolAlloc((size_t) columns * HISTOGRAM_COARSE_BINS * sizeof(uint16_t));
+  if (!columnFine || !columnCoarse) {
+    poolRelease(columnFine);
+    poolRelease(columnCoarse);
+    lockMutex(&job->lock);
+    job->failed = true;
+    unlockMutex(&job->lock);
+    return;
+  }
+  // every tile of output columns runs down the band with the histograms of its own input columns
+  for (left = 0; left < areaWidth; left += job->tileColumns) {
+    count = left + job->tileColumns < areaWidth ? job->tileColumns : areaWidth - left;
+    columns = count + kernelSize - 1;
+    tile = job->pixelValues + left;
+    memset(columnFine, 0, (size_t) columns * HISTOGRAM_BINS * sizeof(uint16_t));
+    memset(columnCoarse, 0, (size_t) columns * HISTOGRAM_COARSE_BINS * sizeof(uint16_t));
+    for (i = firstRow; i < firstRow + kernelSize; i++) {
+      for (j = 0; j < columns; j++)
+        addToColumnHistogram(columnFine, columnCoarse, j, tile[i*width + j], 1);
+    }
+    for (i = firstRow; i < lastRow; i++) {
+      if (i > firstRow) {
+        leavingRow = tile + (i-1)*width;
+        enteringRow = tile + (i+kernelSize-1)*width;
+        for (j = 0; j < columns; j++) {
+          addToColumnHistogram(columnFine, columnCoarse, j, leavingRow[j], -1);
+          addToColumnHistogram(columnFine, columnCoarse, j, enteringRow[j], 1);
+        }
+      }
+      outputRow = job->outputArr + i*job->outputWidth + left;
+      memset(windowCoarse, 0, sizeof(windowCoarse));
+      for (j = 0; j < kernelSize; j++)
+        addHistogram(windowCoarse, columnCoarse + j*HISTOGRAM_COARSE_BINS, HISTOGRAM_COARSE_BINS);
+      // no fine bin is valid at the start of a row
+      for (bin = 0; bin < HISTOGRAM_COARSE_BINS; bin++)
+        finePosition[bin] = -kernelSize;
+      for (j = 0; j < count; j++) {
+        if (j) {
+          addHistogram(windowCoarse, columnCoarse + (j+kernelSize-1)*HISTOGRAM_COARSE_BINS, HISTOGRAM_COARSE_BINS);
+          subtractHistogram(windowCoarse, columnCoarse + (j-1)*HISTOGRAM_COARSE_BINS, HISTOGRAM_COARSE_BINS);
+        }
+        outputRow[j] = findHistogramMedian(windowFine, windowCoarse, columnFine, finePosition, j, kernelSize, rank);
+      }
+    }
+  }
+  poolRelease(columnFine);
+  poolRelease(columnCoarse);
+}
+
+static inline void addToColumnHistogram(uint16_t* columnFine, uint16_t* columnCoarse, size_t column, uint8_t value, int change) {
+  columnFine[column*HISTOGRAM_BINS + value] += change;
+  columnCoarse[column*HISTOGRAM_COARSE_BINS + (value >> 4)] += change;
+}
+
+static inline void addHistogram(uint16_t* histogram, uint16_t* other, int bins) {
+  int i;
+  for (i = 0; i < bins; i++)
+    histogram[i] += other[i];
+}
+
+static inline void subtractHistogram(uint16_t* histogram, uint16_t* other, int bins) {
+  int i;
+  for (i = 0; i < bins; i++)
+    histogram[i] -= other[i];
+}
+
+/*
+* Function: findHistogramMedian
+* --------------------------
+* returns the value of the given rank (0 based) in a two level window
+* histogram, bringing the fine bins of the coarse bin it falls in up to date
+*
+* fine: 256 bin histogram, valid per coarse bin as recorded in finePosition
+* coarse: 16 bin histogram, bin i counts the values [16*i, 16*i+15]
+* columnFine: 256 bin histogram of every column
+* finePosition: first window column the fine bins of every coarse bin were last valid for
+* position: first column of the current window
+* kernelSize: window size
+* rank: number of smaller or equal values that are skipped
+*/
+static inline uint8_t findHistogramMedian(uint16_t* fine, uint16_t* coarse, uint16_t* columnFine, int* finePosition, int position, int kernelSize, int rank) {
+  int bin = 0, value;
+  while (rank >= coarse[bin])
+    rank -= coarse[bin++];
+  if (finePosition[bin] != position) {
+    refreshFineBins(fine, columnFine, bin, finePosition[bin], position, kernelSize);
+    finePosition[bin] = position;
+  }
+  value = bin << 4;
+  while (rank >= fine[value])
+    rank -= fine[value++];
+  return (uint8_t) value;
+}
+
+/*
+* Function: refreshFineBins
+* --------------------------
+* moves the 16 fine bins of one coarse bin of the window histogram from the
+* window at column from to the window at column to
+*
+* fine: 256 bin window histogram
+* columnFine: 256 bin histogram of every column
+* bin: the coarse bin
+* from: first column of the window the fine bins were last valid for
+* to: first column of the current window
+* kernelSize: window size
+*/
+static inline void refreshFineBins(uint16_t* fine, uint16_t* columnFine, int bin, int from, int to, int kernelSize) {
+  int offset = bin * (HISTOGRAM_BINS / HISTOGRAM_COARSE_BINS), column;
+  uint16_t* bins = fine + offset;
+  if (to - from >= kernelSize) {
+    // the two windows share no column
+    memset(bins, 0, HISTOGRAM_BINS / HISTOGRAM_COARSE_BINS * sizeof(uint16_t));
+    for (column = to; column < to + kernelSize; column++)
+      addHistogram(bins, columnFine + column*HISTOGRAM_BINS + offset, HISTOGRAM_BINS / HISTOGRAM_COARSE_BINS);
+    return;
+  }
+  for (column = from; column < to; column++) {
+    addHistogram(bins, columnFine + (column+kernelSize)*HISTOGRAM_BINS + offset, HISTOGRAM_BINS / HISTOGRAM_COARSE_BINS);
+    subtractHistogram(bins, columnFine + column*HISTOGRAM_BINS + offset, HISTOGRAM_BINS / HISTOGRAM_COARSE_BINS);
+  }
+}
+
+uint8_t getMedianForPix(uint8_t* arr, int kernelSize, uint8_t* pixelValues, int width, size_t xLoc, size_t yLoc) {
+  size_t i, j;
+  int kernelPadding, row;
+  kernelPadding = kernelSize >> 1;
+  for (i = 0; i < kernelSize; i++) {
+    row = xLoc+i-kernelPadding;
+    for (j = 0; j < kernelSize; j++){
+      arr[i*kernelSize+j] = pixelValues[(yLoc+j-kernelPadding)+row*width];
+    }
+  }
+  return findMedian(arr, kernelSize*kernelSize);
+}
+
+/*
+* Function: filterMinMax
+* --------------------------
+* normalizes arrValues values between [0-255]
+*
+* arrValues: a pointer the array that should be normalized
+* width: array width
+* height: array height
+* output: width*height buffer for the result, NULL to take one from the pool
+*
+* returns: a pointer to the array with normalized values, NULL on failure
+*/
+uint8_t* filterMinMax(int* arrValues, int width, int height, uint8_t* output) {
+  size_t i;
+  int srcMin, srcMax;
+  long long srcScale;
+  uint64_t multiplier;
+  srcMax = srcMin = arrValues[0];
+  uint8_t* outputPixValues = output ? output : (uint8_t*) poolAlloc((size_t) width * height * sizeof(uint8_t));
+  if (!outputPixValues)
+    return NULL;
+  for (i = 1; i < height*width; i++) {
+    if (arrValues[i] < srcMin)
+      srcMin = arrValues[i];
+    if (arrValues[i] > srcMax)
+      srcMax = arrValues[i];
+  }
+  if (srcMax == srcMin) {
+    memset(outputPixValues, 0, width*height);
+    return outputPixValues;
+  }
+  srcScale = (long long) srcMax - srcMin;
+  multiplier = getScaleMultiplier(srcScale);
+  for (i = 0; i < height*width; i++)
+    outputPixValues[i] = scaleToPixel((long long) arrValues[i] - srcMin, srcScale, multiplier);
+  return outputPixValues;
+}
+
+/*
+* Function: getScaleMultiplier
+* --------------------------
+* precomputes the multiply-shift used by scaleToPixel. For ranges below 2^16
+* ceil(255 * 2^32 / srcScale) makes (src * multiplier) >> 32 equal to
+* floor(src * 255 / srcScale) for every src in [0, srcScale]
+*
+* srcScale: difference between the largest and the smallest value
+*
+* returns: the multiplier, 0 if the range needs a division
+*/
+uint64_t getScaleMultiplier(long long srcScale) {
+  if (srcScale >= (1 << 16))
+    return 0;
+  return ((uint64_t) MAX_PIXEL_VAL << 32) / srcScale + 1;
+}
+
+/*
+* Function: scaleToPixel
+* --------------------------
+* maps src from [0, srcScale] to [0, 255] rounding down
+*
+* src: value minus the smallest value
+* srcScale: difference between the largest and the smallest value
+* multiplier: result of getScaleMultiplier(srcScale)
+*
+* returns: the scaled pixel value
+*/
+static inline uint8_t scaleToPixel(long long src, long long srcScale, uint64_t multiplier) {
+  if (multiplier)
+    return (uint8_t)(((uint64_t) src * multiplier) >> 32);
+  return (uint8_t)(src * MAX_PIXEL_VAL / srcScale);
+}
+
+/*
+* Function: initRowSink
+* --------------------------
+* initializes a row sink, the intermediate rows are allocated by
+* prepareRowSink once the filter knows its range
+*
+* sink: the sink to initialize
+* normalizationType: NORMALIZE_SLICE, NORMALIZE_MINMAX or NORMALIZE_NONE
+* width: output width
+* height: output height
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool initRowSink(row_sink* sink, int normalizationType, int width, int height) {
+  return initFramedRowSink(sink, normalizationType, width, height, 0, NULL, NULL);
+}
+
+/*
+* Function: initFramedRowSink
+* --------------------------
+* initializes a row sink whose pixels are surrounded by a border, filled
+* by finishRowSink, so the filtered area doesn't have to be copied into a
+* padded image afterwards
+*
+* sink: the sink to initialize
+* normalizationType: NORMALIZE_SLICE, NORMALIZE_MINMAX or NORMALIZE_NONE
+* width: output width without the border
+* height: output height without the border
+* padding: border size on each side
+* frame: how the border is filled, may be NULL without border
+* output: (width+padding*2)*(height+padding*2) buffer for the result, NULL
+* to take one from the pool
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool initFramedRowSink(row_sink* sink, int normalizationType, int width, int height, int padding, padding_mode* frame, uint8_t* output) {
+  memset(sink, 0, sizeof(row_sink));
+  sink->normalizationType = normalizationType;
+  sink->width = width;
+  sink->height = height;
+  sink->framePadding = padding;
+  sink->output = output;
+  if (frame)
+    sink->frame = *frame;
+  if (normalizationType == NORMALIZE_SLICE) {
+    sink->pixels = output ? output : (uint8_t*) poolAlloc((size_t)(width + padding*2) * (height + padding*2) * sizeof(uint8_t));
+    if (!sink->pixels)
+      return false;
+  } else if (normalizationType == NORMALIZE_MINMAX) {
+    sink->rowMin = (int*) poolAlloc(height * sizeof(int));
+    sink->rowMax = (int*) poolAlloc(height * sizeof(int));
+    if (!sink->rowMin || !sink->rowMax) {
+      freeRowSink(sink);
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+* returns the first pixel of output row row inside the frame of a sink
+*/
+static inline uint8_t* getSinkPixelRow(row_sink* sink, int row) {
+  int padding = sink->framePadding;
+  return sink->pixels + ((size_t) row + padding) * (sink->width + padding*2) + padding;
+}
+
+/*
+* Function: prepareRowSink
+* --------------------------
+* allocates the intermediate rows of a sink, min-max rows are stored as
+* int16 when every value the filter can produce fits in it
+*
+* sink: an initialized sink
+* minBound: smallest value the filter can produce
+* maxBound: largest value the filter can produce
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool prepareRowSink(row_sink* sink, long long minBound, long long maxBound) {
+  size_t size = (size_t) sink->width * sink->height;
+  if (sink->normalizationType == NORMALIZE_SLICE || sink->values || sink->narrowValues)
+    return true;
+  if (sink->normalizationType == NORMALIZE_MINMAX && minBound >= INT16_MIN && maxBound <= INT16_MAX) {
+    sink->narrowValues = (int16_t*) poolAlloc(size * sizeof(int16_t));
+    return sink->narrowValues != NULL;
   }
-  return result;
+  sink->values = (int*) poolAlloc(size * sizeof(int));
+  return sink->values != NULL;
 }
 
-int applyMedianPgm(char* inputFileName, char* outputFileName) {
-  uint8_t *arr, *pixelValues;
-  int width, height, padding, kernelSize = 3;
-  arr = rBinaryPgm(inputFileName, &width, &height);
-  if (!arr) {
-    setColor(YELLOW);
-    printf("Trying ASCII pgm format...\n");
-    setColor(RESET);
-    arr = rAsciiPgm(inputFileName, &width, &height);
+/*
+* Function: getSinkRow
+* --------------------------
+* returns where a filter should write output row row, the final int row
+* if the sink keeps them and scratch otherwise
+*
+* sink: a prepared sink
+* row: output row index
+* scratch: a band owned array of sink->width values
+*
+* returns: pointer to sink->width writable values
+*/
+int* getSinkRow(row_sink* sink, int row, int* scratch) {
+  if (sink->values)
+    return sink->values + (size_t) row * sink->width;
+  return scratch;
+}
+
+/*
+* Function: putSinkRow
+* --------------------------
+* hands a finished output row to the sink: slicing stores it as pixels,
+* min-max updates the row extremes and narrows it if needed. Rows may be
+* put from several threads as long as each row is put once
+*
+* sink: a prepared sink
+* row: output row index
+* values: the row returned by getSinkRow
+*/
+void putSinkRow(row_sink* sink, int row, int* values) {
+  size_t j;
+  int rowMin, rowMax;
+  uint8_t* pixelRow;
+  int16_t* narrowRow;
+  if (sink->normalizationType == NORMALIZE_SLICE) {
+    pixelRow = getSinkPixelRow(sink, row);
+    for (j = 0; j < sink->width; j++)
+      pixelRow[j] = (uint8_t)(values[j] < 0 ? 0 : (values[j] > MAX_PIXEL_VAL ? MAX_PIXEL_VAL : values[j]));
+    return;
+  }
+  if (sink->normalizationType != NORMALIZE_MINMAX || !sink->width)
+    return;
+  rowMin = rowMax = values[0];
+  for (j = 1; j < sink->width; j++) {
+    if (values[j] < rowMin)
+      rowMin = values[j];
+    if (values[j] > rowMax)
+      rowMax = values[j];
+  }
+  sink->rowMin[row] = rowMin;
+  sink->rowMax[row] = rowMax;
+  if (sink->narrowValues) {
+    narrowRow = sink->narrowValues + (size_t) row * sink->width;
+    for (j = 0; j < sink->width; j++)
+      narrowRow[j] = (int16_t) values[j];
   }
-  if (!arr)
-    return 1;
-  pixelValues = applyMedian(arr, width, height, true);
-  free(arr);
-  padding = (kernelSize>>1);
-  pixelValues = addStaticPad(pixelValues, 0, width-padding*2, height-padding*2, kernelSize);
-  writeArrToPgm(pixelValues, width, height, outputFileName, 2);
-  free(pixelValues);
-  return 0;
 }
 
 /*
-* Function: applyMedian
+* Function: finishRowSink
 * --------------------------
-* returns a pointer to an array with median filter applied
+* completes the normalization once every row has been put and releases the
+* intermediate rows. Min-max scaling runs over the same row bands as the
+* filters, using the integer multiply-shift of scaleToPixel
 *
-* pixelValues: pointer to the array representing image that will be processed
-* width: image width without padding
-* height: image height without padding
-* postPadding: a bool value indicating whether the padding will be applied
-* before (false) or after (true) kernel
+* sink: a sink holding all of its rows
 *
-* returns: a pointer to the newly allocated array after processing
+* returns: the normalized pixels with their frame (owned by the caller),
+* NULL on failure or for NORMALIZE_NONE, whose values stay in sink->values
 */
-uint8_t* applyMedian(uint8_t* pixelValues, int width, int height, bool postPadding) {
-  int kernelSize = 3, padding;
-  uint8_t *pixelValuesCopy, *filteredValues;
-  if (!doesKernelFit(kernelSize, width, height) && !postPadding) {
-    setColor(RED);
-    printf("Kernel too be big to be applied without pre-padding\n");
-    setColor(RESET);
+uint8_t* finishRowSink(row_sink* sink) {
+  uint8_t* pixels;
+  int srcMax, padding = sink->framePadding;
+  size_t i, size = (size_t)(sink->width + padding*2) * (sink->height + padding*2);
+  if (sink->normalizationType == NORMALIZE_NONE)
     return NULL;
+  beginStage(PROFILE_NORMALIZE);
+  if (sink->normalizationType == NORMALIZE_MINMAX) {
+    sink->pixels = sink->output ? sink->output : (uint8_t*) poolAlloc(size * sizeof(uint8_t));
+    if (sink->pixels && sink->fixedRange) {
+      scaleSinkRange(sink, sink->height);
+    } else if (sink->pixels && sink->width && sink->height) {
+      sink->srcMin = sink->rowMin[0];
+      srcMax = sink->rowMax[0];
+      for (i = 1; i < sink->height; i++) {
+        if (sink->rowMin[i] < sink->srcMin)
+          sink->srcMin = sink->rowMin[i];
+        if (sink->rowMax[i] > srcMax)
+          srcMax = sink->rowMax[i];
+      }
+      sink->srcScale = (long long) srcMax - sink->srcMin;
+      scaleSinkRange(sink, sink->height);
+    }
   }
-  pixelValuesCopy = (uint8_t*) malloc(width * height * sizeof(uint8_t));
-  memcpy(pixelValuesCopy, pixelValues, width*height * sizeof(uint8_t));
-  if (!postPadding) {
-    pixelValuesCopy = addStaticPad(pixelValuesCopy, 0, width, height, kernelSize);
-    padding = (kernelSize>>1);
-  } else {
-    padding = 0;
-  }
-  filteredValues = applyMedianArr(kernelSize, pixelValuesCopy, width+padding*2, height+padding*2);
-  free(pixelValuesCopy);
-  return filteredValues;
+  pixels = sink->pixels;
+  sink->pixels = NULL;
+  if (pixels && padding)
+    fillPadding(pixels, sink->width + padding*2, sink->height + padding*2, padding, &(sink->frame));
+  freeRowSink(sink);
+  endStage(pixels ? size : 0);
+  return pixels;
 }
 
-uint8_t* applyMedianArr(int kernelSize, uint8_t* pixelValues, int width, int height) {
-  uint8_t* outputArr;
-  int padding, areaWidth, areaHeight;
-  size_t i, j;
-  uint8_t* arr = (uint8_t*) malloc(kernelSize*kernelSize*sizeof(uint8_t));
-  padding = kernelSize >> 1;
-  areaWidth = width - padding*2;
-  areaHeight = height - padding*2;
-  outputArr = (uint8_t*) malloc(areaWidth * areaHeight * sizeof(int));
-  for (i = 0; i < areaHeight; i++) {
-    for (j = 0; j < areaWidth; j++)
-      outputArr[i*areaWidth+j] = getMedianForPix(arr, kernelSize, pixelValues, width, i+padding, j+padding);
+/*
+* Function: scaleSinkRange
+* --------------------------
+* scales the first rowCount min-max rows of a sink from its range into its
+* pixels, a range of a single value gives zeros
+*
+* sink: a sink holding the rows, with srcMin and srcScale set
+* rowCount: number of rows to scale
+*/
+void scaleSinkRange(row_sink* sink, int rowCount) {
+  int i;
+  if (sink->srcScale) {
+    sink->multiplier = getScaleMultiplier(sink->srcScale);
+    runRowBands(rowCount, scaleSinkRows, sink);
+    return;
   }
-  free(arr);
-  return outputArr;
+  for (i = 0; i < rowCount; i++)
+    memset(getSinkPixelRow(sink, i), 0, sink->width);
 }
 
-uint8_t getMedianForPix(uint8_t* arr, int kernelSize, uint8_t* pixelValues, int width, size_t xLoc, size_t yLoc) {
+void scaleSinkRows(void* context, int firstRow, int lastRow) {
+  row_sink* sink = (row_sink*) context;
   size_t i, j;
-  int kernelPadding, row;
-  kernelPadding = kernelSize >> 1;
-  for (i = 0; i < kernelSize; i++) {
-    row = xLoc+i-kernelPadding;
-    for (j = 0; j < kernelSize; j++){
-      arr[i*kernelSize+j] = pixelValues[(yLoc+j-kernelPadding)+row*width];
+  uint8_t* pixelRow;
+  int16_t* narrowRow;
+  int* wideRow;
+  for (i = firstRow; i < lastRow; i++) {
+    pixelRow = getSinkPixelRow(sink, i);
+    if (sink->narrowValues) {
+      narrowRow = sink->narrowValues + i*sink->width;
+      for (j = 0; j < sink->width; j++)
+        pixelRow[j] = scaleToPixel(narrowRow[j] - sink->srcMin, sink->srcScale, sink->multiplier);
+    } else {
+      wideRow = sink->values + i*sink->width;
+      for (j = 0; j < sink->width; j++)
+        pixelRow[j] = scaleToPixel((long long) wideRow[j] - sink->srcMin, sink->srcScale, sink->multiplier);
     }
   }
-  return findMedian(arr, kernelSize*kernelSize);
 }
 
 /*
-* Function: filterSlice
+* Function: setSinkRange
 * --------------------------
-* sets all values grater than 255 to 255 and all values less than 0 to 0
+* makes a min-max sink scale its rows from [srcMin, srcMax] instead of the
+* extremes of its own rows, used when an image is normalized in parts
 *
-* arrValues: a pointer the array that should be filtered
-* width: array width
-* height: array height
+* sink: an initialized NORMALIZE_MINMAX sink
+* srcMin: value mapped to 0
+* srcMax: value mapped to 255
+*/
+void setSinkRange(row_sink* sink, int srcMin, int srcMax) {
+  sink->fixedRange = true;
+  sink->srcMin = srcMin;
+  sink->srcScale = (long long) srcMax - srcMin;
+}
+
+/*
+* Function: freeRowSink
+* --------------------------
+* releases everything a sink still owns
 *
-* returns: a pointer to the allocated array with filtered values
+* sink: the sink to release
 */
-uint8_t* filterSlice(int* arrValues, int width, int height) {
-  size_t i;
-  uint8_t* outputPixValues = (uint8_t*) malloc(width * height * sizeof(uint8_t));
-  for (i = 0; i < height*width; i++) {
-    outputPixValues[i] = (uint8_t)(arrValues[i] < 0 ? 0 : (arrValues[i] > MAX_PIXEL_VAL ? MAX_PIXEL_VAL : arrValues[i]));
+void freeRowSink(row_sink* sink) {
+  poolRelease(sink->values);
+  poolRelease(sink->narrowValues);
+  if (sink->pixels != sink->output)
+    poolRelease(sink->pixels);
+  poolRelease(sink->rowMin);
+  poolRelease(sink->rowMax);
+  sink->values = NULL;
+  sink->narrowValues = NULL;
+  sink->pixels = NULL;
+  sink->rowMin = NULL;
+  sink->rowMax = NULL;
+}
+
+/*
+* Function: fillPadding
+* --------------------------
+* fills the border around the filtered area of arr in place
+*
+* arr: pixel values array, the area starts padding pixels from each side
+* width: width with padding
+* height: height with padding
+* padding: border size on each side
+* mode: how the border is filled from the area
+*/
+void fillPadding(uint8_t* arr, int width, int height, int padding, padding_mode* mode) {
+  int areaWidth = width - padding*2, areaHeight = height - padding*2, i, j, source;
+  uint8_t *row, value = getPaddingValue(mode);
+  beginStage(PROFILE_PAD);
+  if (areaWidth <= 0 || areaHeight <= 0) {
+    memset(arr, value, (size_t) width * height);
+    endStage((size_t) width * height);
+    return;
   }
-  return outputPixValues;
+  // left and right of every area row, then whole rows above and below
+  for (i = padding; i < height - padding; i++) {
+    row = arr + (size_t) i*width + padding;
+    for (j = 1; j <= padding; j++) {
+      source = borderIndex(-j, areaWidth, mode->type);
+      row[-j] = source < 0 ? value : row[source];
+      source = borderIndex(areaWidth - 1 + j, areaWidth, mode->type);
+      row[areaWidth - 1 + j] = source < 0 ? value : row[source];
+    }
+  }
+  for (i = 0; i < padding; i++) {
+    row = arr + (size_t) i*width;
+    source = borderIndex(i - padding, areaHeight, mode->type);
+    if (source < 0)
+      memset(row, value, width);
+    else
+      memcpy(row, arr + (size_t)(source + padding)*width, width);
+    row = arr + (size_t)(height - padding + i)*width;
+    source = borderIndex(areaHeight + i, areaHeight, mode->type);
+    if (source < 0)
+      memset(row, value, width);
+    else
+      memcpy(row, arr + (size_t)(source + padding)*width, width);
+  }
+  endStage((size_t) width * height - (size_t) areaWidth * areaHeight);
 }
 
 /*
-* Function: filterMinMax
+* Function: borderIndex
 * --------------------------
-* normalizes arrValues values between [0-255]
+* maps a row or column index outside of [0, length) back into the image
 *
-* arrValues: a pointer the array that should be normalized
-* width: array width
-* height: array height
+* index: the index
+* length: image width or height
+* type: padding type
 *
-* returns: a pointer to the allocated array with normalized values
+* returns: the index to read, -1 if the padding is a constant value
 */
-uint8_t* filterMinMax(int* arrValues, int width, int height) {
-  size_t i;
-  int targetMin = 0, targetMax = 255, srcMin, srcMax, srcScale, targetScale, src, scaled;
-  float scaleRatio;
-  srcMax = srcMin = arrValues[0];
-  uint8_t* outputPixValues = (uint8_t*) malloc(width * height * sizeof(uint8_t));
-  for (i = 1; i < height*width; i++) {
-    if (arrValues[i] < srcMin)
-      srcMin = arrValues[i];
-    if (arrValues[i] > srcMax)
-      srcMax = arrValues[i];
+static inline int borderIndex(int index, int length, int type) {
+  int period;
+  if (index >= 0 && index < length)
+    return index;
+  if (type == PADDING_REPLICATE)
+    return index < 0 ? 0 : length - 1;
+  if (type == PADDING_WRAP) {
+    index %= length;
+    return index < 0 ? index + length : index;
   }
-  if (srcMax == srcMin) {
-    memset(outputPixValues, 0, width*height);
-    return outputPixValues;
+  if (type == PADDING_MIRROR) {
+    period = length*2;
+    index %= period;
+    if (index < 0)
+      index += period;
+    return index < length ? index : period - 1 - index;
   }
-  srcScale = srcMax - srcMin;
-  targetScale = targetMax - targetMin;
-  scaleRatio = (float)(targetScale) / (float)(srcScale);
-  for (i = 0; i < height*width; i++) {
-    src = arrValues[i] - srcMin;
-    scaled = src * scaleRatio;
-    outputPixValues[i] = (uint8_t)(scaled + targetMin);
+  return -1;
+}
+
+static inline uint8_t getPaddingValue(padding_mode* mode) {
+  return mode->type == PADDING_CONSTANT ? mode->value : 0;
+}
+
+/*
+* returns the pixel at (row, column), reading through mode outside of the image
+*/
+static inline uint8_t getPaddedPixel(uint8_t* pixelValues, int width, int height, int row, int column, padding_mode* mode) {
+  row = borderIndex(row, height, mode->type);
+  column = borderIndex(column, width, mode->type);
+  if (row < 0 || column < 0)
+    return getPaddingValue(mode);
+  return pixelValues[(size_t) row*width + column];
+}
+
+bool writeArrToPgm(uint8_t* pixelValues, int width, int height, char* outputName, int version) {
+  pgm_writer writer;
+  bool written;
+  // opening and flushing the file count as writing, the rows are nested
+  beginStage(PROFILE_WRITE);
+  written = openPgmWriter(&writer, outputName, width, height, version);
+  if (written) {
+    writePgmRows(&writer, pixelValues, height);
+    written = closePgmWriter(&writer, outputName);
   }
-  return outputPixValues;
+  endStage(0);
+  return written;
 }
 
 /*
-* Function: setPaddingMirror
+* Function: openPgmWriter
 * --------------------------
-* modifies arr by setting the values of the added padding pixels
-* to the nearest neighbor values
+* creates a PGM file and writes its header
 *
-* arr: pixel values array with padding allocated
-* width: image width without padding
-* height: image height without padding
-* kernelSize: the length of kernel dimension
+* writer: the writer to open
+* outputName: path of the file
+* width: image width
+* height: image height
+* version: 2 for ASCII, 5 for binary
 *
 * returns: a bool value indicating failure as false and success as true
 */
-void setPaddingMirror(uint8_t* arr, int width, int height, int kernelSize) {
-  size_t i, j, leftPixLoc, rightPixLoc;
-  int padding = kernelSize >> 1;
-  int widthNoPad = width - padding*2, heightNoPad = height - padding*2;
-  // set padded rows before image
-  leftPixLoc = (width)*padding+padding;
-  rightPixLoc = leftPixLoc + widthNoPad -1;
-  for (i = 0; i < padding; i++) {
-    memset(arr+i*(width), arr[leftPixLoc], padding);
-    memcpy(arr+i*(width)+padding, arr+padding*(width)+padding, widthNoPad * sizeof(uint8_t));
-    memset(arr+i*(width)+padding+widthNoPad, arr[rightPixLoc], padding);
-  }
-  // set padded borders (right, left)
-  for (j=0; j < heightNoPad; i++,j++) {
-    leftPixLoc = i*width+padding;
-    rightPixLoc = leftPixLoc + widthNoPad -1;
-    memset(arr+i*(width), arr[leftPixLoc], padding);
-    memset(arr+i*(width)+padding+widthNoPad, arr[rightPixLoc], padding);
-  }
-  // set padded rows after the image
-  leftPixLoc = (width)*(height-padding-1)+padding;
-  rightPixLoc = leftPixLoc + widthNoPad -1;
-  for (j=0; j < padding; i++,j++) {
-    memset(arr+i*(width), arr[leftPixLoc], padding);
-    memcpy(arr+i*(width)+padding, arr+(height-padding-1)*(width)+padding, widthNoPad * sizeof(uint8_t));
-    memset(arr+i*(width)+padding+widthNoPad, arr[rightPixLoc], padding);
-  }
-}
-
-bool isBinaryPgm(FILE* file) {
-  char* typeHolder = (char*) malloc(LINE_SIZE * sizeof(char));
-  fread(typeHolder, sizeof(char), MAGIC_NUMBER_SIZE, file);
-  typeHolder[MAGIC_NUMBER_SIZE] = '\0';
-  if (strcmp(typeHolder, "P5")) {
-    free(typeHolder);
+bool openPgmWriter(pgm_writer* writer, char* outputName, int width, int height, int version) {
+  size_t rowSize = (size_t) width * sizeof(pixelText[0]);
+  if (!(writer->file = fopen(outputName, "wb"))) {
+    setColor(RED);
+    printf("Cannot create %s\n", outputName);
+    setColor(RESET);
     return false;
   }
-  free(typeHolder);
+  writer->version = version;
+  writer->width = width;
+  writer->text = NULL;
+  writer->rowLengths = NULL;
+  writer->failed = false;
+  if (version == 2) {
+    // a block holds at least one band of rows for every thread
+    writer->blockRows = ASCII_BLOCK_SIZE / (rowSize ? rowSize : 1);
+    if (writer->blockRows < MIN_BAND_ROWS * getThreadCount())
+      writer->blockRows = MIN_BAND_ROWS * getThreadCount();
+    if (writer->blockRows > height)
+      writer->blockRows = height;
+    writer->text = (char*) poolAlloc(rowSize * writer->blockRows);
+    writer->rowLengths = (size_t*) poolAlloc(writer->blockRows * sizeof(size_t));
+    writer->failed = !writer->text || !writer->rowLengths;
+  }
+  fprintf(writer->file, "P%d\n",version);
+  fprintf(writer->file, "# processed by %s\n", BRAND_NAME);
+  fprintf(writer->file, "%d %d\n", width, height);
+  fprintf(writer->file, "255\n");
   return true;
 }
 
-bool isAsciiPgm(FILE* file) {
-  char* typeHolder = (char*) malloc(LINE_SIZE * sizeof(char));
-  fread(typeHolder, sizeof(char), MAGIC_NUMBER_SIZE, file);
-  typeHolder[MAGIC_NUMBER_SIZE] = '\0';
-  if (strcmp(typeHolder, "P2")) {
-    free(typeHolder);
+/*
+* Function: writePgmRows
+* --------------------------
+* appends rows to a PGM file. ASCII pixels are written one per line, blocks
+* of rows are formatted from pixelText on the threads of the current
+* context, each row into its own slot, and the slots are then written in order
+*
+* writer: an open writer
+* rows: rowCount*width pixels
+* rowCount: number of rows to write
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool writePgmRows(pgm_writer* writer, uint8_t* rows, int rowCount) {
+  ascii_job job;
+  size_t rowSize = (size_t) writer->width * sizeof(pixelText[0]), written = 0;
+  int i, lastRow;
+  if (writer->failed)
     return false;
+  beginStage(PROFILE_WRITE);
+  if (writer->version != 2) {
+    writer->failed = fwrite(rows, sizeof(uint8_t), (size_t) writer->width * rowCount, writer->file) != (size_t) writer->width * rowCount;
+    endStage((size_t) writer->width * rowCount);
+    return !writer->failed;
   }
-  free(typeHolder);
-  return true;
+  job.pixelValues = rows;
+  job.width = writer->width;
+  job.text = writer->text;
+  job.rowLengths = writer->rowLengths;
+  for (job.firstRow = 0; job.firstRow < rowCount && !writer->failed; job.firstRow += writer->blockRows) {
+    lastRow = job.firstRow + writer->blockRows < rowCount ? job.firstRow + writer->blockRows : rowCount;
+    runRowBands(lastRow - job.firstRow, encodeAsciiRows, &job);
+    for (i = 0; i < lastRow - job.firstRow && !writer->failed; i++) {
+      writer->failed = fwrite(job.text + i*rowSize, 1, job.rowLengths[i], writer->file) != job.rowLengths[i];
+      written += job.rowLengths[i];
+    }
+  }
+  endStage(written);
+  return !writer->failed;
 }
 
-bool writeArrToPgm(uint8_t* pixelValues, int width, int height, char* outputName, int version) {
-  FILE* picture;
-  size_t (*writepixPtr)(const void*, size_t, size_t, FILE*) = fwrite;
-  if (!(picture = fopen(outputName, "wb"))) {
+/*
+* Function: closePgmWriter
+* --------------------------
+* closes a PGM file and reports the result
+*
+* writer: an open writer
+* outputName: path of the file, NULL to close silently
+*
+* returns: false if any write failed
+*/
+bool closePgmWriter(pgm_writer* writer, char* outputName) {
+  bool written = !fclose(writer->file) && !writer->failed;
+  poolRelease(writer->text);
+  poolRelease(writer->rowLengths);
+  if (!outputName)
+    return written;
+  if (!written) {
     setColor(RED);
-    printf("Cannot create %s\n", outputName);
+    printf("Failed to write %s\n", outputName);
     setColor(RESET);
     return false;
   }
-  fprintf(picture, "P%d\n",version);
-  if (version == 2) {
-    writepixPtr = fwritePixels;
-  }
-  fprintf(picture, "# processed by %s\n", BRAND_NAME);
-  fprintf(picture, "%d %d\n", width, height);
-  fprintf(picture, "255\n");
-  writepixPtr(pixelValues, sizeof(uint8_t), width * height, picture);
-  fclose(picture);
   setColor(GREEN);
   printf("Wrote to output %s Successfully\n", outputName);
   setColor(RESET);
   return true;
 }
 
-size_t fwritePixels(const void *ptr, size_t size, size_t nmemb, FILE *picture) {
-  size_t i;
-  for (i = 0; i < nmemb; i++) {
-    fprintf(picture, "%u\n", ((unsigned char*)ptr)[i]);
+void encodeAsciiRows(void* context, int firstRow, int lastRow) {
+  ascii_job* job = (ascii_job*) context;
+  size_t i, j, rowSize = (size_t) job->width * sizeof(pixelText[0]);
+  uint8_t* pixelRow;
+  char *text;
+  for (i = firstRow; i < lastRow; i++) {
+    pixelRow = job->pixelValues + (job->firstRow + i) * job->width;
+    text = job->text + i*rowSize;
+    // every entry is copied whole, the next one overwrites its unused bytes
+    for (j = 0; j < job->width; j++) {
+      memcpy(text, pixelText[pixelRow[j]], sizeof(pixelText[0]));
+      text += pixelRow[j] < 10 ? 2 : (pixelRow[j] < 100 ? 3 : 4);
+    }
+    job->rowLengths[i] = text - (job->text + i*rowSize);
   }
-  return i;
+}
+
+/*
+* Function: parseOutputVersion
+* --------------------------
+* parses an output format name
+*
+* str: "p2" or "p5"
+* version: set to the PGM version of the format
+*
+* returns: false if str is not a known format
+*/
+bool parseOutputVersion(char* str, int* version) {
+  if (!strcmp(str, "p2") || !strcmp(str, "P2"))
+    *version = 2;
+  else if (!strcmp(str, "p5") || !strcmp(str, "P5"))
+    *version = 5;
+  else
+    return false;
+  return true;
 }
 
 bool isSpace(char c) {
@@ -1033,7 +6749,7 @@ bool isIntegerStr(char* str) {
 
 void skipComments(FILE* file) {
   int c;
-  char* lineHolder = (char*) malloc(LINE_SIZE * sizeof(char));
+  char lineHolder[LINE_SIZE];
   while ((c = fgetc(file)) && isSpace(c));
   if (c == '#') {
     fgets(lineHolder, LINE_SIZE, file);
@@ -1041,7 +6757,6 @@ void skipComments(FILE* file) {
   } else {
     fseek(file, -1, SEEK_CUR);
   }
-  free(lineHolder);
 }
 
 void swap(uint8_t* a, uint8_t* b) {
@@ -1050,22 +6765,6 @@ void swap(uint8_t* a, uint8_t* b) {
   *b = temp;
 }
 
-/*
-* Function: staticToDynamic
-* --------------------------
-* returns a pointer to a user allocated array containing the same values of arr
-*
-* arr: pointer to the array that will be copied
-* kernelSize: the length of kernel dimension
-*
-* returns: a pointer to the allocated array with copied values
-*/
-int* staticToDynamicKernel(int arr[], int kernelSize) {
-  int* arrVal = malloc(kernelSize * kernelSize * sizeof(int));
-  memcpy(arrVal, arr, kernelSize * kernelSize * sizeof(int));
-  return arrVal;
-}
-
 /*
 * Function: doesKernelFit
 * --------------------------
@@ -1081,9 +6780,29 @@ bool doesKernelFit(int kernelSize, int width, int height) {
   return width > kernelSize && height > kernelSize;
 }
 
+/*
+* Function: checkUnpaddedFit
+* --------------------------
+* doesKernelFit for the filters, the command line build also reports a kernel
+* that doesn't fit while library calls stay silent
+*
+* returns: a bool indicating if the kernel can be applied before padding
+*/
+bool checkUnpaddedFit(int kernelSize, int width, int height) {
+  if (doesKernelFit(kernelSize, width, height))
+    return true;
+#ifndef KERNEL_LIBRARY
+  setColor(RED);
+  printf("Kernel too be big to be applied without pre-padding\n");
+  setColor(RESET);
+#endif
+  return false;
+}
+
 /* QUICK SELECT FUNCTION */
 int partition(uint8_t* arr, int l, int r) {
-    uint8_t lst = arr[r], i = l, j = l;
+    uint8_t lst = arr[r];
+    int i = l, j = l;
     while (j < r) {
         if (arr[j] < lst) {
             swap(arr + i, arr + j);
@@ -1095,17 +6814,23 @@ int partition(uint8_t* arr, int l, int r) {
     return i;
 }
 
-int randomPartition(uint8_t* arr, int l, int r) {
-    int n = r - l + 1;
-    int pivot = rand() % n;
-    swap(&arr[l + pivot], &arr[r]);
+// the median of the first, middle and last value is the pivot, rand() would share state between threads
+int pivotPartition(uint8_t* arr, int l, int r) {
+    int m = l + (r - l) / 2;
+    if (arr[m] < arr[l])
+        swap(arr + m, arr + l);
+    if (arr[r] < arr[l])
+        swap(arr + r, arr + l);
+    if (arr[r] < arr[m])
+        swap(arr + r, arr + m);
+    swap(arr + m, arr + r);
     return partition(arr, l, r);
 }
 
 // Utility function to find median
 void medianUtil(uint8_t* arr, int l, int r, int k, int *a, int *b) {
     if (l <= r) {
-        int partitionIndex = randomPartition(arr, l, r);
+        int partitionIndex = pivotPartition(arr, l, r);
         if (partitionIndex == k) {
             *b = (int) arr[partitionIndex];
             if (*a != -1)
@@ -1159,8 +6884,302 @@ void setColor(int color) {
       SetConsoleTextAttribute(hConsole, FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED);
   }
 }
+
+bool listPgmFiles(char* input, file_list* files) {
+  WIN32_FIND_DATAA entry;
+  HANDLE search;
+  DWORD attributes = GetFileAttributesA(input);
+  char pattern[INPUT_SIZE], path[INPUT_SIZE], *dirEnd;
+  if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY))
+    snprintf(pattern, INPUT_SIZE, "%s\\*.pgm", input);
+  else
+    snprintf(pattern, INPUT_SIZE, "%s", input);
+  // FindFirstFile returns bare names, keep the directory part of the pattern
+  strcpy(path, pattern);
+  dirEnd = path + strlen(path);
+  while (dirEnd > path && *(dirEnd-1) != '\\' && *(dirEnd-1) != '/')
+    dirEnd--;
+  if ((search = FindFirstFileA(pattern, &entry)) == INVALID_HANDLE_VALUE)
+    return true;
+  do {
+    if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      continue;
+    snprintf(dirEnd, INPUT_SIZE - (dirEnd - path), "%s", entry.cFileName);
+    if (!addFileName(files, path)) {
+      FindClose(search);
+      return false;
+    }
+  } while (FindNextFileA(search, &entry));
+  FindClose(search);
+  return true;
+}
+
+bool mapFile(char* fileName, pgm_map* image) {
+  HANDLE file, mapping;
+  LARGE_INTEGER size;
+  file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  if (!GetFileSizeEx(file, &size) || (unsigned long long) size.QuadPart > SIZE_MAX) {
+    CloseHandle(file);
+    return false;
+  }
+  image->length = (size_t) size.QuadPart;
+  image->mapped = true;
+  if (!image->length) {
+    image->data = NULL;
+    CloseHandle(file);
+    return true;
+  }
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if (!mapping)
+    return false;
+  // the view keeps the mapping alive
+  image->data = (uint8_t*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  return image->data != NULL;
+}
+
+void* allocAligned(size_t size) {
+  return _aligned_malloc(size, POOL_ALIGNMENT);
+}
+
+void freeAligned(void* buffer) {
+  _aligned_free(buffer);
+}
+
+double getSeconds() {
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double) counter.QuadPart / frequency.QuadPart;
+}
+
+size_t getPeakMemory() {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize;
+}
+
+void unmapFile(pgm_map* image) {
+  if (image->data)
+    UnmapViewOfFile(image->data);
+  image->data = NULL;
+}
+
+size_t releaseFileRange(pgm_map* image, size_t start, size_t end) {
+  // views can't drop part of their pages, the system trims them under pressure
+  return start;
+}
+
+typedef struct {
+  void* (*function)(void*);
+  void* arg;
+} thread_start;
+
+static DWORD WINAPI threadTrampoline(LPVOID param) {
+  thread_start start = *(thread_start*) param;
+  free(param);
+  start.function(start.arg);
+  return 0;
+}
+
+bool startThread(worker_thread* thread, void* (*function)(void*), void* arg) {
+  thread_start* start = (thread_start*) malloc(sizeof(thread_start));
+  if (!start)
+    return false;
+  start->function = function;
+  start->arg = arg;
+  if (!(*thread = CreateThread(NULL, 0, threadTrampoline, start, 0, NULL))) {
+    free(start);
+    return false;
+  }
+  return true;
+}
+
+void joinThread(worker_thread thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+void initMutex(worker_mutex* mutex) {
+  InitializeSRWLock(mutex);
+}
+
+void lockMutex(worker_mutex* mutex) {
+  AcquireSRWLockExclusive(mutex);
+}
+
+void unlockMutex(worker_mutex* mutex) {
+  ReleaseSRWLockExclusive(mutex);
+}
+
+void destroyMutex(worker_mutex* mutex) {
+  // slim locks hold no resources
+  (void) mutex;
+}
 #else
 void setColor(int color) {
   printf("\x1b[%dm", color);
 }
+
+/*
+* Function: listPgmFiles
+* --------------------------
+* appends the PGM files matched by input to files
+*
+* input: a directory (every *.pgm file in it) or a glob pattern
+* files: the list the matched file names are added to
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool listPgmFiles(char* input, file_list* files) {
+  struct stat inputStat;
+  struct dirent* entry;
+  DIR* directory;
+  glob_t matches;
+  size_t i;
+  char path[INPUT_SIZE];
+  if (!stat(input, &inputStat) && S_ISDIR(inputStat.st_mode)) {
+    if (!(directory = opendir(input)))
+      return false;
+    while ((entry = readdir(directory))) {
+      snprintf(path, INPUT_SIZE, "%s%c%s", input, PATH_SEP, entry->d_name);
+      if (hasPgmExtension(entry->d_name) && !stat(path, &inputStat) && S_ISREG(inputStat.st_mode)
+          && !addFileName(files, path)) {
+        closedir(directory);
+        return false;
+      }
+    }
+    closedir(directory);
+    return true;
+  }
+  if (glob(input, 0, NULL, &matches))
+    return true;
+  for (i = 0; i < matches.gl_pathc; i++) {
+    if (!addFileName(files, matches.gl_pathv[i])) {
+      globfree(&matches);
+      return false;
+    }
+  }
+  globfree(&matches);
+  return true;
+}
+
+/*
+* Function: mapFile
+* --------------------------
+* maps a whole file read-only, large files are marked for sequential
+* access so the kernel reads ahead and drops pages behind the filters
+*
+* fileName: path of the file
+* image: set to the mapping
+*
+* returns: a bool value indicating failure as false and success as true
+*/
+bool mapFile(char* fileName, pgm_map* image) {
+  struct stat fileStat;
+  int file = open(fileName, O_RDONLY);
+  void* data;
+  if (file < 0)
+    return false;
+  if (fstat(file, &fileStat) || !S_ISREG(fileStat.st_mode)) {
+    close(file);
+    return false;
+  }
+  image->length = (size_t) fileStat.st_size;
+  image->mapped = true;
+  image->data = NULL;
+  if (!image->length) {
+    close(file);
+    return true;
+  }
+  data = mmap(NULL, image->length, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (data == MAP_FAILED)
+    return false;
+  if (image->length >= SEQUENTIAL_HINT_MIN_SIZE)
+    madvise(data, image->length, MADV_SEQUENTIAL);
+  image->data = (uint8_t*) data;
+  return true;
+}
+
+void* allocAligned(size_t size) {
+  void* buffer;
+  return posix_memalign(&buffer, POOL_ALIGNMENT, size) ? NULL : buffer;
+}
+
+void freeAligned(void* buffer) {
+  free(buffer);
+}
+
+double getSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+size_t getPeakMemory() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  // kilobytes on Linux and the BSDs
+  return (size_t) usage.ru_maxrss * 1024;
+#endif
+}
+
+void unmapFile(pgm_map* image) {
+  if (image->data)
+    munmap(image->data, image->length);
+  image->data = NULL;
+}
+
+/*
+* Function: releaseFileRange
+* --------------------------
+* drops the resident pages of a range of a mapping, they are read from the
+* file again if touched later
+*
+* image: a mapping
+* start: page aligned offset of the range
+* end: offset after the range, the page it falls in is kept
+*
+* returns: the offset up to which the pages were released
+*/
+size_t releaseFileRange(pgm_map* image, size_t start, size_t end) {
+  size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+  end -= end % pageSize;
+  if (image->data && end > start && !madvise(image->data + start, end - start, MADV_DONTNEED))
+    return end;
+  return start;
+}
+
+bool startThread(worker_thread* thread, void* (*function)(void*), void* arg) {
+  return !pthread_create(thread, NULL, function, arg);
+}
+
+void joinThread(worker_thread thread) {
+  pthread_join(thread, NULL);
+}
+
+void initMutex(worker_mutex* mutex) {
+  pthread_mutex_init(mutex, NULL);
+}
+
+void lockMutex(worker_mutex* mutex) {
+  pthread_mutex_lock(mutex);
+}
+
+void unlockMutex(worker_mutex* mutex) {
+  pthread_mutex_unlock(mutex);
+}
+
+void destroyMutex(worker_mutex* mutex) {
+  pthread_mutex_destroy(mutex);
+}
 #endif
@@ -0,0 +1,127 @@
+/*
+* kernel.h: the filters of kernel.c as a library
+*
+* Build kernel.c with -DKERNEL_LIBRARY to leave out main (see README.md).
+* The functions write into images the caller allocates and may be called
+* from several threads at once. Their scratch buffers come from a pool
+* shared by the whole process, which keeps up to 256 MiB of them between
+* calls for the next image of the same size; kernelReleaseMemory frees
+* them. Arguments are checked before anything runs and failures are
+* reported as KERNEL_ status codes.
+*/
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(_WIN32) && defined(KERNEL_SHARED)
+#define KERNEL_API __declspec(dllexport)
+#elif defined(__GNUC__) || defined(__clang__)
+#define KERNEL_API __attribute__((visibility("default")))
+#else
+#define KERNEL_API
+#endif
+
+//status codes
+#define KERNEL_OK 0
+#define KERNEL_INVALID_ARGUMENT 1
+#define KERNEL_WINDOW_TOO_BIG 2
+#define KERNEL_OUT_OF_MEMORY 3
+//gradient magnitude types
+#define GRADIENT_L2 0
+#define GRADIENT_L1 1
+#define GRADIENT_SQUARED 2
+//normalization types
+#define NORMALIZE_SLICE 0
+#define NORMALIZE_MINMAX 1
+#define NORMALIZE_NONE 2
+//padding types
+#define PADDING_ZERO 0
+#define PADDING_MIRROR 1
+#define PADDING_CONSTANT 2
+#define PADDING_REPLICATE 3
+#define PADDING_WRAP 4
+//window limits
+#define MAX_MEDIAN_WINDOW_SIZE 255
+#define MAX_CANNY_WINDOW_SIZE 11
+
+/*
+* Struct: padding_mode
+* --------------------------
+* how the pixels outside of an image are read (pre-padding) or how the
+* border around a filtered area is filled (post-padding)
+*
+* type: PADDING_ZERO, PADDING_CONSTANT (value), PADDING_REPLICATE (aaa|abc),
+* PADDING_MIRROR (cba|abc) or PADDING_WRAP (abc|abc)
+* value: pixel value of PADDING_CONSTANT
+*/
+typedef struct {
+  int type;
+  uint8_t value;
+} padding_mode;
+
+/*
+* Struct: kernelSettings
+* --------------------------
+*
+* padding: border handling, see padding_mode
+* normalizationType: 0 for slicing 1 for minMax
+* postPadding: apply padding after kernel if true before if false
+* coefficient: a float to be multiplied with the kernel
+*/
+typedef struct {
+  padding_mode padding;
+  int normalizationType;
+  bool postPadding;
+  float coefficient;
+} kernel_settings;
+
+/*
+* Struct: kernel_image
+* --------------------------
+* an 8-bit grayscale image stored row after row
+*
+* pixels: width*height pixel values
+* width: image width
+* height: image height
+*/
+typedef struct {
+  uint8_t* pixels;
+  int width;
+  int height;
+} kernel_image;
+
+/*
+* Struct: kernel_context
+* --------------------------
+* options of a library call, a NULL context runs on the calling thread only
+*
+* threadCount: number of threads an image is split over
+* tileColumns: width of the cache tiles of big masks and medians, 0 sizes them
+* from the L2 cache
+*/
+typedef struct {
+  int threadCount;
+  int tileColumns;
+} kernel_context;
+
+//filters, the output must have the size of the input and a buffer of its own.
+//median windows are at most MAX_MEDIAN_WINDOW_SIZE, canny smoothing windows
+//at most MAX_CANNY_WINDOW_SIZE
+KERNEL_API int kernelAverage(kernel_context*, kernel_image*, int, kernel_image*);
+KERNEL_API int kernelMedian(kernel_context*, kernel_image*, int, kernel_image*);
+KERNEL_API int kernelVerPrewitt(kernel_context*, kernel_image*, kernel_image*);
+KERNEL_API int kernelSobel(kernel_context*, kernel_image*, int, kernel_image*);
+KERNEL_API int kernelCanny(kernel_context*, kernel_image*, int, int, int, int, kernel_image*);
+KERNEL_API int kernelCustom(kernel_context*, kernel_image*, int*, int, kernel_settings*, kernel_image*);
+
+//raw values, the output of kernelConvolve has the size of the area the kernel fits in
+KERNEL_API int kernelConvolve(kernel_context*, kernel_image*, int*, int, int*);
+KERNEL_API int kernelMinMax(int*, kernel_image*);
+
+//helpers
+KERNEL_API const char* kernelStatusText(int);
+KERNEL_API void kernelReleaseMemory();
+
+#endif
@@ -1,12 +1,111 @@
+import ctypes
+import ctypes.util
+import os
 import numpy as np
-def conv2d(a, f):
+
+# the filters of c-projects/kernel.c built as a shared library (see README.md),
+# found through KERNELOP_LIBRARY, next to this file or on the library path.
+# ctypes releases the GIL during the calls, so they run alongside other threads
+class KernelImage(ctypes.Structure):
+    _fields_ = [('pixels', ctypes.c_void_p), ('width', ctypes.c_int), ('height', ctypes.c_int)]
+
+class KernelContext(ctypes.Structure):
+    _fields_ = [('threadCount', ctypes.c_int), ('tileColumns', ctypes.c_int)]
+
+def loadlibrary():
+    here = os.path.dirname(os.path.abspath(__file__))
+    paths = [os.environ.get('KERNELOP_LIBRARY')]
+    paths += [os.path.join(here, name) for name in ('libkernel.so', 'libkernel.dylib', 'kernel.dll')]
+    paths.append(ctypes.util.find_library('kernel'))
+    for path in paths:
+        if not path:
+            continue
+        try:
+            lib = ctypes.CDLL(path)
+            lib.kernelConvolve
+        except (OSError, AttributeError):
+            continue
+        image = ctypes.POINTER(KernelImage)
+        context = ctypes.POINTER(KernelContext)
+        values = ctypes.POINTER(ctypes.c_int)
+        lib.kernelConvolve.argtypes = [context, image, values, ctypes.c_int, values]
+        lib.kernelMedian.argtypes = [context, image, ctypes.c_int, image]
+        lib.kernelCanny.argtypes = [context, image, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, image]
+        lib.kernelMinMax.argtypes = [values, image]
+        lib.kernelStatusText.restype = ctypes.c_char_p
+        return lib
+    return None
+
+native = loadlibrary()
+
+def asimage(a):
+    # uint8 arrays that are already contiguous are passed without a copy
+    a = np.ascontiguousarray(a, dtype=np.uint8)
+    return a, KernelImage(a.ctypes.data, a.shape[1], a.shape[0])
+
+def check(status):
+    if status:
+        raise ValueError(native.kernelStatusText(status).decode())
+
+def isnative(a, f=None):
+    if native is None or a.ndim != 2 or a.dtype != np.uint8:
+        return False
+    if f is None:
+        return True
+    # the native sums are ints, kernels that could overflow them stay in numpy
+    return bool(f.ndim == 2 and f.shape[0] == f.shape[1] and f.shape[0] % 2
+                and a.shape[0] > f.shape[0] and a.shape[1] > f.shape[1] and np.array_equal(f, np.round(f))
+                and 255 * sum(abs(int(v)) for v in f.flat) <= np.iinfo(np.intc).max)
+
+def conv2d(a, f, threads=1):
+    # integer kernels on 8-bit images run natively and return int32 (np.intc)
+    # values, anything else runs with einsum and keeps the numpy result type
+    f = np.asarray(f)
+    if isnative(a, f):
+        a, image = asimage(a)
+        kernel = np.ascontiguousarray(f, dtype=np.intc)
+        out = np.empty(tuple(np.subtract(a.shape, f.shape) + 1), dtype=np.intc)
+        check(native.kernelConvolve(KernelContext(threads), image, kernel.ctypes.data_as(ctypes.POINTER(ctypes.c_int)),
+                                    f.shape[0], out.ctypes.data_as(ctypes.POINTER(ctypes.c_int))))
+        return out
     s = f.shape + tuple(np.subtract(a.shape, f.shape) + 1)
     strd = np.lib.stride_tricks.as_strided
     subM = strd(a, shape = s, strides = a.strides * 2)
     return np.einsum('ij,ijkl->kl', f, subM)
 
+def median(a, size=3, threads=1):
+    # size x size median of an 8-bit image, the border it doesn't fit in is 0.
+    # size is odd and at most 255
+    if not isnative(a):
+        raise RuntimeError('median needs the kernel library and an 8-bit image')
+    a, image = asimage(a)
+    out, result = asimage(np.empty_like(a))
+    check(native.kernelMedian(KernelContext(threads), image, size, result))
+    return out
+
+def canny(a, low=40, high=100, size=5, threads=1):
+    # edges of an 8-bit image as 255, binomial smoothing of size x size and
+    # hysteresis thresholds on the l2 magnitude of the prewitt gradients.
+    # 0 <= low <= high, thresholds above the largest magnitude (about 1082) find nothing
+    if not isnative(a):
+        raise RuntimeError('canny needs the kernel library and an 8-bit image')
+    a, image = asimage(a)
+    out, result = asimage(np.empty_like(a))
+    check(native.kernelCanny(KernelContext(threads), image, size, 0, low, high, result))
+    return out
+
+def normalize(data):
+    # scales integer values to [0-255] with the smallest becoming 0
+    if native is None:
+        data = data - np.min(data)
+        return np.uint8(minmaxnorm(data) if np.max(data) else data)
+    data = np.ascontiguousarray(data, dtype=np.intc)
+    out, result = asimage(np.empty(data.shape, dtype=np.uint8))
+    check(native.kernelMinMax(data.ctypes.data_as(ctypes.POINTER(ctypes.c_int)), result))
+    return out
+
 def minmaxnorm(data):
     max = np.max(data)
     min = np.min(data)
     scaleval = 255/(max-min)
-    return data * scaleval
\ No newline at end of file
+    return data * scaleval